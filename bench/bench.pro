@@ -0,0 +1,20 @@
+QT += core
+QT -= gui
+
+TARGET = snftp-bench
+TEMPLATE = app
+
+DEFINES += QT_DEPRECATED_WARNINGS
+DEFINES += QT_DISABLE_DEPRECATED_BEFORE=0x060000
+
+CONFIG += c++11 console
+CONFIG -= app_bundle
+
+include(../src/core.pri)
+
+SOURCES += \
+        loopback.cpp \
+        main.cpp
+
+HEADERS += \
+        loopback.h
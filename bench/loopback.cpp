@@ -0,0 +1,284 @@
+#include "loopback.h"
+
+#include <QCoreApplication>
+#include <QElapsedTimer>
+#include <QEventLoop>
+#include <QFile>
+#include <QFileInfo>
+#include <QTcpServer>
+#include <QTcpSocket>
+#include <QThread>
+
+#include <atomic>
+
+#ifdef Q_OS_UNIX
+#include <sys/resource.h>
+#endif
+
+#include "sendjob.h"
+#include "transferengine.h"
+#include "udpsocket.h"
+
+using namespace std;
+
+extern atomic<quint64> allocations;
+
+static double cpuSeconds()
+{
+#ifdef Q_OS_UNIX
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    return usage.ru_utime.tv_sec + usage.ru_stime.tv_sec + (usage.ru_utime.tv_usec + usage.ru_stime.tv_usec) / 1e6;
+#else
+    return 0;
+#endif
+}
+
+static void resetPeakRss()
+{
+#ifdef Q_OS_LINUX
+    QFile file("/proc/self/clear_refs");
+    if (file.open(QIODevice::WriteOnly))
+        file.write("5");
+#endif
+}
+
+static qint64 peakRss()
+{
+#ifdef Q_OS_LINUX
+    QFile file("/proc/self/status");
+    if (file.open(QIODevice::ReadOnly)) {
+        foreach (const QByteArray &line, file.readAll().split('\n'))
+            if (line.startsWith("VmHWM:"))
+                return line.mid(6).trimmed().split(' ').first().toLongLong() * 1024;
+    }
+#endif
+#ifdef Q_OS_UNIX
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+#ifdef Q_OS_MACOS
+    return usage.ru_maxrss;
+#else
+    return usage.ru_maxrss * 1024;
+#endif
+#else
+    return 0;
+#endif
+}
+
+LoopbackBench::LoopbackBench(const QString &workPath, int streams, const QStringList &transports, int fecGroup, qint64 sendWindow) :
+    workDir(QDir(workPath).filePath(QString("snftp-bench-%1").arg(QCoreApplication::applicationPid()))),
+    streams(streams),
+    transports(transports),
+    fecGroup(fecGroup),
+    sendWindow(sendWindow)
+{
+}
+
+LoopbackBench::~LoopbackBench()
+{
+    workDir.removeRecursively();
+}
+
+bool LoopbackBench::writeRandomFile(const QString &path, qint64 size)
+{
+    QFile file(path);
+    if (!file.open(QIODevice::WriteOnly))
+        return false;
+    QByteArray buffer(WRITE_SIZE, Qt::Uninitialized);
+    for (qint64 done = 0; done < size; done += WRITE_SIZE) {
+        const qint64 len = qMin(size - done, static_cast<qint64>(WRITE_SIZE));
+        randombytes_buf(buffer.data(), static_cast<size_t>(len));
+        if (file.write(buffer.constData(), len) != len)
+            return false;
+    }
+    return true;
+}
+
+bool LoopbackBench::run(QTextStream &out, const QList<int> &fileSizes, const QList<int> &frameSizes, const QList<int> &smallFileCounts)
+{
+    if (!workDir.mkpath(".")) {
+        out << "error,unable to create " << workDir.path() << '\n';
+        return false;
+    }
+
+    out << "case,transport,files,bytes,frame_kib,streams,seconds,mb_s,frames_s,cpu_s_per_gb,peak_rss_mib,allocations,allocations_per_mb,"
+           "retransmits,fec_recovered" << '\n';
+    foreach (int size, fileSizes) {
+        const QString path(workDir.filePath(QString("file-%1MiB.bin").arg(size)));
+        if (!writeRandomFile(path, static_cast<qint64>(size) * 1024 * 1024)) {
+            out << "error,unable to write " << path << '\n';
+            return false;
+        }
+        foreach (int frameSize, frameSizes)
+            foreach (const QString &transport, transports)
+                if (!runCase(out, QString("file-%1MiB").arg(size), QStringList(path), QStringList(QFileInfo(path).fileName()),
+                             static_cast<qint64>(size) * 1024 * 1024, frameSize * 1024, transport))
+                    return false;
+        QFile::remove(path);
+    }
+
+    foreach (int count, smallFileCounts) {
+        const QString dirPath(workDir.filePath(QString("small-%1").arg(count)));
+        QDir().mkpath(dirPath);
+        for (int i = 0; i < count; ++i) {
+            if (!writeRandomFile(QDir(dirPath).filePath(QString("%1.bin").arg(i)), SMALL_FILE_SIZE)) {
+                out << "error,unable to write " << dirPath << '\n';
+                return false;
+            }
+        }
+        QStringList paths;
+        QStringList filenames;
+        SendJob::collect(dirPath, &paths, &filenames);
+        foreach (int frameSize, frameSizes)
+            foreach (const QString &transport, transports)
+                if (!runCase(out, QString("small-%1x%2KiB").arg(count).arg(SMALL_FILE_SIZE / 1024), paths, filenames,
+                             static_cast<qint64>(count) * SMALL_FILE_SIZE, frameSize * 1024, transport))
+                    return false;
+        QDir(dirPath).removeRecursively();
+    }
+    return true;
+}
+
+bool LoopbackBench::runCase(QTextStream &out, const QString &name, const QStringList &paths, const QStringList &filenames,
+                            qint64 bytes, int frameSize, const QString &transport)
+{
+    const bool udp = transport == "udp";
+    const QString recvPath(workDir.filePath("recv"));
+    QDir(recvPath).removeRecursively();
+    QDir().mkpath(recvPath);
+
+    TransferOptions options;
+    options.client = false;
+    options.legacyProtocol = false;
+    options.maxFrameSize = frameSize;
+    options.streams = udp ? 1 : streams;
+    options.compression = false;
+    options.delta = false;
+    options.plaintext = false;
+    options.preallocate = false;
+    options.sendWindow = sendWindow;
+    options.recvWindow = 32 * 1024 * 1024;
+    options.cryptoThreads = QThread::idealThreadCount();
+    options.ioDepth = DiskIo::DEFAULT_QUEUE_DEPTH;
+    options.durability = DiskIo::DURABILITY_NONE;
+    options.metrics = false;
+    options.metricsInterval = 0;
+
+    QTcpServer *server = nullptr;
+    UdpSocket *serverSocket = nullptr;
+    UdpSocket *clientSocket = nullptr;
+    QTcpSocket *socket;
+    quint16 port;
+    if (udp) {
+        serverSocket = new UdpSocket;
+        serverSocket->setFecGroup(fecGroup);
+        if (!serverSocket->listen(QHostAddress::LocalHost, 0)) {
+            out << "error,unable to listen: " << serverSocket->errorString() << '\n';
+            delete serverSocket;
+            return false;
+        }
+        port = serverSocket->localPort();
+        clientSocket = new UdpSocket;
+        clientSocket->setFecGroup(fecGroup);
+        socket = clientSocket;
+    } else {
+        server = new QTcpServer;
+        if (!server->listen(QHostAddress::LocalHost, 0)) {
+            out << "error,unable to listen: " << server->errorString() << '\n';
+            delete server;
+            return false;
+        }
+        port = server->serverPort();
+        socket = new QTcpSocket;
+    }
+    TransferEngine *sender = nullptr;
+    TransferEngine *receiver = nullptr;
+    QEventLoop loop;
+    QString error;
+    int received = 0;
+    quint64 frames = 0;
+
+    const auto startReceiver = [&](QTcpSocket *peer) {
+        receiver = new TransferEngine(recvPath, peer, server, options);
+        QObject::connect(receiver, &TransferEngine::recvJobFinished, &loop, [&]() {
+            if (++received == paths.length())
+                loop.quit();
+        });
+        QObject::connect(receiver, &TransferEngine::errorOccurred, &loop, [&](const QString &message) {
+            error = message;
+            loop.quit();
+        });
+        receiver->start();
+    };
+    if (udp) {
+        QObject::connect(serverSocket, &QTcpSocket::connected, &loop, [&]() {
+            QObject::disconnect(serverSocket, &QTcpSocket::connected, &loop, nullptr);
+            startReceiver(serverSocket);
+        });
+    } else {
+        QObject::connect(server, &QTcpServer::newConnection, &loop, [&]() {
+            QObject::disconnect(server, &QTcpServer::newConnection, &loop, nullptr);
+            startReceiver(server->nextPendingConnection());
+        });
+    }
+    QObject::connect(socket, &QTcpSocket::connected, &loop, [&]() {
+        QObject::disconnect(socket, nullptr, &loop, nullptr);
+        TransferOptions clientOptions(options);
+        clientOptions.client = true;
+        sender = new TransferEngine(workDir.path(), socket, nullptr, clientOptions);
+        QObject::connect(sender, &TransferEngine::sendStatsChanged, &loop, [&](const SendStats &stats) {
+            frames = stats.frames;
+        });
+        QObject::connect(sender, &TransferEngine::errorOccurred, &loop, [&](const QString &message) {
+            error = message;
+            loop.quit();
+        });
+        sender->start();
+        sender->addSendJobs(paths, filenames);
+    });
+    QObject::connect(socket, QOverload<QAbstractSocket::SocketError>::of(&QTcpSocket::error), &loop, [&]() {
+        error = socket->errorString();
+        loop.quit();
+    });
+
+    resetPeakRss();
+    const quint64 allocationsBefore = allocations;
+    const double cpuBefore = cpuSeconds();
+    QElapsedTimer timer;
+    timer.start();
+    socket->connectToHost(QHostAddress::LocalHost, port);
+    loop.exec();
+    const double seconds = qMax(timer.nsecsElapsed(), static_cast<qint64>(1)) / 1e9;
+    const double cpu = cpuSeconds() - cpuBefore;
+    const quint64 allocationCount = allocations - allocationsBefore;
+    const quint64 retransmits = clientSocket != nullptr ? clientSocket->getStats().retransmits : 0;
+    const quint64 fecRecovered = serverSocket != nullptr ? serverSocket->getStats().fecRecovered : 0;
+
+    delete sender;
+    if (sender == nullptr)
+        delete socket;
+    delete receiver;
+    if (receiver == nullptr) {
+        delete server;
+        delete serverSocket;
+    }
+    QDir(recvPath).removeRecursively();
+
+    if (!error.isEmpty()) {
+        out << "error," << name << ',' << error << '\n';
+        return false;
+    }
+    const double megabytes = bytes / 1e6;
+    out << name << ',' << transport << ',' << paths.length() << ',' << bytes << ',' << frameSize / 1024 << ',' << options.streams << ','
+        << QString::number(seconds, 'f', 3) << ','
+        << QString::number(megabytes / seconds, 'f', 1) << ','
+        << QString::number(frames / seconds, 'f', 0) << ','
+        << QString::number(cpu / qMax(bytes / 1e9, 1e-9), 'f', 2) << ','
+        << QString::number(peakRss() / 1048576.0, 'f', 1) << ','
+        << allocationCount << ','
+        << QString::number(allocationCount / qMax(megabytes, 1e-9), 'f', 1) << ','
+        << retransmits << ',' << fecRecovered << '\n';
+    out.flush();
+    return true;
+}
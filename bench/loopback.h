@@ -0,0 +1,29 @@
+#ifndef LOOPBACK_H
+#define LOOPBACK_H
+
+#include <QDir>
+#include <QList>
+#include <QStringList>
+#include <QTextStream>
+
+class LoopbackBench {
+public:
+    LoopbackBench(const QString &workPath, int streams, const QStringList &transports, int fecGroup, qint64 sendWindow);
+    ~LoopbackBench();
+    bool run(QTextStream &out, const QList<int> &fileSizes, const QList<int> &frameSizes, const QList<int> &smallFileCounts);
+private:
+    enum {
+        SMALL_FILE_SIZE = 4 * 1024,
+        WRITE_SIZE = 1024 * 1024
+    };
+    QDir workDir;
+    int streams;
+    QStringList transports;
+    int fecGroup;
+    qint64 sendWindow;
+    bool writeRandomFile(const QString &path, qint64 size);
+    bool runCase(QTextStream &out, const QString &name, const QStringList &paths, const QStringList &filenames,
+                 qint64 bytes, int frameSize, const QString &transport);
+};
+
+#endif // LOOPBACK_H
@@ -0,0 +1,295 @@
+#include <QCommandLineParser>
+#include <QCoreApplication>
+#include <QDir>
+#include <QElapsedTimer>
+#include <QTextStream>
+#include <QThread>
+
+#include <atomic>
+#include <cstring>
+
+#include "bufferpool.h"
+#include "crypto.h"
+#include "cryptopipeline.h"
+#include "loopback.h"
+#include "protocol.h"
+#include "ringbuffer.h"
+
+std::atomic<quint64> allocations(0);
+static std::atomic<quint64> bytesAllocated(0);
+
+#ifdef __GLIBC__
+extern "C" void *__libc_malloc(size_t size);
+extern "C" void *__libc_realloc(void *ptr, size_t size);
+
+extern "C" void *malloc(size_t size)
+{
+    allocations.fetch_add(1, std::memory_order_relaxed);
+    bytesAllocated.fetch_add(size, std::memory_order_relaxed);
+    return __libc_malloc(size);
+}
+
+extern "C" void *realloc(void *ptr, size_t size)
+{
+    allocations.fetch_add(1, std::memory_order_relaxed);
+    bytesAllocated.fetch_add(size, std::memory_order_relaxed);
+    return __libc_realloc(ptr, size);
+}
+#endif
+
+static double benchPipeline(CryptoPipeline::Direction direction, int workers, const QByteArray &frame, int frames)
+{
+    CryptoPipeline pipeline(direction, workers);
+    BufferPool pool(frame.length());
+    QElapsedTimer timer;
+    int submitted = 0;
+    int done = 0;
+
+    timer.start();
+    while (done < frames) {
+        while (submitted < frames && !pipeline.isFull()) {
+            QByteArray buffer(pool.acquire());
+            memcpy(buffer.data(), frame.constData(), static_cast<size_t>(frame.length()));
+            if (direction == CryptoPipeline::ENCRYPT)
+                pipeline.submit(buffer, 0, frame.length() - Crypto::OVERHEAD);
+            else
+                pipeline.submit(buffer, 0, frame.length());
+            ++submitted;
+        }
+        QCoreApplication::processEvents(QEventLoop::WaitForMoreEvents);
+        while (pipeline.hasResult()) {
+            CryptoFrame result(pipeline.takeResult());
+            pool.release(result.buffer);
+            ++done;
+        }
+    }
+
+    return static_cast<double>(frame.length()) * frames / 1048576.0 / (timer.nsecsElapsed() / 1e9);
+}
+
+static void legacyRoundTrip(const QByteArray &plainText)
+{
+    static const unsigned char key[crypto_aead_chacha20poly1305_IETF_KEYBYTES] = {};
+    QByteArray nonce(Crypto::NONCE_BYTES, 0);
+    randombytes_buf(nonce.data(), static_cast<size_t>(nonce.length()));
+    QByteArray ret(plainText.length() + Crypto::TAG_BYTES, 0);
+    unsigned long long cipherTextLen;
+    crypto_aead_chacha20poly1305_ietf_encrypt(reinterpret_cast<unsigned char *>(ret.data()), &cipherTextLen,
+                                              reinterpret_cast<const unsigned char *>(plainText.data()), static_cast<unsigned long long>(plainText.length()),
+                                              nullptr, 0, nullptr, reinterpret_cast<unsigned char *>(nonce.data()),
+                                              key);
+    QByteArray cipherText(nonce + ret.left(static_cast<int>(cipherTextLen)));
+    QByteArray lenBytes(2, 0);
+    cipherText = lenBytes + cipherText;
+
+    QByteArray recvBuffer(cipherText);
+    const QByteArray sealed(recvBuffer.mid(2, cipherText.length() - 2));
+    recvBuffer = recvBuffer.mid(cipherText.length());
+    QByteArray recvNonce(sealed.left(Crypto::NONCE_BYTES));
+    QByteArray cipher(sealed.mid(Crypto::NONCE_BYTES));
+    QByteArray plain(cipher.length(), 0);
+    unsigned long long plainTextLen;
+    crypto_aead_chacha20poly1305_ietf_decrypt(reinterpret_cast<unsigned char *>(plain.data()), &plainTextLen, nullptr,
+                                              reinterpret_cast<unsigned char *>(cipher.data()), static_cast<unsigned long long>(cipher.length()),
+                                              nullptr, 0, reinterpret_cast<unsigned char *>(recvNonce.data()),
+                                              key);
+    plain = plain.left(static_cast<int>(plainTextLen));
+}
+
+static void pooledRoundTrip(BufferPool &pool, int plainTextLen)
+{
+    QByteArray buffer(pool.acquire());
+    const int sealedLen = Crypto::seal(buffer.data() + 2, plainTextLen);
+    Crypto::open(buffer.data() + 2, sealedLen);
+    pool.release(buffer);
+}
+
+static void benchAllocations(QTextStream &out, int frameSize, int frames)
+{
+    const QByteArray plainText(frameSize, 'x');
+    BufferPool pool(2 + Crypto::OVERHEAD + frameSize);
+
+    quint64 allocationsBefore = allocations;
+    quint64 bytesBefore = bytesAllocated;
+    for (int i = 0; i < frames; ++i)
+        legacyRoundTrip(plainText);
+    out << "legacy," << static_cast<double>(allocations - allocationsBefore) / frames << ','
+        << static_cast<double>(bytesAllocated - bytesBefore) / frames << '\n';
+
+    allocationsBefore = allocations;
+    bytesBefore = bytesAllocated;
+    for (int i = 0; i < frames; ++i)
+        pooledRoundTrip(pool, frameSize);
+    out << "pooled," << static_cast<double>(allocations - allocationsBefore) / frames << ','
+        << static_cast<double>(bytesAllocated - bytesBefore) / frames << '\n';
+}
+
+static void benchCipher(QTextStream &out, const QString &name, bool aes, int frameSize, int frames)
+{
+    QByteArray key(Crypto::KEY_BYTES, 0);
+    randombytes_buf(key.data(), static_cast<size_t>(key.length()));
+    QSharedPointer<crypto_aead_aes256gcm_state> state;
+    if (aes)
+        state = Crypto::expandAesKey(key);
+    QByteArray buffer(frameSize + Crypto::TAG_BYTES, 'x');
+    QElapsedTimer timer;
+    qint64 sealNsecs = 0;
+    qint64 openNsecs = 0;
+
+    for (int i = 0; i < frames; ++i) {
+        timer.start();
+        const int sealedLen = aes ? Crypto::sealAes(buffer.data(), frameSize, state.data(), static_cast<quint64>(i))
+                                  : Crypto::seal(buffer.data(), frameSize, key, static_cast<quint64>(i));
+        sealNsecs += timer.nsecsElapsed();
+        timer.start();
+        if ((aes ? Crypto::openAes(buffer.data(), sealedLen, state.data(), static_cast<quint64>(i))
+                 : Crypto::open(buffer.data(), sealedLen, key, static_cast<quint64>(i))) != frameSize) {
+            out << name << ",failed,failed" << '\n';
+            return;
+        }
+        openNsecs += timer.nsecsElapsed();
+    }
+
+    const double bytes = static_cast<double>(frameSize) * frames;
+    out << name << ',' << QString::number(bytes / sealNsecs, 'f', 2) << ',' << QString::number(bytes / openNsecs, 'f', 2) << '\n';
+}
+
+static void benchParser(QTextStream &out, int frameSize, qint64 totalBytes)
+{
+    // The receive path of Connection without the socket and the crypto: frames
+    // arrive in socket-sized reads, go through the ring and into pooled buffers.
+    const int readSize = 64 * 1024;
+    const int frameCount = static_cast<int>(qMax(totalBytes / frameSize, static_cast<qint64>(1)));
+    QByteArray stream(Protocol::V2_HEADER_BYTES + frameSize, 'x');
+    Protocol::putUInt32(stream.data(), static_cast<quint32>(frameSize));
+    RingBuffer ring(4 * (Protocol::V2_HEADER_BYTES + frameSize));
+    BufferPool pool(frameSize);
+    qint64 streamOffset = 0;
+    int parsed = 0;
+    const quint64 allocationsBefore = allocations;
+    QElapsedTimer timer;
+    timer.start();
+
+    while (parsed < frameCount) {
+        qint64 maxLen;
+        char *data = ring.writePointer(&maxLen);
+        maxLen = qMin(maxLen, static_cast<qint64>(readSize));
+        for (qint64 done = 0; done < maxLen;) {
+            const qint64 len = qMin(maxLen - done, stream.length() - streamOffset);
+            memcpy(data + done, stream.constData() + streamOffset, static_cast<size_t>(len));
+            done += len;
+            streamOffset = (streamOffset + len) % stream.length();
+        }
+        ring.commit(maxLen);
+
+        char lenBytes[Protocol::V2_HEADER_BYTES];
+        while (parsed < frameCount && ring.peek(0, lenBytes, Protocol::V2_HEADER_BYTES)) {
+            const qint64 len = Protocol::getUInt32(lenBytes);
+            if (ring.getSize() < Protocol::V2_HEADER_BYTES + len)
+                break;
+            QByteArray buffer(pool.acquire());
+            ring.peek(Protocol::V2_HEADER_BYTES, buffer.data(), len);
+            ring.consume(Protocol::V2_HEADER_BYTES + len);
+            pool.release(buffer);
+            ++parsed;
+        }
+    }
+
+    const double seconds = qMax(timer.nsecsElapsed(), static_cast<qint64>(1)) / 1e9;
+    out << frameSize / 1024 << ',' << QString::number(static_cast<double>(frameSize) * frameCount / 1e6 / seconds, 'f', 1) << ','
+        << QString::number(frameCount / seconds, 'f', 0) << ','
+        << static_cast<double>(allocations - allocationsBefore) / frameCount << '\n';
+}
+
+static QList<int> parseList(const QString &value)
+{
+    QList<int> ret;
+    foreach (const QString &item, value.split(',')) {
+        const int number = item.trimmed().toInt();
+        if (number > 0)
+            ret.append(number);
+    }
+    return ret;
+}
+
+static void runMicro(QTextStream &out)
+{
+    const int frameSize = 64000;
+    const int frames = 4096;
+    const QByteArray plainText(frameSize + Crypto::OVERHEAD, 'x');
+    const QByteArray cipherText(Crypto::encrypt(QByteArray(frameSize, 'x')));
+
+    out << "workers,encrypt_mib_s,decrypt_mib_s" << '\n';
+    for (int workers = 1; workers <= QThread::idealThreadCount(); ++workers) {
+        const double encrypt = benchPipeline(CryptoPipeline::ENCRYPT, workers, plainText, frames);
+        const double decrypt = benchPipeline(CryptoPipeline::DECRYPT, workers, cipherText, frames);
+        out << workers << ',' << QString::number(encrypt, 'f', 1) << ',' << QString::number(decrypt, 'f', 1) << '\n';
+    }
+
+    out << '\n' << "path,allocations_per_frame,bytes_allocated_per_frame" << '\n';
+    benchAllocations(out, frameSize, frames);
+
+    out << '\n' << "cipher,seal_gb_s,open_gb_s" << '\n';
+    benchCipher(out, "chacha20-poly1305", false, 1024 * 1024, 1024);
+    if (Crypto::isAesAvailable())
+        benchCipher(out, "aes256-gcm", true, 1024 * 1024, 1024);
+    else
+        out << "aes256-gcm,unavailable,unavailable" << '\n';
+
+    out << '\n' << "parser_frame_kib,mb_s,frames_s,allocations_per_frame" << '\n';
+    foreach (int size, QList<int>() << 64 << 1024 << 4096)
+        benchParser(out, size * 1024, 1024LL * 1024 * 1024);
+    out.flush();
+}
+
+int main(int argc, char *argv[])
+{
+    Crypto::init();
+    QCoreApplication a(argc, argv);
+    QTextStream out(stdout);
+    Crypto::setPassword("snftp-bench");
+
+    QCommandLineParser parser;
+    parser.setApplicationDescription("Benchmarks for snftp. Results are printed as CSV sections separated by blank lines.");
+    parser.addHelpOption();
+    const QCommandLineOption suiteOption("suite", "micro, transfer or all.", "suite", "all");
+    const QCommandLineOption sizesOption("sizes", "File sizes in MiB for the transfer suite.", "list", "1,64,256");
+    const QCommandLineOption frameSizesOption("frame-sizes", "Frame sizes in KiB for the transfer suite.", "list", "64,1024,4096");
+    const QCommandLineOption smallFilesOption("small-files", "Counts of 4 KiB files for the transfer suite.", "list", "1000");
+    const QCommandLineOption streamsOption("streams", "Number of TCP streams for the transfer suite.", "count", "1");
+    const QCommandLineOption transportsOption("transports", "Transports for the transfer suite, tcp and/or udp.", "list", "tcp");
+    const QCommandLineOption fecOption("fec", "Parity group size in packets for the udp transport, 0 to disable.", "packets", "0");
+    const QCommandLineOption sendWindowOption("send-window", "Send window in MiB for the transfer suite.", "MiB", "4");
+    const QCommandLineOption workDirOption("work-dir", "Directory for the transfer suite's files.", "directory", QDir::tempPath());
+    parser.addOptions({suiteOption, sizesOption, frameSizesOption, smallFilesOption, streamsOption, transportsOption, fecOption,
+                       sendWindowOption, workDirOption});
+    parser.process(a);
+
+    const QString suite(parser.value(suiteOption));
+    if (suite != "micro" && suite != "transfer" && suite != "all") {
+        QTextStream(stderr) << "snftp-bench: unknown suite: " << suite << '\n';
+        return 1;
+    }
+    QStringList transports;
+    foreach (const QString &item, parser.value(transportsOption).split(',')) {
+        const QString transport(item.trimmed());
+        if (transport != "tcp" && transport != "udp") {
+            QTextStream(stderr) << "snftp-bench: unknown transport: " << transport << '\n';
+            return 1;
+        }
+        transports.append(transport);
+    }
+    if (suite != "transfer")
+        runMicro(out);
+    if (suite != "micro") {
+        if (suite == "all")
+            out << '\n';
+        LoopbackBench loopback(parser.value(workDirOption), qMax(parser.value(streamsOption).toInt(), 1), transports,
+                               parser.value(fecOption).toInt(), qMax(parser.value(sendWindowOption).toLongLong(), 1LL) * 1024 * 1024);
+        if (!loopback.run(out, parseList(parser.value(sizesOption)), parseList(parser.value(frameSizesOption)),
+                          parseList(parser.value(smallFilesOption))))
+            return 1;
+    }
+
+    return 0;
+}
@@ -0,0 +1,282 @@
+#include "clicontroller.h"
+
+#include <QCoreApplication>
+#include <QJsonDocument>
+#include <QSaveFile>
+
+#include "udpsocket.h"
+
+CliController::CliController(const CliOptions &options, QObject *parent) :
+    QObject(parent),
+    options(options),
+    out(stdout),
+    server(nullptr),
+    socket(nullptr),
+    engine(nullptr),
+    peerServer(nullptr),
+    progressTimer(new QTimer(this)),
+    lastProgressMsecs(0),
+    lastBytesSent(0),
+    lastBytesReceived(0)
+{
+    connect(progressTimer, &QTimer::timeout, this, &CliController::progressTimeout);
+}
+
+bool CliController::start()
+{
+    if (options.maxPeers > 0)
+        return serve();
+    if (!options.transfer.client)
+        return listen();
+
+    if (options.udp) {
+        UdpSocket *udpSocket = new UdpSocket(this);
+        udpSocket->setFecGroup(options.fecGroup);
+        socket = udpSocket;
+    } else {
+        socket = new QTcpSocket(this);
+    }
+    connect(socket, &QTcpSocket::connected, this, &CliController::socketConnected);
+    connect(socket, QOverload<QAbstractSocket::SocketError>::of(&QTcpSocket::error), this, &CliController::socketErrored);
+    socket->connectToHost(options.address, options.port);
+    return true;
+}
+
+void CliController::writeEvent(const QString &event, QJsonObject fields)
+{
+    fields.insert("event", event);
+    out << QJsonDocument(fields).toJson(QJsonDocument::Compact) << '\n';
+    out.flush();
+}
+
+void CliController::writeMetrics()
+{
+    if (!options.transfer.metrics)
+        return;
+    const MetricsSnapshot metrics(engine->getMetrics());
+    if (options.metricsEvents)
+        writeEvent("metrics", Metrics::toJson(metrics));
+    if (options.metricsPath.isEmpty())
+        return;
+    // Replace the file atomically so that a scraper never sees half of it.
+    QSaveFile file(options.metricsPath);
+    if (!file.open(QIODevice::WriteOnly) || file.write(Metrics::toPrometheus(metrics).toUtf8()) < 0 || !file.commit())
+        QTextStream(stderr) << "snftp-cli: unable to write " << options.metricsPath << '\n';
+}
+
+bool CliController::listen()
+{
+    if (options.udp) {
+        UdpSocket *udpSocket = new UdpSocket(this);
+        udpSocket->setFecGroup(options.fecGroup);
+        if (!udpSocket->listen(QHostAddress(options.address), options.port)) {
+            writeEvent("error", {{"message", QString("Unable to listen on %1:%2: %3").arg(options.address).arg(options.port).arg(udpSocket->errorString())}});
+            delete udpSocket;
+            return false;
+        }
+        socket = udpSocket;
+        connect(socket, &QTcpSocket::connected, this, &CliController::socketConnected);
+        connect(socket, QOverload<QAbstractSocket::SocketError>::of(&QTcpSocket::error), this, &CliController::socketErrored);
+        writeEvent("listening", {{"address", options.address}, {"port", options.port}, {"transport", "udp"}});
+        return true;
+    }
+
+    server = new QTcpServer(this);
+    if (!server->listen(QHostAddress(options.address), options.port)) {
+        writeEvent("error", {{"message", QString("Unable to listen on %1:%2: %3").arg(options.address).arg(options.port).arg(server->errorString())}});
+        delete server;
+        server = nullptr;
+        return false;
+    }
+    connect(server, &QTcpServer::newConnection, this, &CliController::serverNewConnection);
+    writeEvent("listening", {{"address", options.address}, {"port", options.port}});
+    return true;
+}
+
+bool CliController::serve()
+{
+    peerServer = new PeerServer(options.savePath, options.transfer, options.workers, options.maxPeers, options.connectionMemory, this);
+    if (!peerServer->listen(QHostAddress(options.address), options.port)) {
+        writeEvent("error", {{"message", QString("Unable to listen on %1:%2: %3").arg(options.address).arg(options.port).arg(peerServer->getErrorString())}});
+        return false;
+    }
+    connect(peerServer, &PeerServer::sessionStarted, this, &CliController::peerSessionStarted);
+    connect(peerServer, &PeerServer::sessionFinished, this, &CliController::peerSessionFinished);
+    connect(peerServer, &PeerServer::recvJobStarted, this, &CliController::peerRecvJobStarted);
+    connect(peerServer, &PeerServer::recvJobFinished, this, &CliController::peerRecvJobFinished);
+    connect(peerServer, &PeerServer::peerRejected, this, &CliController::peerRejected);
+    writeEvent("listening", {{"address", options.address}, {"port", options.port}, {"maxPeers", options.maxPeers}});
+    return true;
+}
+
+void CliController::startEngine()
+{
+    writeEvent("connected", {{"address", socket->peerAddress().toString()}, {"port", socket->peerPort()},
+                             {"transport", options.udp ? "udp" : "tcp"}});
+    engine = new TransferEngine(options.savePath, socket, server, options.transfer, this);
+    socket = nullptr;
+    server = nullptr;
+    recvFilenames.clear();
+
+    connect(engine, &TransferEngine::sendJobStarted, this, &CliController::engineSendJobStarted);
+    connect(engine, &TransferEngine::sendJobFinished, this, &CliController::engineSendJobFinished);
+    connect(engine, &TransferEngine::recvJobStarted, this, &CliController::engineRecvJobStarted);
+    connect(engine, &TransferEngine::recvJobFinished, this, &CliController::engineRecvJobFinished);
+    connect(engine, &TransferEngine::protocolNegotiated, this, &CliController::engineProtocolNegotiated);
+    connect(engine, &TransferEngine::idle, this, &CliController::engineIdle);
+    connect(engine, &TransferEngine::errorOccurred, this, &CliController::engineErrorOccurred);
+    connect(engine, &TransferEngine::disconnected, this, &CliController::engineDisconnected);
+
+    elapsed.start();
+    lastProgressMsecs = 0;
+    lastBytesSent = 0;
+    lastBytesReceived = 0;
+    if (options.progressInterval > 0)
+        progressTimer->start(options.progressInterval);
+
+    engine->start();
+    if (!options.paths.isEmpty())
+        engine->addSendJobs(options.paths, options.filenames);
+}
+
+void CliController::finishSession(ExitCode exitCode)
+{
+    progressTimer->stop();
+    writeMetrics();
+    const double seconds = qMax(elapsed.elapsed(), static_cast<qint64>(1)) / 1000.0;
+    writeEvent("finished", {{"status", exitCode},
+                            {"bytesSent", engine->getBytesSent()},
+                            {"bytesReceived", engine->getBytesReceived()},
+                            {"seconds", seconds},
+                            {"sendRate", engine->getBytesSent() / seconds},
+                            {"receiveRate", engine->getBytesReceived() / seconds}});
+    engine->disconnect(this);
+    engine->deleteLater();
+    engine = nullptr;
+
+    if (!options.daemon)
+        QCoreApplication::exit(exitCode);
+    else if (!listen())
+        QCoreApplication::exit(NETWORK_ERROR);
+}
+
+void CliController::serverNewConnection()
+{
+    socket = server->nextPendingConnection();
+    disconnect(server, &QTcpServer::newConnection, this, &CliController::serverNewConnection);
+    startEngine();
+}
+
+void CliController::socketConnected()
+{
+    disconnect(socket, &QTcpSocket::connected, this, &CliController::socketConnected);
+    disconnect(socket, QOverload<QAbstractSocket::SocketError>::of(&QTcpSocket::error),
+               this, &CliController::socketErrored);
+    startEngine();
+}
+
+void CliController::socketErrored()
+{
+    writeEvent("error", {{"message", QString("Failed to connect: %1").arg(socket->errorString())}});
+    QCoreApplication::exit(NETWORK_ERROR);
+}
+
+void CliController::progressTimeout()
+{
+    const qint64 msecs = elapsed.elapsed();
+    const double seconds = qMax(msecs - lastProgressMsecs, static_cast<qint64>(1)) / 1000.0;
+    const qint64 bytesSent = engine->getBytesSent();
+    const qint64 bytesReceived = engine->getBytesReceived();
+    writeEvent("progress", {{"bytesSent", bytesSent},
+                            {"bytesReceived", bytesReceived},
+                            {"sendRate", (bytesSent - lastBytesSent) / seconds},
+                            {"receiveRate", (bytesReceived - lastBytesReceived) / seconds},
+                            {"sendStalledMs", engine->getCreditStallMsecs()},
+                            {"receiveStalledMs", engine->getWindowStallMsecs()}});
+    lastProgressMsecs = msecs;
+    lastBytesSent = bytesSent;
+    lastBytesReceived = bytesReceived;
+    writeMetrics();
+}
+
+void CliController::engineSendJobStarted(int index)
+{
+    writeEvent("send-started", {{"path", options.paths[index]}, {"filename", options.filenames[index]}});
+}
+
+void CliController::engineSendJobFinished(int index)
+{
+    writeEvent("send-finished", {{"path", options.paths[index]}, {"filename", options.filenames[index]}});
+}
+
+void CliController::engineRecvJobStarted(int id, const QString &filename)
+{
+    recvFilenames.insert(id, filename);
+    writeEvent("receive-started", {{"filename", filename}});
+}
+
+void CliController::engineRecvJobFinished(int id)
+{
+    writeEvent("receive-finished", {{"filename", recvFilenames.take(id)}});
+}
+
+void CliController::engineProtocolNegotiated(int version, int frameSize, int streams, bool compression)
+{
+    writeEvent("negotiated", {{"version", version}, {"frameSize", frameSize}, {"streams", streams}, {"compression", compression}});
+}
+
+void CliController::engineIdle()
+{
+    if (options.paths.isEmpty())
+        return;
+    engine->shutdown();
+    finishSession(SUCCESS);
+}
+
+void CliController::engineErrorOccurred(const QString &message)
+{
+    writeEvent("error", {{"message", message}});
+    finishSession(TRANSFER_ERROR);
+}
+
+void CliController::engineDisconnected()
+{
+    if (engine->isIdle()) {
+        finishSession(SUCCESS);
+        return;
+    }
+    if (engine->isUnconfirmed()) {
+        writeEvent("error", {{"message", "The peer disconnected before confirming every file."}});
+        finishSession(TRANSFER_ERROR);
+        return;
+    }
+    writeEvent("error", {{"message", "The peer disconnected in the middle of a transfer."}});
+    finishSession(INTERRUPTED);
+}
+
+void CliController::peerSessionStarted(int session, const QString &address, quint16 port, const QString &savePath)
+{
+    writeEvent("connected", {{"session", session}, {"address", address}, {"port", port}, {"savePath", savePath}});
+}
+
+void CliController::peerSessionFinished(int session, bool ok, const QString &message, qint64 bytesReceived)
+{
+    if (!ok)
+        writeEvent("error", {{"session", session}, {"message", message}});
+    writeEvent("finished", {{"session", session}, {"status", ok ? SUCCESS : TRANSFER_ERROR}, {"bytesReceived", bytesReceived}});
+}
+
+void CliController::peerRecvJobStarted(int session, const QString &filename)
+{
+    writeEvent("receive-started", {{"session", session}, {"filename", filename}});
+}
+
+void CliController::peerRecvJobFinished(int session, const QString &filename)
+{
+    writeEvent("receive-finished", {{"session", session}, {"filename", filename}});
+}
+
+void CliController::peerRejected(const QString &address, const QString &reason)
+{
+    writeEvent("rejected", {{"address", address}, {"message", reason}});
+}
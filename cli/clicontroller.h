@@ -0,0 +1,85 @@
+#ifndef CLICONTROLLER_H
+#define CLICONTROLLER_H
+
+#include <QElapsedTimer>
+#include <QHash>
+#include <QJsonObject>
+#include <QObject>
+#include <QStringList>
+#include <QTcpServer>
+#include <QTcpSocket>
+#include <QTextStream>
+#include <QTimer>
+
+#include "peerserver.h"
+#include "transferengine.h"
+
+struct CliOptions {
+    QString address;
+    quint16 port;
+    QString savePath;
+    QStringList paths;
+    QStringList filenames;
+    bool daemon;
+    bool udp;
+    int fecGroup;
+    int maxPeers;
+    int workers;
+    qint64 connectionMemory;
+    int progressInterval;
+    bool metricsEvents;
+    QString metricsPath;
+    TransferOptions transfer;
+};
+
+class CliController : public QObject {
+    Q_OBJECT
+public:
+    enum ExitCode {
+        SUCCESS = 0,
+        USAGE_ERROR = 1,
+        NETWORK_ERROR = 2,
+        TRANSFER_ERROR = 3,
+        INTERRUPTED = 4
+    };
+    explicit CliController(const CliOptions &options, QObject *parent = nullptr);
+    bool start();
+private:
+    CliOptions options;
+    QTextStream out;
+    QTcpServer *server;
+    QTcpSocket *socket;
+    TransferEngine *engine;
+    PeerServer *peerServer;
+    QTimer *progressTimer;
+    QElapsedTimer elapsed;
+    qint64 lastProgressMsecs;
+    qint64 lastBytesSent;
+    qint64 lastBytesReceived;
+    QHash<int, QString> recvFilenames;
+    void writeEvent(const QString &event, QJsonObject fields = QJsonObject());
+    void writeMetrics();
+    bool listen();
+    bool serve();
+    void startEngine();
+    void finishSession(ExitCode exitCode);
+    void serverNewConnection();
+    void socketConnected();
+    void socketErrored();
+    void progressTimeout();
+    void engineSendJobStarted(int index);
+    void engineSendJobFinished(int index);
+    void engineRecvJobStarted(int id, const QString &filename);
+    void engineRecvJobFinished(int id);
+    void engineProtocolNegotiated(int version, int frameSize, int streams, bool compression);
+    void engineIdle();
+    void engineErrorOccurred(const QString &message);
+    void engineDisconnected();
+    void peerSessionStarted(int session, const QString &address, quint16 port, const QString &savePath);
+    void peerSessionFinished(int session, bool ok, const QString &message, qint64 bytesReceived);
+    void peerRecvJobStarted(int session, const QString &filename);
+    void peerRecvJobFinished(int session, const QString &filename);
+    void peerRejected(const QString &address, const QString &reason);
+};
+
+#endif // CLICONTROLLER_H
@@ -0,0 +1,134 @@
+#include <QCommandLineParser>
+#include <QCoreApplication>
+#include <QFile>
+#include <QFileInfo>
+#include <QTextStream>
+#include <QThread>
+
+#include "clicontroller.h"
+#include "crypto.h"
+#include "diskio.h"
+#include "sendjob.h"
+#include "udpsocket.h"
+
+static int usageError(const QString &message)
+{
+    QTextStream(stderr) << "snftp-cli: " << message << '\n';
+    return CliController::USAGE_ERROR;
+}
+
+int main(int argc, char *argv[])
+{
+    Crypto::init();
+    QCoreApplication a(argc, argv);
+    QCoreApplication::setApplicationName("snftp-cli");
+
+    QCommandLineParser parser;
+    parser.setApplicationDescription("Headless snftp. Progress is printed to stdout as one JSON object per line.");
+    parser.addHelpOption();
+    parser.addPositionalArgument("paths", "Files or directories to send.", "[paths...]");
+    const QCommandLineOption listenOption(QStringList() << "l" << "listen", "Listen on <address> for a peer.", "address", "0.0.0.0");
+    const QCommandLineOption connectOption(QStringList() << "c" << "connect", "Connect to the peer at <address>.", "address");
+    const QCommandLineOption portOption(QStringList() << "p" << "port", "TCP or UDP port.", "port", "7638");
+    const QCommandLineOption udpOption("udp", "Carry the transfer over UDP with paced, rate-based congestion control (lossy or long links).");
+    const QCommandLineOption fecOption("fec", "With --udp, send one parity packet per <packets> data packets, 0 to disable.", "packets", "0");
+    const QCommandLineOption savePathOption(QStringList() << "s" << "save-path", "Directory for received files.", "directory", ".");
+    const QCommandLineOption daemonOption(QStringList() << "d" << "daemon", "Keep listening for new peers after each session.");
+    const QCommandLineOption maxPeersOption("max-peers", "Receive from up to <count> peers at once, each into its own subdirectory.", "count", "0");
+    const QCommandLineOption workersOption("workers", "Worker threads shared by the peers of --max-peers.", "count",
+                                           QString::number(qMin(QThread::idealThreadCount(), 4)));
+    const QCommandLineOption connectionMemoryOption("connection-memory", "Memory budget per connection with --max-peers, in MiB.", "MiB", "64");
+    const QCommandLineOption passwordFileOption("password-file", "Read the password from <file> instead of SNFTP_PASSWORD.", "file");
+    const QCommandLineOption frameSizeOption("frame-size", "Maximum frame size in KiB.", "KiB", "4096");
+    const QCommandLineOption streamsOption("streams", "Number of TCP streams.", "count", "1");
+    const QCommandLineOption sendWindowOption("send-window", "Send window in MiB.", "MiB", "4");
+    const QCommandLineOption recvWindowOption("recv-window", "Data in MiB the peer may send ahead of the disk.", "MiB", "32");
+    const QCommandLineOption cryptoThreadsOption("crypto-threads", "Crypto worker threads.", "count", QString::number(QThread::idealThreadCount()));
+    const QCommandLineOption progressIntervalOption("progress-interval", "Milliseconds between progress events, 0 to disable.", "ms", "1000");
+    const QCommandLineOption metricsOption("metrics", "Follow every progress event with a metrics event (stage latencies, frames, queue depths).");
+    const QCommandLineOption metricsFileOption("metrics-file", "Write metrics in the Prometheus text format to <file> with every progress event.", "file");
+    const QCommandLineOption compressionOption("compression", "Compress data with zstd.");
+    const QCommandLineOption deltaOption("delta", "Only send what changed in files the peer already has.");
+    const QCommandLineOption plaintextOption("plaintext", "Send data unencrypted but authenticated (trusted LAN).");
+    const QCommandLineOption preallocateOption("preallocate", "Preallocate received files.");
+    const QCommandLineOption ioDepthOption("io-depth", "File reads and writes kept in flight.", "count",
+                                           QString::number(DiskIo::DEFAULT_QUEUE_DEPTH));
+    const QCommandLineOption fsyncOption("fsync", "Sync each received file once complete: none, data (fdatasync) or full (fsync).", "policy", "none");
+    const QCommandLineOption legacyOption("legacy", "Use the legacy protocol (v1).");
+    parser.addOptions({listenOption, connectOption, portOption, udpOption, fecOption, savePathOption, daemonOption,
+                       maxPeersOption, workersOption, connectionMemoryOption, passwordFileOption,
+                       frameSizeOption, streamsOption, sendWindowOption, recvWindowOption, cryptoThreadsOption, progressIntervalOption,
+                       metricsOption, metricsFileOption,
+                       compressionOption, deltaOption, plaintextOption, preallocateOption, ioDepthOption, fsyncOption, legacyOption});
+    parser.process(a);
+
+    CliOptions options;
+    options.transfer.client = parser.isSet(connectOption);
+    if (options.transfer.client && parser.isSet(listenOption))
+        return usageError("--listen and --connect are mutually exclusive.");
+    options.address = parser.value(options.transfer.client ? connectOption : listenOption);
+    bool ok;
+    options.port = parser.value(portOption).toUShort(&ok);
+    if (!ok || options.port == 0)
+        return usageError("Invalid port.");
+    options.savePath = parser.value(savePathOption);
+    if (!QFileInfo(options.savePath).isDir())
+        return usageError(QString("Not a directory: %1").arg(options.savePath));
+    options.daemon = parser.isSet(daemonOption);
+    if (options.daemon && options.transfer.client)
+        return usageError("--daemon requires --listen.");
+    options.maxPeers = qMax(parser.value(maxPeersOption).toInt(), 0);
+    options.workers = qMax(parser.value(workersOption).toInt(), 1);
+    options.connectionMemory = qMax(parser.value(connectionMemoryOption).toLongLong(), 1LL) * 1024 * 1024;
+    if (options.maxPeers > 0 && options.transfer.client)
+        return usageError("--max-peers requires --listen.");
+    options.udp = parser.isSet(udpOption);
+    options.fecGroup = parser.value(fecOption).toInt(&ok);
+    if (!ok || options.fecGroup < 0 || options.fecGroup > UdpSocket::MAX_FEC_GROUP)
+        return usageError(QString("--fec must range from 0 to %1.").arg(UdpSocket::MAX_FEC_GROUP));
+    if (options.udp && options.maxPeers > 0)
+        return usageError("--udp and --max-peers are mutually exclusive.");
+    options.progressInterval = parser.value(progressIntervalOption).toInt();
+    options.metricsEvents = parser.isSet(metricsOption);
+    options.metricsPath = parser.value(metricsFileOption);
+
+    foreach (const QString &path, parser.positionalArguments()) {
+        if (!QFileInfo::exists(path))
+            return usageError(QString("No such file or directory: %1").arg(path));
+        SendJob::collect(path, &options.paths, &options.filenames);
+    }
+    if ((options.daemon || options.maxPeers > 0) && !options.paths.isEmpty())
+        return usageError("--daemon and --max-peers only receive files.");
+
+    options.transfer.legacyProtocol = parser.isSet(legacyOption);
+    options.transfer.maxFrameSize = parser.value(frameSizeOption).toInt() * 1024;
+    // A paced UDP stream fills the link alone.
+    options.transfer.streams = options.udp ? 1 : qMax(parser.value(streamsOption).toInt(), 1);
+    options.transfer.compression = parser.isSet(compressionOption);
+    options.transfer.delta = parser.isSet(deltaOption);
+    options.transfer.plaintext = parser.isSet(plaintextOption);
+    options.transfer.preallocate = parser.isSet(preallocateOption);
+    options.transfer.sendWindow = qMax(parser.value(sendWindowOption).toLongLong(), 1LL) * 1024 * 1024;
+    options.transfer.recvWindow = qMax(parser.value(recvWindowOption).toLongLong(), 1LL) * 1024 * 1024;
+    options.transfer.cryptoThreads = qMax(parser.value(cryptoThreadsOption).toInt(), 1);
+    options.transfer.ioDepth = qBound(1, parser.value(ioDepthOption).toInt(), static_cast<int>(DiskIo::MAX_QUEUE_DEPTH));
+    options.transfer.durability = QStringList({"none", "data", "full"}).indexOf(parser.value(fsyncOption));
+    if (options.transfer.durability < 0)
+        return usageError("--fsync must be none, data or full.");
+    options.transfer.metrics = options.metricsEvents || !options.metricsPath.isEmpty();
+    options.transfer.metricsInterval = 0;
+
+    QString password(QString::fromLocal8Bit(qgetenv("SNFTP_PASSWORD")));
+    if (parser.isSet(passwordFileOption)) {
+        QFile file(parser.value(passwordFileOption));
+        if (!file.open(QIODevice::ReadOnly))
+            return usageError(QString("Unable to read %1").arg(file.fileName()));
+        password = QString::fromUtf8(file.readLine()).trimmed();
+    }
+    Crypto::setPassword(password);
+
+    CliController controller(options);
+    if (!controller.start())
+        return CliController::NETWORK_ERROR;
+    return a.exec();
+}
@@ -0,0 +1,8 @@
+TEMPLATE = subdirs
+
+SUBDIRS += \
+        src \
+        cli \
+        bench
+
+src.file = src/snftp.pro
@@ -0,0 +1,40 @@
+#include "bufferpool.h"
+
+BufferPool::BufferPool(int bufferSize, int maxFree) : bufferSize(bufferSize), maxFree(maxFree), allocations(0) {}
+
+int BufferPool::getBufferSize() const
+{
+    return bufferSize;
+}
+
+void BufferPool::setBufferSize(int bufferSize)
+{
+    this->bufferSize = bufferSize;
+    freeBuffers.clear();
+}
+
+quint64 BufferPool::getAllocations() const
+{
+    return allocations;
+}
+
+QByteArray BufferPool::acquire()
+{
+    if (freeBuffers.isEmpty()) {
+        ++allocations;
+        return QByteArray(bufferSize, Qt::Uninitialized);
+    }
+    QByteArray ret;
+    ret.swap(freeBuffers.last());
+    freeBuffers.removeLast();
+    return ret;
+}
+
+void BufferPool::release(QByteArray &buffer)
+{
+    if (buffer.size() == bufferSize && buffer.isDetached() && freeBuffers.length() < maxFree) {
+        freeBuffers.append(QByteArray());
+        freeBuffers.last().swap(buffer);
+    }
+    buffer.clear();
+}
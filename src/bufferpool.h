@@ -0,0 +1,22 @@
+#ifndef BUFFERPOOL_H
+#define BUFFERPOOL_H
+
+#include <QByteArray>
+#include <QVector>
+
+class BufferPool {
+public:
+    explicit BufferPool(int bufferSize, int maxFree = 64);
+    int getBufferSize() const;
+    void setBufferSize(int bufferSize);
+    quint64 getAllocations() const;
+    QByteArray acquire();
+    void release(QByteArray &buffer);
+private:
+    int bufferSize;
+    int maxFree;
+    quint64 allocations;
+    QVector<QByteArray> freeBuffers;
+};
+
+#endif // BUFFERPOOL_H
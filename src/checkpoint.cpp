@@ -0,0 +1,156 @@
+#include "checkpoint.h"
+
+#include <cstring>
+
+#include <sodium.h>
+
+#include "protocol.h"
+
+using namespace std;
+
+const QByteArray Checkpoint::magic("SNFTPPRT");
+
+Checkpoint::Checkpoint(const QString &path) : file(path + ".snftp-part"), fileSize(0) {}
+
+QString Checkpoint::getPath() const
+{
+    return file.fileName();
+}
+
+qint64 Checkpoint::verifiedChunks() const
+{
+    qint64 ret = 0;
+    while (chunks.contains(ret))
+        ++ret;
+    return ret;
+}
+
+qint64 Checkpoint::getVerifiedBytes() const
+{
+    return qMin(verifiedChunks() * CHUNK_SIZE, fileSize);
+}
+
+QByteArray Checkpoint::combine(const QVector<QByteArray> &hashes)
+{
+    crypto_generichash_state state;
+    crypto_generichash_init(&state, nullptr, 0, HASH_BYTES);
+    foreach (const QByteArray &hash, hashes)
+        crypto_generichash_update(&state, reinterpret_cast<const unsigned char *>(hash.constData()), HASH_BYTES);
+    QByteArray ret(HASH_BYTES, 0);
+    crypto_generichash_final(&state, reinterpret_cast<unsigned char *>(ret.data()), HASH_BYTES);
+    return ret;
+}
+
+bool Checkpoint::load(qint64 fileSize)
+{
+    this->fileSize = fileSize;
+    chunks.clear();
+    if (!file.open(QIODevice::ReadWrite))
+        return false;
+
+    const QByteArray header(file.read(magic.length() + 12));
+    if (header.length() != magic.length() + 12 || !header.startsWith(magic)
+            || static_cast<qint64>(Protocol::getUInt64(header.constData() + magic.length())) != fileSize
+            || Protocol::getUInt32(header.constData() + magic.length() + 8) != CHUNK_SIZE) {
+        file.close();
+        return false;
+    }
+
+    const qint64 maxIndex = (fileSize - 1) / CHUNK_SIZE;
+    char record[8 + HASH_BYTES];
+    qint64 end = file.pos();
+    while (file.read(record, sizeof(record)) == sizeof(record)) {
+        const qint64 index = static_cast<qint64>(Protocol::getUInt64(record));
+        if (index > maxIndex)
+            break;
+        chunks.insert(index, QByteArray(record + 8, HASH_BYTES));
+        end = file.pos();
+    }
+    // Drop a record torn by a crash so that new ones are appended cleanly.
+    file.resize(end);
+    file.seek(end);
+    return true;
+}
+
+bool Checkpoint::create(qint64 fileSize)
+{
+    this->fileSize = fileSize;
+    chunks.clear();
+    if (file.isOpen())
+        file.close();
+    if (!file.open(QIODevice::WriteOnly | QIODevice::Truncate))
+        return false;
+
+    QByteArray header(magic);
+    header.append(12, 0);
+    Protocol::putUInt64(header.data() + magic.length(), static_cast<quint64>(fileSize));
+    Protocol::putUInt32(header.data() + magic.length() + 8, CHUNK_SIZE);
+    return file.write(header) == header.length() && file.flush();
+}
+
+bool Checkpoint::addChunk(qint64 index, const QByteArray &hash)
+{
+    char record[8 + HASH_BYTES];
+    Protocol::putUInt64(record, static_cast<quint64>(index));
+    memcpy(record + 8, hash.constData(), HASH_BYTES);
+    chunks.insert(index, hash);
+    return file.write(record, sizeof(record)) == sizeof(record) && file.flush();
+}
+
+// Records are only flushed, not synced, so after a crash the sidecar can
+// vouch for data that never reached the disk. The verified chunks are
+// compared with hashes read back from the file, and everything from the
+// first mismatch on is dropped.
+bool Checkpoint::verify(const QVector<QByteArray> &hashes)
+{
+    const qint64 count = verifiedChunks();
+    qint64 matching = 0;
+    while (matching < count && matching < hashes.length() && hashes[static_cast<int>(matching)] == chunks[matching])
+        ++matching;
+    if (matching == count)
+        return true;
+
+    const QHash<qint64, QByteArray> kept(chunks);
+    if (!create(fileSize))
+        return false;
+    for (qint64 i = 0; i < matching; ++i)
+        if (!addChunk(i, kept[i]))
+            return false;
+    return true;
+}
+
+void Checkpoint::remove()
+{
+    file.remove();
+    chunks.clear();
+}
+
+// The hashes of the chunks in the first length bytes of the file, as far as
+// it can be read.
+QVector<QByteArray> Checkpoint::hashChunks(const QString &path, qint64 length)
+{
+    QVector<QByteArray> ret;
+    QFile file(path);
+    if (!file.open(QIODevice::ReadOnly))
+        return ret;
+
+    QByteArray buffer(CHUNK_SIZE, Qt::Uninitialized);
+    for (qint64 offset = 0; offset < length; offset += CHUNK_SIZE) {
+        const qint64 len = qMin(static_cast<qint64>(CHUNK_SIZE), length - offset);
+        if (file.read(buffer.data(), len) != len)
+            break;
+        QByteArray hash(HASH_BYTES, 0);
+        crypto_generichash(reinterpret_cast<unsigned char *>(hash.data()), HASH_BYTES, reinterpret_cast<const unsigned char *>(buffer.constData()),
+                           static_cast<unsigned long long>(len), nullptr, 0);
+        ret.append(hash);
+    }
+    return ret;
+}
+
+QByteArray Checkpoint::hashFilePrefix(const QString &path, qint64 length)
+{
+    const QVector<QByteArray> hashes(hashChunks(path, length));
+    if (static_cast<qint64>(hashes.length()) < (length + CHUNK_SIZE - 1) / CHUNK_SIZE)
+        return QByteArray();
+    return combine(hashes);
+}
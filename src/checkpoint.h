@@ -0,0 +1,34 @@
+#ifndef CHECKPOINT_H
+#define CHECKPOINT_H
+
+#include <QByteArray>
+#include <QFile>
+#include <QHash>
+#include <QVector>
+
+class Checkpoint {
+public:
+    enum {
+        CHUNK_SIZE = 4 * 1024 * 1024,
+        HASH_BYTES = 32
+    };
+    explicit Checkpoint(const QString &path);
+    QString getPath() const;
+    qint64 getVerifiedBytes() const;
+    bool load(qint64 fileSize);
+    bool create(qint64 fileSize);
+    bool addChunk(qint64 index, const QByteArray &hash);
+    bool verify(const QVector<QByteArray> &hashes);
+    void remove();
+    static QVector<QByteArray> hashChunks(const QString &path, qint64 length);
+    static QByteArray hashFilePrefix(const QString &path, qint64 length);
+    static QByteArray combine(const QVector<QByteArray> &hashes);
+private:
+    const static QByteArray magic;
+    QFile file;
+    qint64 fileSize;
+    QHash<qint64, QByteArray> chunks;
+    qint64 verifiedChunks() const;
+};
+
+#endif // CHECKPOINT_H
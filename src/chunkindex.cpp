@@ -0,0 +1,189 @@
+#include "chunkindex.h"
+
+#include <QDateTime>
+#include <QFile>
+#include <QFileInfo>
+#include <QHash>
+#include <QSaveFile>
+
+#include <cstring>
+
+#include <sodium.h>
+
+#include "filedigest.h"
+
+using namespace std;
+
+const QByteArray ChunkIndex::magic("SNFTPIDX");
+
+const quint64 *ChunkIndex::gearTable()
+{
+    // Both peers must cut at the same places, so the table is derived from a
+    // fixed seed with splitmix64 instead of being random.
+    static const struct Table {
+        quint64 values[256];
+        Table()
+        {
+            quint64 state = 0x736e667470ULL;
+            for (int i = 0; i < 256; ++i) {
+                quint64 z = (state += 0x9E3779B97F4A7C15ULL);
+                z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+                z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+                values[i] = z ^ (z >> 31);
+            }
+        }
+    } table;
+    return table.values;
+}
+
+QString ChunkIndex::cachePath(const QString &path)
+{
+    return path + ".snftp-index";
+}
+
+QVector<Protocol::IndexEntry> ChunkIndex::build(const QString &path, bool *ok)
+{
+    QVector<Protocol::IndexEntry> ret;
+    *ok = false;
+    QFile file(path);
+    if (!file.open(QIODevice::ReadOnly))
+        return ret;
+
+    const quint64 *gear = gearTable();
+    QByteArray buffer(READ_SIZE, Qt::Uninitialized);
+    crypto_generichash_state state;
+    crypto_generichash_init(&state, nullptr, 0, sizeof(Protocol::IndexEntry::hash));
+    Protocol::IndexEntry entry;
+    quint64 hash = 0;
+    int len = 0;
+    qint64 n;
+    while ((n = file.read(buffer.data(), READ_SIZE)) > 0) {
+        const unsigned char *data = reinterpret_cast<const unsigned char *>(buffer.constData());
+        qint64 segment = 0;
+        for (qint64 i = 0; i < n; ++i) {
+            hash = (hash << 1) + gear[data[i]];
+            if ((++len < MIN_CHUNK_SIZE || (hash & CHUNK_MASK) != 0) && len < MAX_CHUNK_SIZE)
+                continue;
+            crypto_generichash_update(&state, data + segment, static_cast<unsigned long long>(i + 1 - segment));
+            crypto_generichash_final(&state, reinterpret_cast<unsigned char *>(entry.hash), sizeof(entry.hash));
+            entry.length = len;
+            ret.append(entry);
+            crypto_generichash_init(&state, nullptr, 0, sizeof(entry.hash));
+            segment = i + 1;
+            hash = 0;
+            len = 0;
+        }
+        crypto_generichash_update(&state, data + segment, static_cast<unsigned long long>(n - segment));
+    }
+    if (n < 0)
+        return QVector<Protocol::IndexEntry>();
+    if (len > 0) {
+        crypto_generichash_final(&state, reinterpret_cast<unsigned char *>(entry.hash), sizeof(entry.hash));
+        entry.length = len;
+        ret.append(entry);
+    }
+    *ok = true;
+    return ret;
+}
+
+QVector<Protocol::IndexEntry> ChunkIndex::load(const QString &path)
+{
+    const QFileInfo info(path);
+    const qint64 size = info.size();
+    const qint64 mtime = info.lastModified().toMSecsSinceEpoch();
+    const int entryBytes = 4 + static_cast<int>(sizeof(Protocol::IndexEntry::hash));
+
+    QFile cache(cachePath(path));
+    if (cache.open(QIODevice::ReadOnly)) {
+        const QByteArray data(cache.readAll());
+        const int headerBytes = magic.length() + 16;
+        if (data.length() >= headerBytes && data.startsWith(magic)
+                && static_cast<qint64>(Protocol::getUInt64(data.constData() + magic.length())) == size
+                && static_cast<qint64>(Protocol::getUInt64(data.constData() + magic.length() + 8)) == mtime
+                && (data.length() - headerBytes) % entryBytes == 0) {
+            QVector<Protocol::IndexEntry> ret;
+            ret.reserve((data.length() - headerBytes) / entryBytes);
+            for (const char *entry = data.constData() + headerBytes; entry < data.constData() + data.length(); entry += entryBytes) {
+                Protocol::IndexEntry indexEntry;
+                indexEntry.length = static_cast<int>(Protocol::getUInt32(entry));
+                memcpy(indexEntry.hash, entry + 4, sizeof(indexEntry.hash));
+                ret.append(indexEntry);
+            }
+            return ret;
+        }
+        cache.close();
+    }
+
+    bool ok;
+    const QVector<Protocol::IndexEntry> ret(build(path, &ok));
+    if (!ok)
+        return ret;
+
+    QSaveFile save(cachePath(path));
+    if (save.open(QIODevice::WriteOnly)) {
+        QByteArray header(magic);
+        header.append(16, 0);
+        Protocol::putUInt64(header.data() + magic.length(), static_cast<quint64>(size));
+        Protocol::putUInt64(header.data() + magic.length() + 8, static_cast<quint64>(mtime));
+        save.write(header);
+        char entry[4 + sizeof(Protocol::IndexEntry::hash)];
+        foreach (const Protocol::IndexEntry &indexEntry, ret) {
+            Protocol::putUInt32(entry, static_cast<quint32>(indexEntry.length));
+            memcpy(entry + 4, indexEntry.hash, sizeof(indexEntry.hash));
+            save.write(entry, sizeof(entry));
+        }
+        save.commit();
+    }
+    return ret;
+}
+
+DeltaPlan ChunkIndex::plan(const QString &path, const QVector<Protocol::IndexEntry> &peerIndex)
+{
+    DeltaPlan ret;
+    ret.copyBytes = 0;
+
+    QHash<quint64, int> peerChunks;
+    QVector<qint64> peerOffsets(peerIndex.length());
+    qint64 peerOffset = 0;
+    for (int i = 0; i < peerIndex.length(); ++i) {
+        quint64 key;
+        memcpy(&key, peerIndex[i].hash, sizeof(key));
+        if (!peerChunks.contains(key))
+            peerChunks.insert(key, i);
+        peerOffsets[i] = peerOffset;
+        peerOffset += peerIndex[i].length;
+    }
+
+    const QVector<Protocol::IndexEntry> index(build(path, &ret.ok));
+    qint64 offset = 0;
+    foreach (const Protocol::IndexEntry &entry, index) {
+        quint64 key;
+        memcpy(&key, entry.hash, sizeof(key));
+        const int peer = peerChunks.value(key, -1);
+        if (peer >= 0 && peerIndex[peer].length == entry.length && memcmp(peerIndex[peer].hash, entry.hash, sizeof(entry.hash)) == 0) {
+            Protocol::Copy *last = ret.copies.isEmpty() ? nullptr : &ret.copies.last();
+            if (last != nullptr && last->offset + last->length == offset && last->sourceOffset + last->length == peerOffsets[peer]) {
+                last->length += entry.length;
+                ret.copyHashes.last().append(entry.hash, sizeof(entry.hash));
+            } else {
+                Protocol::Copy copy;
+                copy.offset = offset;
+                copy.sourceOffset = peerOffsets[peer];
+                copy.length = entry.length;
+                ret.copies.append(copy);
+                ret.copyHashes.append(QByteArray(entry.hash, sizeof(entry.hash)));
+            }
+            ret.copyBytes += entry.length;
+        } else if (!ret.literals.isEmpty() && ret.literals.last().first + ret.literals.last().second == offset) {
+            ret.literals.last().second += entry.length;
+        } else {
+            ret.literals.append(qMakePair(offset, static_cast<qint64>(entry.length)));
+        }
+        offset += entry.length;
+    }
+    // A copy is verified by the chunk hashes the receiver recomputes while
+    // reading its basis, so its digest piece is built from ours.
+    for (int i = 0; i < ret.copyHashes.length(); ++i)
+        ret.copyHashes[i] = FileDigest::hash(ret.copyHashes[i]);
+    return ret;
+}
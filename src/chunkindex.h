@@ -0,0 +1,35 @@
+#ifndef CHUNKINDEX_H
+#define CHUNKINDEX_H
+
+#include <QPair>
+#include <QString>
+#include <QVector>
+
+#include "protocol.h"
+
+struct DeltaPlan {
+    bool ok;
+    QVector<Protocol::Copy> copies;
+    QVector<QByteArray> copyHashes;
+    QVector<QPair<qint64, qint64> > literals;
+    qint64 copyBytes;
+};
+
+class ChunkIndex {
+public:
+    enum {
+        MIN_CHUNK_SIZE = 16 * 1024,
+        MAX_CHUNK_SIZE = 256 * 1024,
+        CHUNK_MASK = 64 * 1024 - 1,
+        READ_SIZE = 4 * 1024 * 1024
+    };
+    static QString cachePath(const QString &path);
+    static QVector<Protocol::IndexEntry> build(const QString &path, bool *ok);
+    static QVector<Protocol::IndexEntry> load(const QString &path);
+    static DeltaPlan plan(const QString &path, const QVector<Protocol::IndexEntry> &peerIndex);
+private:
+    const static QByteArray magic;
+    static const quint64 *gearTable();
+};
+
+#endif // CHUNKINDEX_H
@@ -0,0 +1,55 @@
+#include "compressor.h"
+
+#include <QByteArray>
+
+#include <cstring>
+
+#include <zstd.h>
+
+using namespace std;
+
+namespace {
+
+struct Contexts {
+    ZSTD_CCtx *cctx;
+    ZSTD_DCtx *dctx;
+    QByteArray scratch;
+    Contexts() : cctx(ZSTD_createCCtx()), dctx(ZSTD_createDCtx()) {}
+    ~Contexts()
+    {
+        ZSTD_freeCCtx(cctx);
+        ZSTD_freeDCtx(dctx);
+    }
+    char *reserve(size_t size)
+    {
+        if (static_cast<size_t>(scratch.size()) < size)
+            scratch.resize(static_cast<int>(size));
+        return scratch.data();
+    }
+};
+
+thread_local Contexts contexts;
+
+}
+
+int Compressor::compress(char *data, int length)
+{
+    const size_t bound = ZSTD_compressBound(static_cast<size_t>(length));
+    char *out = contexts.reserve(bound);
+    const size_t ret = ZSTD_compressCCtx(contexts.cctx, out, bound, data, static_cast<size_t>(length), LEVEL);
+    // Not worth the receiver's time unless it saves at least an eighth.
+    if (ZSTD_isError(ret) || ret > static_cast<size_t>(length - length / 8))
+        return -1;
+    memcpy(data, out, ret);
+    return static_cast<int>(ret);
+}
+
+int Compressor::decompress(char *data, int length, int capacity)
+{
+    char *in = contexts.reserve(static_cast<size_t>(length));
+    memcpy(in, data, static_cast<size_t>(length));
+    const size_t ret = ZSTD_decompressDCtx(contexts.dctx, data, static_cast<size_t>(capacity), in, static_cast<size_t>(length));
+    if (ZSTD_isError(ret))
+        return -1;
+    return static_cast<int>(ret);
+}
@@ -0,0 +1,13 @@
+#ifndef COMPRESSOR_H
+#define COMPRESSOR_H
+
+class Compressor {
+public:
+    enum {
+        LEVEL = 1
+    };
+    static int compress(char *data, int length);
+    static int decompress(char *data, int length, int capacity);
+};
+
+#endif // COMPRESSOR_H
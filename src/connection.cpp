@@ -0,0 +1,812 @@
+#include "connection.h"
+
+#include <cstring>
+
+#ifdef Q_OS_UNIX
+#include <sys/socket.h>
+#include <unistd.h>
+#endif
+#ifdef Q_OS_LINUX
+#include <sys/sendfile.h>
+#endif
+
+#include "crypto.h"
+#include "metrics.h"
+#include "udpsocket.h"
+
+using namespace std;
+
+Connection::Connection(QTcpSocket *socket, Role role, bool primary, const TransferOptions &options, QObject *parent) :
+    QObject(parent),
+    socket(socket),
+    role(role),
+    primary(primary),
+    // Only a kernel TCP socket can be written to directly.
+    directSend(qobject_cast<UdpSocket *>(socket) == nullptr && socket->socketDescriptor() >= 0),
+    handshakeDone(false),
+    localHello(),
+    peerHello(),
+    protocolVersion(options.legacyProtocol ? 1 : Protocol::VERSION),
+    localMaxFrameSize(qBound(static_cast<int>(Protocol::MIN_FRAME_SIZE), options.maxFrameSize, static_cast<int>(Protocol::MAX_FRAME_SIZE))),
+    frameSize(Protocol::V1_FRAME_SIZE),
+    localFeatures((options.compression ? Protocol::FEATURE_COMPRESSION : 0) | (options.delta ? Protocol::FEATURE_DELTA : 0)
+                  | Protocol::FEATURE_CREDIT | Protocol::FEATURE_SPARSE),
+    features(0),
+    helloTimer(new QTimer(this)),
+    sendHighWatermark(qMax(options.sendWindow, static_cast<qint64>(Protocol::V1_FRAME_SIZE))),
+    sendLowWatermark(sendHighWatermark / 4),
+    recvWindow(qMax(options.recvWindow, static_cast<qint64>(Protocol::V1_FRAME_SIZE))),
+    sendCreditLimit(0),
+    sendCreditUsed(0),
+    recvCreditLimit(0),
+    recvCreditUsed(0),
+    recvCreditReleased(0),
+    authStream(0),
+    sendSequence(0),
+    recvSequence(0),
+    bypassStreak(0),
+    bypassSkip(0),
+    encryptPipeline(new CryptoPipeline(CryptoPipeline::ENCRYPT, options.cryptoThreads, this)),
+    decryptPipeline(new CryptoPipeline(CryptoPipeline::DECRYPT, options.cryptoThreads, this)),
+    sendPool(Protocol::V1_HEADER_BYTES + Crypto::OVERHEAD + Protocol::V1_FRAME_SIZE),
+    recvPool(Protocol::V1_MAX_SEALED_BYTES),
+    recvRing(RECV_RING_FRAMES * (Protocol::V1_HEADER_BYTES + Protocol::V1_MAX_SEALED_BYTES)),
+    v1ContentRemaining(0),
+    drained(false),
+    recordsPaused(false),
+    failed(false)
+{
+    throttleTimer.invalidate();
+    creditTimer.invalidate();
+    windowTimer.invalidate();
+    publicKey = Crypto::generateKeyPair(&secretKey);
+    qRegisterMetaType<SendStats>();
+    qRegisterMetaType<CompressionStats>();
+    qRegisterMetaType<CopyStats>();
+
+#ifdef Q_OS_UNIX
+    if (options.plaintext)
+        localFeatures |= Protocol::FEATURE_PLAINTEXT;
+#endif
+    if (Crypto::isAesAvailable())
+        localFeatures |= Protocol::FEATURE_AES_GCM;
+
+    sendStats.window = sendHighWatermark;
+    sendStats.refills = 0;
+    sendStats.underruns = 0;
+    sendStats.throttles = 0;
+    sendStats.frames = 0;
+    sendStats.creditStalls = 0;
+    sendStats.creditStallNsecs = 0;
+    sendStats.windowStalls = 0;
+    sendStats.windowStallNsecs = 0;
+    compressionStats.bytesIn = 0;
+    compressionStats.bytesOut = 0;
+    compressionStats.compressed = 0;
+    compressionStats.bypassed = 0;
+    compressionStats.nsecs = 0;
+    copyStats.sendPayload = 0;
+    copyStats.sendCopied = 0;
+    copyStats.recvPayload = 0;
+    copyStats.recvCopied = 0;
+
+    helloTimer->setSingleShot(true);
+    connect(helloTimer, &QTimer::timeout, this, &Connection::helloTimeout);
+
+    socket->setParent(this);
+    socket->setSocketOption(QTcpSocket::LowDelayOption, 1);
+    // Bounds the hellos, the window in effect is set by the handshake.
+    socket->setReadBufferSize(recvWindow);
+
+    connect(socket, &QTcpSocket::readyRead, this, &Connection::socketReadyRead);
+    connect(socket, &QTcpSocket::bytesWritten, this, &Connection::socketBytesWritten);
+    connect(socket, &QTcpSocket::disconnected, this, &Connection::socketDisconnected);
+    connect(encryptPipeline, &CryptoPipeline::resultReady, this, &Connection::encryptResultReady);
+    connect(decryptPipeline, &CryptoPipeline::resultReady, this, &Connection::decryptResultReady);
+}
+
+bool Connection::isReady() const
+{
+    return handshakeDone && !failed;
+}
+
+int Connection::getProtocolVersion() const
+{
+    return protocolVersion;
+}
+
+int Connection::getFrameSize() const
+{
+    return frameSize;
+}
+
+int Connection::getFeatures() const
+{
+    return features;
+}
+
+bool Connection::isPlaintext() const
+{
+    return (features & Protocol::FEATURE_PLAINTEXT) != 0;
+}
+
+bool Connection::hasCredit() const
+{
+    return (features & Protocol::FEATURE_CREDIT) != 0;
+}
+
+int Connection::getMaxRecordBytes() const
+{
+    return protocolVersion >= 2 ? frameSize - 1 : frameSize;
+}
+
+const Protocol::Hello &Connection::getPeerHello() const
+{
+    return peerHello;
+}
+
+const SendStats &Connection::getSendStats() const
+{
+    return sendStats;
+}
+
+CompressionStats Connection::getCompressionStats() const
+{
+    CompressionStats ret(compressionStats);
+    ret.nsecs = encryptPipeline->getTransformNsecs() + decryptPipeline->getTransformNsecs();
+    return ret;
+}
+
+const CopyStats &Connection::getCopyStats() const
+{
+    return copyStats;
+}
+
+int Connection::getEncryptQueue() const
+{
+    return encryptPipeline->getPending();
+}
+
+int Connection::getDecryptQueue() const
+{
+    return decryptPipeline->getPending();
+}
+
+qint64 Connection::getSocketQueue() const
+{
+    return socket->bytesToWrite();
+}
+
+QHostAddress Connection::getPeerAddress() const
+{
+    return socket->peerAddress();
+}
+
+quint16 Connection::getPeerPort() const
+{
+    return socket->peerPort();
+}
+
+qint64 Connection::getMemoryEstimate(const TransferOptions &options)
+{
+    // The receive side holds at most the window in the socket's read buffer,
+    // plus the receive ring, the decrypt pipeline and the write-behind queue,
+    // whose frames are out of the socket but not yet granted back. The send
+    // side holds its window and the encrypt pipeline.
+    const qint64 frame = qBound(static_cast<int>(Protocol::MIN_FRAME_SIZE), options.maxFrameSize, static_cast<int>(Protocol::MAX_FRAME_SIZE))
+            + Protocol::V2_HEADER_BYTES + Crypto::OVERHEAD;
+    return frame * (RECV_RING_FRAMES + 4 * qMax(options.cryptoThreads, 1) + qMax(options.ioDepth, 1)) + qMax(options.sendWindow, 2 * frame)
+            + qMax(options.recvWindow, 2 * frame);
+}
+
+void Connection::start(const Protocol::Hello &hello)
+{
+    localHello = hello;
+    if (protocolVersion == 1)
+        finishHandshake(1, Protocol::V1_FRAME_SIZE, 0);
+    else if (role == CLIENT)
+        sendHello(hello);
+    else if (primary)
+        helloTimer->start(HELLO_TIMEOUT);
+
+    if (socket->bytesAvailable() > 0)
+        socketReadyRead();
+}
+
+void Connection::acceptHello(const Protocol::Hello &reply)
+{
+    sendHello(reply);
+    finishHandshake(reply.version, reply.maxFrameSize, reply.features);
+}
+
+void Connection::close()
+{
+    failed = true;
+    socket->abort();
+}
+
+void Connection::shutdown()
+{
+    failed = true;
+    socket->disconnectFromHost();
+}
+
+int Connection::headerBytes() const
+{
+    return protocolVersion >= 2 && handshakeDone ? Protocol::V2_HEADER_BYTES : Protocol::V1_HEADER_BYTES;
+}
+
+int Connection::nonceBytes() const
+{
+    return protocolVersion >= 6 && handshakeDone ? 0 : Crypto::NONCE_BYTES;
+}
+
+int Connection::payloadOffset() const
+{
+    return headerBytes() + nonceBytes();
+}
+
+int Connection::maxSealedBytes() const
+{
+    return protocolVersion >= 2 && handshakeDone ? frameSize + nonceBytes() + Crypto::TAG_BYTES : Protocol::V1_MAX_SEALED_BYTES;
+}
+
+qint64 Connection::queuedBytes() const
+{
+    return socket->bytesToWrite() + encryptPipeline->getPendingBytes();
+}
+
+void Connection::sendHello(const Protocol::Hello &hello)
+{
+    Protocol::Hello local(hello);
+    local.maxFrameSize = qMin(local.maxFrameSize, localMaxFrameSize);
+    local.features &= localFeatures;
+    local.publicKey = publicKey;
+    writeEncrypt(Protocol::encodeHello(local));
+}
+
+void Connection::finishHandshake(int version, int negotiatedFrameSize, int negotiatedFeatures)
+{
+    helloTimer->stop();
+    protocolVersion = version;
+    handshakeDone = true;
+    if (protocolVersion >= 2) {
+        features = negotiatedFeatures & localFeatures;
+        frameSize = qMin(negotiatedFrameSize, localMaxFrameSize);
+        sendPool.setBufferSize(headerBytes() + Crypto::OVERHEAD + frameSize);
+        recvPool.setBufferSize(maxSealedBytes());
+        recvRing.reserve(RECV_RING_FRAMES * (headerBytes() + maxSealedBytes()));
+        sendHighWatermark = qMax(sendHighWatermark, 2 * static_cast<qint64>(frameSize));
+        sendLowWatermark = sendHighWatermark / 4;
+        sendStats.window = sendHighWatermark;
+        recvWindow = qMax(recvWindow, 2 * static_cast<qint64>(frameSize));
+    }
+    // Peers without credit are held back by TCP once this much is buffered.
+    socket->setReadBufferSize(recvWindow);
+
+    // From v6 on every connection runs its own key exchange inside the
+    // password-sealed hellos and numbers its frames in each direction.
+    QByteArray recvKey;
+    QByteArray sendKey;
+    const bool exchanged = protocolVersion < 6
+            || Crypto::deriveSessionKeys(role == CLIENT, publicKey, secretKey, peerHello.publicKey, &recvKey, &sendKey);
+    sodium_memzero(secretKey.data(), static_cast<size_t>(secretKey.length()));
+    secretKey.clear();
+    if (!exchanged) {
+        fail("The key exchange failed!");
+        return;
+    }
+    const bool aes = (features & Protocol::FEATURE_AES_GCM) != 0;
+    encryptPipeline->setKey(sendKey, aes);
+    decryptPipeline->setKey(recvKey, aes);
+
+    if (isPlaintext()) {
+        const Protocol::Hello &clientHello = role == CLIENT ? localHello : peerHello;
+        authStream = clientHello.streamIndex;
+        if (protocolVersion >= 6) {
+            encryptPipeline->setAuthKey(Crypto::deriveAuthKey(clientHello.sessionId, sendKey));
+            decryptPipeline->setAuthKey(Crypto::deriveAuthKey(clientHello.sessionId, recvKey));
+        } else {
+            const QByteArray authKey(Crypto::deriveAuthKey(clientHello.sessionId));
+            encryptPipeline->setAuthKey(authKey);
+            decryptPipeline->setAuthKey(authKey);
+        }
+    }
+    if (hasCredit())
+        sendCredit(static_cast<quint64>(recvWindow));
+    emit handshakeFinished();
+    emit readyToSend();
+}
+
+void Connection::helloTimeout()
+{
+    if (!handshakeDone)
+        finishHandshake(1, Protocol::V1_FRAME_SIZE, 0);
+}
+
+QByteArray Connection::authNonce(Role sender, quint64 sequence) const
+{
+    QByteArray ret(Crypto::AUTH_NONCE_BYTES, 0);
+    ret[0] = static_cast<char>(sender);
+    ret[1] = static_cast<char>(authStream);
+    Protocol::putUInt64(ret.data() + 4, sequence);
+    return ret;
+}
+
+void Connection::writeEncrypt(const QByteArray &data)
+{
+    QByteArray buffer(sendPool.acquire());
+    memcpy(buffer.data() + payloadOffset(), data.constData(), static_cast<size_t>(data.length()));
+    submitFrame(buffer, data.length());
+}
+
+void Connection::submitFrame(QByteArray &buffer, int plainTextLen, bool compress)
+{
+    encryptPipeline->submit(buffer, headerBytes(), plainTextLen, compress, nonceBytes() == 0 ? sendSequence++ : 0);
+    ++sendStats.frames;
+    Metrics::count(Metrics::FRAMES_SENT);
+    copyStats.sendPayload += static_cast<quint64>(plainTextLen);
+}
+
+bool Connection::canSend() const
+{
+    return handshakeDone && !failed && !encryptPipeline->isFull() && queuedBytes() < sendHighWatermark
+            && (!hasCredit() || sendCreditUsed < sendCreditLimit);
+}
+
+bool Connection::isFlushed() const
+{
+    return encryptPipeline->getPending() == 0 && socket->bytesToWrite() == 0;
+}
+
+void Connection::beginRefill()
+{
+    if (throttleTimer.isValid()) {
+        Metrics::record(Metrics::BACKPRESSURE, throttleTimer.nsecsElapsed());
+        throttleTimer.invalidate();
+    }
+    ++sendStats.refills;
+    if (drained)
+        ++sendStats.underruns;
+    drained = false;
+}
+
+void Connection::endRefill(bool throttled)
+{
+    if (!throttled)
+        return;
+    ++sendStats.throttles;
+    if (Metrics::isEnabled())
+        throttleTimer.start();
+}
+
+char *Connection::beginRecord(Protocol::RecordType type, QByteArray *buffer)
+{
+    *buffer = sendPool.acquire();
+    char *payload = buffer->data() + payloadOffset();
+    if (protocolVersion < 2)
+        return payload;
+    payload[0] = static_cast<char>(type);
+    return payload + 1;
+}
+
+void Connection::commitRecord(QByteArray &buffer, int length)
+{
+    if (protocolVersion < 2) {
+        submitFrame(buffer, length);
+        return;
+    }
+
+    const char type = buffer.constData()[payloadOffset()];
+    const bool data = type == static_cast<char>(Protocol::DATA);
+    if (data || type == static_cast<char>(Protocol::BATCH))
+        useCredit(length);
+    bool compress = false;
+    if ((features & Protocol::FEATURE_COMPRESSION) != 0 && data) {
+        if (bypassSkip > 0) {
+            --bypassSkip;
+            compressionStats.bytesIn += static_cast<quint64>(length);
+            compressionStats.bytesOut += static_cast<quint64>(length);
+            ++compressionStats.bypassed;
+        } else {
+            compress = true;
+        }
+    }
+    submitFrame(buffer, length + 1, compress);
+}
+
+void Connection::sendRecord(Protocol::RecordType type, const QByteArray &body)
+{
+    QByteArray buffer;
+    char *data = beginRecord(type, &buffer);
+    memcpy(data, body.constData(), static_cast<size_t>(body.length()));
+    commitRecord(buffer, body.length());
+}
+
+void Connection::discardRecord(QByteArray &buffer)
+{
+    sendPool.release(buffer);
+}
+
+// A hashed record has its digest piece computed while it is read for the
+// tag, and handed back through fileRecordHashed() in the order sent.
+void Connection::sendFileRecord(Protocol::RecordType type, int fileHandle, qint64 offset, int length, bool hashed)
+{
+#ifdef Q_OS_UNIX
+    const int handle = dup(fileHandle);
+    if (handle < 0) {
+        fail("Error reading file!");
+        return;
+    }
+    QByteArray buffer(Protocol::V2_HEADER_BYTES + Crypto::TAG_BYTES + 1 + (hashed ? Protocol::DIGEST_BYTES : 0), Qt::Uninitialized);
+    buffer[Protocol::V2_HEADER_BYTES + Crypto::TAG_BYTES] = static_cast<char>(type);
+    encryptPipeline->submitRaw(buffer, Protocol::V2_HEADER_BYTES, 1, authNonce(role, sendSequence++), handle, offset, length, hashed);
+    if (type == Protocol::DATA)
+        useCredit(length);
+    copyStats.sendPayload += static_cast<quint64>(length);
+    ++sendStats.frames;
+    Metrics::count(Metrics::FRAMES_SENT);
+#else
+    Q_UNUSED(type);
+    Q_UNUSED(fileHandle);
+    Q_UNUSED(offset);
+    Q_UNUSED(length);
+    Q_UNUSED(hashed);
+    fail("Plaintext records are not supported on this platform!");
+#endif
+}
+
+void Connection::grantCredit(qint64 bytes)
+{
+    if (!hasCredit() || failed)
+        return;
+    // Granted a quarter of the window at a time, unless the peer has run
+    // out and is waiting.
+    recvCreditReleased += static_cast<quint64>(bytes);
+    const quint64 limit = recvCreditReleased + static_cast<quint64>(recvWindow);
+    if (limit > recvCreditLimit && (limit - recvCreditLimit >= static_cast<quint64>(recvWindow / 4) || recvCreditUsed >= recvCreditLimit))
+        sendCredit(limit);
+}
+
+// While paused, decrypted records stay in the pipeline, which then stops
+// the parser, and the socket's read buffer holds back the peer.
+void Connection::pauseRecords()
+{
+    recordsPaused = true;
+}
+
+void Connection::resumeRecords()
+{
+    if (!recordsPaused)
+        return;
+    recordsPaused = false;
+    decryptResultReady();
+}
+
+void Connection::useCredit(int length)
+{
+    if (!hasCredit())
+        return;
+    sendCreditUsed += static_cast<quint64>(length);
+    if (sendCreditUsed >= sendCreditLimit && !creditTimer.isValid()) {
+        ++sendStats.creditStalls;
+        creditTimer.start();
+    }
+}
+
+void Connection::sendCredit(quint64 limit)
+{
+    recvCreditLimit = limit;
+    if (windowTimer.isValid() && recvCreditUsed < recvCreditLimit) {
+        const qint64 nsecs = windowTimer.nsecsElapsed();
+        sendStats.windowStallNsecs += static_cast<quint64>(nsecs);
+        Metrics::record(Metrics::WINDOW_STALL, nsecs);
+        windowTimer.invalidate();
+    }
+    sendRecord(Protocol::CREDIT, Protocol::encodeCredit(limit));
+}
+
+void Connection::processCredit(const char *data, int length)
+{
+    quint64 limit;
+    if (!Protocol::decodeCredit(data, length, &limit)) {
+        fail("Invalid credit record!");
+        return;
+    }
+    if (limit <= sendCreditLimit)
+        return;
+    sendCreditLimit = limit;
+    if (creditTimer.isValid() && sendCreditUsed < sendCreditLimit) {
+        const qint64 nsecs = creditTimer.nsecsElapsed();
+        sendStats.creditStallNsecs += static_cast<quint64>(nsecs);
+        Metrics::record(Metrics::CREDIT_STALL, nsecs);
+        creditTimer.invalidate();
+    }
+    if (canSend())
+        emit readyToSend();
+}
+
+void Connection::writeFrame(const char *data, qint64 length)
+{
+#ifdef Q_OS_LINUX
+    // Qt's write buffer costs one more copy, skip it whenever it is empty.
+    if (directSend && socket->bytesToWrite() == 0) {
+        const ssize_t sent = send(static_cast<int>(socket->socketDescriptor()), data, static_cast<size_t>(length), MSG_DONTWAIT | MSG_NOSIGNAL);
+        if (sent > 0) {
+            copyStats.sendCopied += static_cast<quint64>(sent);
+            data += sent;
+            length -= sent;
+        }
+    }
+#endif
+    if (length > 0) {
+        copyStats.sendCopied += 2 * static_cast<quint64>(length);
+        socket->write(data, length);
+    }
+}
+
+void Connection::writeFileBody(int fileHandle, qint64 offset, qint64 length)
+{
+#ifdef Q_OS_LINUX
+    if (directSend && socket->bytesToWrite() == 0) {
+        const int socketHandle = static_cast<int>(socket->socketDescriptor());
+        while (length > 0) {
+            off_t fileOffset = static_cast<off_t>(offset);
+            const ssize_t sent = sendfile(socketHandle, fileHandle, &fileOffset, static_cast<size_t>(length));
+            if (sent <= 0)
+                break;
+            copyStats.sendCopied += static_cast<quint64>(sent);
+            offset += sent;
+            length -= sent;
+        }
+    }
+#endif
+    if (length == 0)
+        return;
+#ifdef Q_OS_UNIX
+    QByteArray body(static_cast<int>(length), Qt::Uninitialized);
+    if (pread(fileHandle, body.data(), static_cast<size_t>(length), static_cast<off_t>(offset)) != length) {
+        fail("Error reading file!");
+        return;
+    }
+    copyStats.sendCopied += static_cast<quint64>(length);
+    writeFrame(body.constData(), length);
+#else
+    Q_UNUSED(fileHandle);
+    Q_UNUSED(offset);
+    fail("Plaintext records are not supported on this platform!");
+#endif
+}
+
+void Connection::writeRawFrame(CryptoFrame &frame)
+{
+    if (frame.length >= 0) {
+        Protocol::putUInt32(frame.buffer.data(), static_cast<quint32>(frame.length + frame.fileLength) | Protocol::RAW_FRAME_FLAG);
+        writeFrame(frame.buffer.constData(), frame.offset + frame.length);
+        writeFileBody(frame.fileHandle, frame.fileOffset, frame.fileLength);
+        if (frame.hashed && !failed)
+            emit fileRecordHashed(QByteArray(frame.buffer.constData() + frame.offset + frame.length, Protocol::DIGEST_BYTES));
+    } else {
+        fail("Error reading file!");
+    }
+#ifdef Q_OS_UNIX
+    ::close(frame.fileHandle);
+#endif
+}
+
+void Connection::encryptResultReady()
+{
+    while (!failed && encryptPipeline->hasResult()) {
+        CryptoFrame frame(encryptPipeline->takeResult());
+        if (frame.raw) {
+            writeRawFrame(frame);
+            continue;
+        }
+        if (frame.offset == Protocol::V2_HEADER_BYTES)
+            Protocol::putUInt32(frame.buffer.data(), static_cast<quint32>(frame.length));
+        else
+            Protocol::putUInt16(frame.buffer.data(), static_cast<quint16>(frame.length));
+        if (frame.transform)
+            updateCompressionStats(frame);
+        writeFrame(frame.buffer.constData(), frame.offset + frame.length);
+        sendPool.release(frame.buffer);
+    }
+
+    if (canSend() && queuedBytes() <= sendLowWatermark)
+        emit readyToSend();
+}
+
+void Connection::updateCompressionStats(const CryptoFrame &frame)
+{
+    const int overhead = nonceBytes() + Crypto::TAG_BYTES;
+    const int sealedLen = frame.sourceLength + overhead;
+    compressionStats.bytesIn += static_cast<quint64>(frame.sourceLength - 1);
+    compressionStats.bytesOut += static_cast<quint64>(frame.length - overhead - 1);
+    if (frame.length < sealedLen) {
+        ++compressionStats.compressed;
+        bypassStreak = 0;
+        return;
+    }
+
+    // Back off exponentially on incompressible data, probing now and then.
+    ++compressionStats.bypassed;
+    if (++bypassStreak >= BYPASS_STREAK)
+        bypassSkip = qMin(1 << qMin(bypassStreak - BYPASS_STREAK + 1, 8), static_cast<int>(MAX_BYPASS_SKIP));
+}
+
+void Connection::fail(const QString &message)
+{
+    if (failed)
+        return;
+    failed = true;
+    emit errorOccurred(message);
+    socket->abort();
+}
+
+void Connection::socketReadyRead()
+{
+    while (!failed) {
+        qint64 maxLen;
+        char *data = recvRing.writePointer(&maxLen);
+        if (maxLen == 0) {
+            const qint64 before = recvRing.getSize();
+            parseFrames();
+            if (recvRing.getSize() == before)
+                break;
+            continue;
+        }
+        const qint64 len = socket->read(data, maxLen);
+        if (len <= 0)
+            break;
+        copyStats.recvCopied += 2 * static_cast<quint64>(len);
+        recvRing.commit(len);
+    }
+    parseFrames();
+}
+
+void Connection::parseFrames()
+{
+    while (!failed && !decryptPipeline->isFull()) {
+        if (!handshakeDone && decryptPipeline->getPending() > 0)
+            break;
+
+        char lenBytes[Protocol::V2_HEADER_BYTES];
+        const int header = headerBytes();
+        if (!recvRing.peek(0, lenBytes, header))
+            break;
+        qint64 len = header == Protocol::V2_HEADER_BYTES ? Protocol::getUInt32(lenBytes) : Protocol::getUInt16(lenBytes);
+        const bool raw = header == Protocol::V2_HEADER_BYTES && (len & Protocol::RAW_FRAME_FLAG) != 0;
+        if (raw && !isPlaintext()) {
+            fail("Unexpected plaintext frame!");
+            return;
+        }
+        len &= ~static_cast<qint64>(Protocol::RAW_FRAME_FLAG);
+        if (len > maxSealedBytes()) {
+            fail(QString("Invalid frame length: %1").arg(len));
+            return;
+        }
+        if (recvRing.getSize() < header + len)
+            break;
+
+        QByteArray buffer(recvPool.acquire());
+        recvRing.peek(header, buffer.data(), len);
+        recvRing.consume(header + len);
+        copyStats.recvCopied += static_cast<quint64>(len);
+        Metrics::count(Metrics::FRAMES_RECEIVED);
+        if (raw)
+            decryptPipeline->submitRaw(buffer, 0, static_cast<int>(len), authNonce(role == CLIENT ? SERVER : CLIENT, recvSequence++));
+        else
+            decryptPipeline->submit(buffer, 0, static_cast<int>(len), (features & Protocol::FEATURE_COMPRESSION) != 0,
+                                    nonceBytes() == 0 ? recvSequence++ : 0, getMaxRecordBytes() + 1);
+    }
+}
+
+void Connection::decryptResultReady()
+{
+    while (!failed && !recordsPaused && decryptPipeline->hasResult()) {
+        CryptoFrame frame(decryptPipeline->takeResult());
+        processFrame(frame.buffer.constData() + frame.offset, frame.length);
+        recvPool.release(frame.buffer);
+    }
+    socketReadyRead();
+}
+
+void Connection::processFrame(const char *data, int length)
+{
+    if (length == CryptoPipeline::DECOMPRESS_FAILED) {
+        fail("Invalid compressed record!");
+        return;
+    }
+    if (length <= 0) {
+        fail(nonceBytes() == 0 ? "A frame failed authentication!" : "The password seems to be incorrect!");
+        return;
+    }
+
+    Protocol::Hello hello;
+    if (!handshakeDone) {
+        if (Protocol::decodeHello(data, length, &hello)) {
+            hello.version = qMin(hello.version, static_cast<int>(Protocol::VERSION));
+            hello.maxFrameSize = qMin(hello.maxFrameSize, localMaxFrameSize);
+            peerHello = hello;
+            if (role == CLIENT)
+                finishHandshake(hello.version, hello.maxFrameSize, hello.features);
+            else
+                emit helloReceived(hello);
+            return;
+        }
+        if (role == CLIENT) {
+            fail("The peer did not answer the protocol handshake, try the legacy protocol.");
+            return;
+        }
+        if (!primary) {
+            fail("The peer did not send a protocol handshake.");
+            return;
+        }
+        finishHandshake(1, Protocol::V1_FRAME_SIZE, 0);
+    }
+
+    // Records are written into buffers of this size further on.
+    if ((protocolVersion >= 2 ? length - 1 : length) > getMaxRecordBytes()) {
+        fail(QString("Invalid record length: %1").arg(length));
+        return;
+    }
+
+    if (protocolVersion >= 2) {
+        const int type = static_cast<unsigned char>(data[0]);
+        if (hasCredit() && type == Protocol::CREDIT) {
+            processCredit(data + 1, length - 1);
+            return;
+        }
+        // Data beyond the grant is refused, so what the peer can make this
+        // side buffer stays within the window. Packed files count as data.
+        if (hasCredit() && (type == Protocol::DATA || type == Protocol::BATCH)) {
+            recvCreditUsed += static_cast<quint64>(length - 1);
+            if (recvCreditUsed > recvCreditLimit + static_cast<quint64>(getMaxRecordBytes())) {
+                fail("The peer sent more data than it was granted!");
+                return;
+            }
+            if (recvCreditUsed >= recvCreditLimit && !windowTimer.isValid()) {
+                ++sendStats.windowStalls;
+                windowTimer.start();
+            }
+        }
+        copyStats.recvPayload += static_cast<quint64>(length - 1);
+        emit recordReceived(type, data + 1, length - 1);
+        return;
+    }
+
+    if (v1ContentRemaining > 0) {
+        v1ContentRemaining -= length;
+        copyStats.recvPayload += static_cast<quint64>(length);
+        emit recordReceived(Protocol::DATA, data, length);
+        return;
+    }
+
+    if (Protocol::decodeHello(data, length, &hello)) {
+        fail("The protocol handshake arrived too late!");
+        return;
+    }
+    Protocol::Metadata metadata;
+    if (!Protocol::decodeMetadata(1, data, length, &metadata)) {
+        fail("Invalid metadata record!");
+        return;
+    }
+    v1ContentRemaining = metadata.fileSize;
+    emit recordReceived(Protocol::METADATA, data, length);
+}
+
+void Connection::socketBytesWritten()
+{
+    const qint64 queued = queuedBytes();
+    if (queued > sendLowWatermark || !canSend())
+        return;
+
+    drained = queued == 0;
+    emit readyToSend();
+}
+
+void Connection::socketDisconnected()
+{
+    if (!failed)
+        emit disconnected();
+}
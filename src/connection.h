@@ -0,0 +1,190 @@
+#ifndef CONNECTION_H
+#define CONNECTION_H
+
+#include <QElapsedTimer>
+#include <QObject>
+#include <QTcpSocket>
+#include <QTimer>
+
+#include "bufferpool.h"
+#include "cryptopipeline.h"
+#include "protocol.h"
+#include "ringbuffer.h"
+
+struct TransferOptions {
+    bool client;
+    bool legacyProtocol;
+    int maxFrameSize;
+    int streams;
+    bool compression;
+    bool delta;
+    bool plaintext;
+    bool preallocate;
+    qint64 sendWindow;
+    qint64 recvWindow;
+    int cryptoThreads;
+    int ioDepth;
+    int durability;
+    bool metrics;
+    int metricsInterval;
+};
+
+struct SendStats {
+    qint64 window;
+    quint64 refills;
+    quint64 underruns;
+    quint64 throttles;
+    quint64 frames;
+    quint64 creditStalls;
+    quint64 creditStallNsecs;
+    quint64 windowStalls;
+    quint64 windowStallNsecs;
+};
+
+struct CompressionStats {
+    quint64 bytesIn;
+    quint64 bytesOut;
+    quint64 compressed;
+    quint64 bypassed;
+    quint64 nsecs;
+};
+
+struct CopyStats {
+    quint64 sendPayload;
+    quint64 sendCopied;
+    quint64 recvPayload;
+    quint64 recvCopied;
+};
+
+Q_DECLARE_METATYPE(SendStats)
+Q_DECLARE_METATYPE(CompressionStats)
+Q_DECLARE_METATYPE(CopyStats)
+
+class Connection : public QObject {
+    Q_OBJECT
+public:
+    enum Role {
+        CLIENT,
+        SERVER
+    };
+    explicit Connection(QTcpSocket *socket, Role role, bool primary, const TransferOptions &options, QObject *parent = nullptr);
+    bool isReady() const;
+    int getProtocolVersion() const;
+    int getFrameSize() const;
+    int getFeatures() const;
+    bool isPlaintext() const;
+    bool hasCredit() const;
+    int getMaxRecordBytes() const;
+    const Protocol::Hello &getPeerHello() const;
+    const SendStats &getSendStats() const;
+    CompressionStats getCompressionStats() const;
+    const CopyStats &getCopyStats() const;
+    int getEncryptQueue() const;
+    int getDecryptQueue() const;
+    qint64 getSocketQueue() const;
+    QHostAddress getPeerAddress() const;
+    quint16 getPeerPort() const;
+    static qint64 getMemoryEstimate(const TransferOptions &options);
+    void start(const Protocol::Hello &hello);
+    void acceptHello(const Protocol::Hello &reply);
+    void close();
+    void shutdown();
+    bool canSend() const;
+    bool isFlushed() const;
+    void beginRefill();
+    void endRefill(bool throttled);
+    char *beginRecord(Protocol::RecordType type, QByteArray *buffer);
+    void commitRecord(QByteArray &buffer, int length);
+    void discardRecord(QByteArray &buffer);
+    void sendRecord(Protocol::RecordType type, const QByteArray &body);
+    void sendFileRecord(Protocol::RecordType type, int fileHandle, qint64 offset, int length, bool hashed = false);
+    void grantCredit(qint64 bytes);
+    void pauseRecords();
+    void resumeRecords();
+signals:
+    void helloReceived(const Protocol::Hello &hello);
+    void handshakeFinished();
+    void recordReceived(int type, const char *data, int length);
+    void readyToSend();
+    void fileRecordHashed(const QByteArray &hash);
+    void errorOccurred(const QString &message);
+    void disconnected();
+private:
+    enum {
+        RECV_RING_FRAMES = 4,
+        HELLO_TIMEOUT = 3000,
+        BYPASS_STREAK = 4,
+        MAX_BYPASS_SKIP = 256
+    };
+    QTcpSocket *socket;
+    Role role;
+    bool primary;
+    bool directSend;
+    bool handshakeDone;
+    Protocol::Hello localHello;
+    Protocol::Hello peerHello;
+    QByteArray publicKey;
+    QByteArray secretKey;
+    int protocolVersion;
+    int localMaxFrameSize;
+    int frameSize;
+    int localFeatures;
+    int features;
+    QTimer *helloTimer;
+    qint64 sendHighWatermark;
+    qint64 sendLowWatermark;
+    qint64 recvWindow;
+    quint64 sendCreditLimit;
+    quint64 sendCreditUsed;
+    quint64 recvCreditLimit;
+    quint64 recvCreditUsed;
+    quint64 recvCreditReleased;
+    SendStats sendStats;
+    CompressionStats compressionStats;
+    CopyStats copyStats;
+    int authStream;
+    quint64 sendSequence;
+    quint64 recvSequence;
+    int bypassStreak;
+    int bypassSkip;
+    CryptoPipeline *encryptPipeline;
+    CryptoPipeline *decryptPipeline;
+    BufferPool sendPool;
+    BufferPool recvPool;
+    RingBuffer recvRing;
+    qint64 v1ContentRemaining;
+    bool drained;
+    bool recordsPaused;
+    QElapsedTimer throttleTimer;
+    QElapsedTimer creditTimer;
+    QElapsedTimer windowTimer;
+    bool failed;
+    int headerBytes() const;
+    int nonceBytes() const;
+    int payloadOffset() const;
+    int maxSealedBytes() const;
+    qint64 queuedBytes() const;
+    void sendHello(const Protocol::Hello &hello);
+    void finishHandshake(int version, int negotiatedFrameSize, int negotiatedFeatures);
+    void helloTimeout();
+    QByteArray authNonce(Role sender, quint64 sequence) const;
+    void writeEncrypt(const QByteArray &data);
+    void writeFrame(const char *data, qint64 length);
+    void writeFileBody(int fileHandle, qint64 offset, qint64 length);
+    void writeRawFrame(CryptoFrame &frame);
+    void submitFrame(QByteArray &buffer, int plainTextLen, bool compress = false);
+    void useCredit(int length);
+    void sendCredit(quint64 limit);
+    void processCredit(const char *data, int length);
+    void updateCompressionStats(const CryptoFrame &frame);
+    void fail(const QString &message);
+    void parseFrames();
+    void processFrame(const char *data, int length);
+    void encryptResultReady();
+    void decryptResultReady();
+    void socketReadyRead();
+    void socketBytesWritten();
+    void socketDisconnected();
+};
+
+#endif // CONNECTION_H
@@ -0,0 +1,48 @@
+QT += network concurrent
+
+INCLUDEPATH += $$PWD
+DEPENDPATH += $$PWD
+
+SOURCES += \
+        $$PWD/bufferpool.cpp \
+        $$PWD/checkpoint.cpp \
+        $$PWD/chunkindex.cpp \
+        $$PWD/compressor.cpp \
+        $$PWD/connection.cpp \
+        $$PWD/crypto.cpp \
+        $$PWD/cryptopipeline.cpp \
+        $$PWD/diskio.cpp \
+        $$PWD/filedigest.cpp \
+        $$PWD/metrics.cpp \
+        $$PWD/peerserver.cpp \
+        $$PWD/protocol.cpp \
+        $$PWD/ringbuffer.cpp \
+        $$PWD/sendjob.cpp \
+        $$PWD/transferengine.cpp \
+        $$PWD/udpsocket.cpp
+
+HEADERS += \
+        $$PWD/bufferpool.h \
+        $$PWD/checkpoint.h \
+        $$PWD/chunkindex.h \
+        $$PWD/compressor.h \
+        $$PWD/connection.h \
+        $$PWD/crypto.h \
+        $$PWD/cryptopipeline.h \
+        $$PWD/diskio.h \
+        $$PWD/filedigest.h \
+        $$PWD/metrics.h \
+        $$PWD/peerserver.h \
+        $$PWD/protocol.h \
+        $$PWD/ringbuffer.h \
+        $$PWD/sendjob.h \
+        $$PWD/transferengine.h \
+        $$PWD/udpsocket.h
+
+LIBS += -lsodium -lzstd
+
+linux:packagesExist(liburing) {
+    CONFIG += link_pkgconfig
+    PKGCONFIG += liburing
+    DEFINES += HAVE_LIBURING
+}
@@ -1,5 +1,8 @@
 #include "crypto.h"
 
+#include <cstring>
+#include <stdexcept>
+
 using namespace std;
 
 bool Crypto::inited = false;
@@ -29,29 +32,201 @@ void Crypto::setPassword(const QString &password)
 
 QByteArray Crypto::encrypt(const QByteArray &plainText)
 {
-    QByteArray nonce(crypto_aead_chacha20poly1305_IETF_NPUBBYTES, 0);
-    randombytes_buf(nonce.data(), static_cast<size_t>(nonce.length()));
-    QByteArray ret(plainText.length() + static_cast<int>(crypto_aead_chacha20poly1305_IETF_ABYTES), 0);
-    unsigned long long cipherTextLen;
-    crypto_aead_chacha20poly1305_ietf_encrypt(reinterpret_cast<unsigned char *>(ret.data()), &cipherTextLen,
-                                              reinterpret_cast<const unsigned char *>(plainText.data()), static_cast<unsigned long long>(plainText.length()),
-                                              nullptr, 0, nullptr, reinterpret_cast<unsigned char *>(nonce.data()),
-                                              reinterpret_cast<unsigned char *>(key.data()));
-    return nonce + ret.left(static_cast<int>(cipherTextLen));
+    QByteArray ret(plainText.length() + OVERHEAD, Qt::Uninitialized);
+    memcpy(ret.data() + NONCE_BYTES, plainText.constData(), static_cast<size_t>(plainText.length()));
+    seal(ret.data(), plainText.length());
+    return ret;
 }
 
 QByteArray Crypto::decrypt(const QByteArray &cipherText)
 {
-    if (static_cast<unsigned int>(cipherText.length()) < crypto_aead_chacha20poly1305_IETF_NPUBBYTES)
-        return QByteArray();
-    QByteArray nonce(cipherText.left(crypto_aead_chacha20poly1305_IETF_NPUBBYTES));
-    QByteArray cipher = cipherText.mid(crypto_aead_chacha20poly1305_IETF_NPUBBYTES);
-    QByteArray ret(cipher.length(), 0);
-    unsigned long long plainTextLen;
-    if (crypto_aead_chacha20poly1305_ietf_decrypt(reinterpret_cast<unsigned char *>(ret.data()), &plainTextLen, nullptr,
-                                                  reinterpret_cast<unsigned char *>(cipher.data()), static_cast<unsigned long long>(cipher.length()),
-                                                  nullptr, 0, reinterpret_cast<unsigned char *>(nonce.data()),
-                                                  reinterpret_cast<unsigned char *>(key.data())) != 0)
+    QByteArray ret(cipherText);
+    const int plainTextLen = open(ret.data(), ret.length());
+    if (plainTextLen <= 0)
         return QByteArray();
-    return ret.left(static_cast<int>(plainTextLen));
+    return ret.mid(NONCE_BYTES, plainTextLen);
+}
+
+int Crypto::seal(char *data, int plainTextLen)
+{
+    unsigned char *nonce = reinterpret_cast<unsigned char *>(data);
+    unsigned char *text = nonce + NONCE_BYTES;
+    randombytes_buf(nonce, NONCE_BYTES);
+    crypto_aead_chacha20poly1305_ietf_encrypt_detached(text, text + plainTextLen, nullptr,
+                                                       text, static_cast<unsigned long long>(plainTextLen),
+                                                       nullptr, 0, nullptr, nonce,
+                                                       reinterpret_cast<const unsigned char *>(key.constData()));
+    return plainTextLen + OVERHEAD;
+}
+
+QByteArray Crypto::generateKeyPair(QByteArray *secretKey)
+{
+    QByteArray ret(crypto_kx_PUBLICKEYBYTES, 0);
+    secretKey->resize(crypto_kx_SECRETKEYBYTES);
+    crypto_kx_keypair(reinterpret_cast<unsigned char *>(ret.data()), reinterpret_cast<unsigned char *>(secretKey->data()));
+    return ret;
+}
+
+QByteArray Crypto::mixKey(const QByteArray &sessionKey)
+{
+    // Only a peer that knows the password can seal a hello, so keying the
+    // exchanged keys with the password binds the session to it.
+    QByteArray ret(KEY_BYTES, 0);
+    crypto_generichash(reinterpret_cast<unsigned char *>(ret.data()), static_cast<size_t>(ret.length()),
+                       reinterpret_cast<const unsigned char *>(sessionKey.constData()), static_cast<unsigned long long>(sessionKey.length()),
+                       reinterpret_cast<const unsigned char *>(key.constData()), static_cast<size_t>(key.length()));
+    return ret;
+}
+
+bool Crypto::deriveSessionKeys(bool client, const QByteArray &publicKey, const QByteArray &secretKey,
+                               const QByteArray &peerPublicKey, QByteArray *recvKey, QByteArray *sendKey)
+{
+    if (publicKey.length() != crypto_kx_PUBLICKEYBYTES || secretKey.length() != crypto_kx_SECRETKEYBYTES
+            || peerPublicKey.length() != crypto_kx_PUBLICKEYBYTES)
+        return false;
+
+    unsigned char rx[crypto_kx_SESSIONKEYBYTES];
+    unsigned char tx[crypto_kx_SESSIONKEYBYTES];
+    const unsigned char *pk = reinterpret_cast<const unsigned char *>(publicKey.constData());
+    const unsigned char *sk = reinterpret_cast<const unsigned char *>(secretKey.constData());
+    const unsigned char *peerPk = reinterpret_cast<const unsigned char *>(peerPublicKey.constData());
+    const int result = client ? crypto_kx_client_session_keys(rx, tx, pk, sk, peerPk) : crypto_kx_server_session_keys(rx, tx, pk, sk, peerPk);
+    if (result == 0) {
+        *recvKey = mixKey(QByteArray(reinterpret_cast<const char *>(rx), sizeof(rx)));
+        *sendKey = mixKey(QByteArray(reinterpret_cast<const char *>(tx), sizeof(tx)));
+    }
+    sodium_memzero(rx, sizeof(rx));
+    sodium_memzero(tx, sizeof(tx));
+    return result == 0;
+}
+
+void Crypto::counterNonce(unsigned char *nonce, quint64 counter)
+{
+    memset(nonce, 0, NONCE_BYTES);
+    for (int i = 0; i < 8; ++i)
+        nonce[NONCE_BYTES - 1 - i] = static_cast<unsigned char>(counter >> (8 * i));
+}
+
+int Crypto::seal(char *data, int plainTextLen, const QByteArray &sessionKey, quint64 counter)
+{
+    unsigned char nonce[NONCE_BYTES];
+    counterNonce(nonce, counter);
+    unsigned char *text = reinterpret_cast<unsigned char *>(data);
+    crypto_aead_chacha20poly1305_ietf_encrypt_detached(text, text + plainTextLen, nullptr,
+                                                       text, static_cast<unsigned long long>(plainTextLen),
+                                                       nullptr, 0, nullptr, nonce,
+                                                       reinterpret_cast<const unsigned char *>(sessionKey.constData()));
+    return plainTextLen + TAG_BYTES;
+}
+
+int Crypto::open(char *data, int sealedLen, const QByteArray &sessionKey, quint64 counter)
+{
+    if (sealedLen < TAG_BYTES)
+        return -1;
+    unsigned char nonce[NONCE_BYTES];
+    counterNonce(nonce, counter);
+    unsigned char *text = reinterpret_cast<unsigned char *>(data);
+    const int plainTextLen = sealedLen - TAG_BYTES;
+    if (crypto_aead_chacha20poly1305_ietf_decrypt_detached(text, nullptr,
+                                                           text, static_cast<unsigned long long>(plainTextLen),
+                                                           text + plainTextLen, nullptr, 0, nonce,
+                                                           reinterpret_cast<const unsigned char *>(sessionKey.constData())) != 0)
+        return -1;
+    return plainTextLen;
+}
+
+bool Crypto::isAesAvailable()
+{
+    return crypto_aead_aes256gcm_is_available() != 0;
+}
+
+QSharedPointer<crypto_aead_aes256gcm_state> Crypto::expandAesKey(const QByteArray &sessionKey)
+{
+    // The expanded key is only read by the workers, so they can share it.
+    // sodium_malloc keeps it aligned and out of swap.
+    QSharedPointer<crypto_aead_aes256gcm_state> ret(
+                static_cast<crypto_aead_aes256gcm_state *>(sodium_malloc(sizeof(crypto_aead_aes256gcm_state))), sodium_free);
+    if (ret.isNull())
+        throw runtime_error("failed to allocate the AES key schedule");
+    crypto_aead_aes256gcm_beforenm(ret.data(), reinterpret_cast<const unsigned char *>(sessionKey.constData()));
+    return ret;
+}
+
+int Crypto::sealAes(char *data, int plainTextLen, const crypto_aead_aes256gcm_state *state, quint64 counter)
+{
+    unsigned char nonce[NONCE_BYTES];
+    counterNonce(nonce, counter);
+    unsigned char *text = reinterpret_cast<unsigned char *>(data);
+    crypto_aead_aes256gcm_encrypt_detached_afternm(text, text + plainTextLen, nullptr,
+                                                   text, static_cast<unsigned long long>(plainTextLen),
+                                                   nullptr, 0, nullptr, nonce, state);
+    return plainTextLen + TAG_BYTES;
+}
+
+int Crypto::openAes(char *data, int sealedLen, const crypto_aead_aes256gcm_state *state, quint64 counter)
+{
+    if (sealedLen < TAG_BYTES)
+        return -1;
+    unsigned char nonce[NONCE_BYTES];
+    counterNonce(nonce, counter);
+    unsigned char *text = reinterpret_cast<unsigned char *>(data);
+    const int plainTextLen = sealedLen - TAG_BYTES;
+    if (crypto_aead_aes256gcm_decrypt_detached_afternm(text, nullptr,
+                                                       text, static_cast<unsigned long long>(plainTextLen),
+                                                       text + plainTextLen, nullptr, 0, nonce, state) != 0)
+        return -1;
+    return plainTextLen;
+}
+
+QByteArray Crypto::deriveAuthKey(const QByteArray &context)
+{
+    return deriveAuthKey(context, key);
+}
+
+QByteArray Crypto::deriveAuthKey(const QByteArray &context, const QByteArray &baseKey)
+{
+    const QByteArray message("snftp-auth" + context);
+    QByteArray ret(AUTH_KEY_BYTES, 0);
+    crypto_generichash(reinterpret_cast<unsigned char *>(ret.data()), static_cast<size_t>(ret.length()),
+                       reinterpret_cast<const unsigned char *>(message.constData()), static_cast<unsigned long long>(message.length()),
+                       reinterpret_cast<const unsigned char *>(baseKey.constData()), static_cast<size_t>(baseKey.length()));
+    return ret;
+}
+
+void Crypto::authenticate(char *tag, const QByteArray &authKey, const QByteArray &nonce,
+                          const char *head, int headLen, const char *body, qint64 bodyLen)
+{
+    // A fresh one-time Poly1305 key per frame, taken from the ChaCha20 keystream.
+    unsigned char polyKey[crypto_onetimeauth_KEYBYTES];
+    crypto_stream_chacha20_ietf(polyKey, sizeof(polyKey), reinterpret_cast<const unsigned char *>(nonce.constData()),
+                                reinterpret_cast<const unsigned char *>(authKey.constData()));
+    crypto_onetimeauth_state state;
+    crypto_onetimeauth_init(&state, polyKey);
+    crypto_onetimeauth_update(&state, reinterpret_cast<const unsigned char *>(head), static_cast<unsigned long long>(headLen));
+    crypto_onetimeauth_update(&state, reinterpret_cast<const unsigned char *>(body), static_cast<unsigned long long>(bodyLen));
+    crypto_onetimeauth_final(&state, reinterpret_cast<unsigned char *>(tag));
+    sodium_memzero(polyKey, sizeof(polyKey));
+}
+
+bool Crypto::verify(const char *tag, const QByteArray &authKey, const QByteArray &nonce,
+                    const char *head, int headLen, const char *body, qint64 bodyLen)
+{
+    char expected[TAG_BYTES];
+    authenticate(expected, authKey, nonce, head, headLen, body, bodyLen);
+    return sodium_memcmp(expected, tag, TAG_BYTES) == 0;
+}
+
+int Crypto::open(char *data, int sealedLen)
+{
+    if (sealedLen < OVERHEAD)
+        return -1;
+    const unsigned char *nonce = reinterpret_cast<unsigned char *>(data);
+    unsigned char *text = reinterpret_cast<unsigned char *>(data) + NONCE_BYTES;
+    const int plainTextLen = sealedLen - OVERHEAD;
+    if (crypto_aead_chacha20poly1305_ietf_decrypt_detached(text, nullptr,
+                                                           text, static_cast<unsigned long long>(plainTextLen),
+                                                           text + plainTextLen, nullptr, 0, nonce,
+                                                           reinterpret_cast<const unsigned char *>(key.constData())) != 0)
+        return -1;
+    return plainTextLen;
 }
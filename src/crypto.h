@@ -1,20 +1,49 @@
 #ifndef CRYPTO_H
 #define CRYPTO_H
 
+#include <QSharedPointer>
 #include <QString>
 
 #include <sodium.h>
 
 class Crypto {
 public:
+    enum {
+        NONCE_BYTES = crypto_aead_chacha20poly1305_IETF_NPUBBYTES,
+        TAG_BYTES = crypto_aead_chacha20poly1305_IETF_ABYTES,
+        OVERHEAD = NONCE_BYTES + TAG_BYTES,
+        KEY_BYTES = crypto_aead_chacha20poly1305_IETF_KEYBYTES,
+        PUBLIC_KEY_BYTES = crypto_kx_PUBLICKEYBYTES,
+        AUTH_KEY_BYTES = crypto_stream_chacha20_ietf_KEYBYTES,
+        AUTH_NONCE_BYTES = crypto_stream_chacha20_ietf_NONCEBYTES
+    };
     static void init();
     static void setPassword(const QString &password);
     static QByteArray encrypt(const QByteArray &plainText);
     static QByteArray decrypt(const QByteArray &cipherText);
+    static int seal(char *data, int plainTextLen);
+    static int open(char *data, int sealedLen);
+    static QByteArray generateKeyPair(QByteArray *secretKey);
+    static bool deriveSessionKeys(bool client, const QByteArray &publicKey, const QByteArray &secretKey,
+                                  const QByteArray &peerPublicKey, QByteArray *recvKey, QByteArray *sendKey);
+    static int seal(char *data, int plainTextLen, const QByteArray &sessionKey, quint64 counter);
+    static int open(char *data, int sealedLen, const QByteArray &sessionKey, quint64 counter);
+    static bool isAesAvailable();
+    static QSharedPointer<crypto_aead_aes256gcm_state> expandAesKey(const QByteArray &sessionKey);
+    static int sealAes(char *data, int plainTextLen, const crypto_aead_aes256gcm_state *state, quint64 counter);
+    static int openAes(char *data, int sealedLen, const crypto_aead_aes256gcm_state *state, quint64 counter);
+    static QByteArray deriveAuthKey(const QByteArray &context);
+    static QByteArray deriveAuthKey(const QByteArray &context, const QByteArray &baseKey);
+    static void authenticate(char *tag, const QByteArray &authKey, const QByteArray &nonce,
+                             const char *head, int headLen, const char *body, qint64 bodyLen);
+    static bool verify(const char *tag, const QByteArray &authKey, const QByteArray &nonce,
+                       const char *head, int headLen, const char *body, qint64 bodyLen);
 private:
     static bool inited;
     const static QByteArray salt;
     static QByteArray key;
+    static void counterNonce(unsigned char *nonce, quint64 counter);
+    static QByteArray mixKey(const QByteArray &sessionKey);
 };
 
 #endif // CRYPTO_H
@@ -0,0 +1,292 @@
+#include "cryptopipeline.h"
+
+#include <QElapsedTimer>
+#include <QtConcurrent>
+
+#include <cerrno>
+
+#ifdef Q_OS_UNIX
+#include <unistd.h>
+#endif
+
+#include "compressor.h"
+#include "crypto.h"
+#include "metrics.h"
+#include "protocol.h"
+
+using namespace std;
+
+namespace {
+
+// Without a session key frames carry a random nonce, with one the nonce is
+// the frame counter and is left off the wire.
+struct SealJob {
+    char *data;
+    int length;
+    int capacity;
+    bool transform;
+    QByteArray key;
+    QSharedPointer<crypto_aead_aes256gcm_state> aesState;
+    quint64 counter;
+    atomic<quint64> *nsecs;
+};
+
+struct AuthJob {
+    char *data;
+    int length;
+    QByteArray key;
+    QByteArray nonce;
+    int fileHandle;
+    qint64 fileOffset;
+    qint64 fileLength;
+    char *hash;
+};
+
+}
+
+static int sealWithKey(const SealJob &job, int length)
+{
+    if (job.key.isEmpty())
+        return Crypto::seal(job.data, length);
+    if (!job.aesState.isNull())
+        return Crypto::sealAes(job.data, length, job.aesState.data(), job.counter);
+    return Crypto::seal(job.data, length, job.key, job.counter);
+}
+
+static int openWithKey(const SealJob &job)
+{
+    if (job.key.isEmpty())
+        return Crypto::open(job.data, job.length);
+    if (!job.aesState.isNull())
+        return Crypto::openAes(job.data, job.length, job.aesState.data(), job.counter);
+    return Crypto::open(job.data, job.length, job.key, job.counter);
+}
+
+static int sealRecord(const SealJob &job)
+{
+    Metrics::Timer metricsTimer(Metrics::ENCRYPT);
+    char *record = job.key.isEmpty() ? job.data + Crypto::NONCE_BYTES : job.data;
+    int length = job.length;
+    if (job.transform && length > 1) {
+        QElapsedTimer timer;
+        timer.start();
+        const int bodyLen = Compressor::compress(record + 1, length - 1);
+        if (bodyLen >= 0) {
+            record[0] = static_cast<char>(Protocol::DATA_COMPRESSED);
+            length = bodyLen + 1;
+        }
+        job.nsecs->fetch_add(static_cast<quint64>(timer.nsecsElapsed()), memory_order_relaxed);
+    }
+    return sealWithKey(job, length);
+}
+
+static int openRecord(const SealJob &job)
+{
+    Metrics::Timer metricsTimer(Metrics::DECRYPT);
+    const int ret = openWithKey(job);
+    char *record = job.key.isEmpty() ? job.data + Crypto::NONCE_BYTES : job.data;
+    if (ret <= 0 || !job.transform || record[0] != static_cast<char>(Protocol::DATA_COMPRESSED))
+        return ret;
+
+    QElapsedTimer timer;
+    timer.start();
+    const int bodyLen = Compressor::decompress(record + 1, ret - 1, job.capacity - 1);
+    job.nsecs->fetch_add(static_cast<quint64>(timer.nsecsElapsed()), memory_order_relaxed);
+    if (bodyLen < 0)
+        return CryptoPipeline::DECOMPRESS_FAILED;
+    record[0] = static_cast<char>(Protocol::DATA);
+    return bodyLen + 1;
+}
+
+// Plaintext records are [tag][type][body], the body of a sent record stays in
+// the file and is read for authentication. It is not mapped, since a file
+// truncated while it is sent would then kill the process with SIGBUS. The
+// same read gives the record's piece of the file digest, if asked for.
+static int signFileRecord(const AuthJob &job)
+{
+    Metrics::Timer metricsTimer(Metrics::ENCRYPT);
+    char *tag = job.data;
+    const char *head = job.data + Crypto::TAG_BYTES;
+#ifdef Q_OS_UNIX
+    QByteArray body(static_cast<int>(job.fileLength), Qt::Uninitialized);
+    for (qint64 done = 0; done < job.fileLength;) {
+        const ssize_t ret = pread(job.fileHandle, body.data() + done, static_cast<size_t>(job.fileLength - done),
+                                  static_cast<off_t>(job.fileOffset + done));
+        if (ret < 0 && errno == EINTR)
+            continue;
+        if (ret <= 0)
+            return -1;
+        done += ret;
+    }
+    Crypto::authenticate(tag, job.key, job.nonce, head, job.length, body.constData(), job.fileLength);
+    if (job.hash != nullptr)
+        crypto_generichash(reinterpret_cast<unsigned char *>(job.hash), Protocol::DIGEST_BYTES,
+                           reinterpret_cast<const unsigned char *>(body.constData()), static_cast<unsigned long long>(job.fileLength), nullptr, 0);
+    return Crypto::TAG_BYTES + job.length;
+#else
+    Q_UNUSED(tag);
+    Q_UNUSED(head);
+    return -1;
+#endif
+}
+
+static int verifyRecord(const AuthJob &job)
+{
+    Metrics::Timer metricsTimer(Metrics::DECRYPT);
+    if (job.length < Crypto::TAG_BYTES + 1)
+        return CryptoPipeline::OPEN_FAILED;
+    const char *record = job.data + Crypto::TAG_BYTES;
+    if (!Crypto::verify(job.data, job.key, job.nonce, record, 1, record + 1, job.length - Crypto::TAG_BYTES - 1))
+        return CryptoPipeline::OPEN_FAILED;
+    return job.length - Crypto::TAG_BYTES;
+}
+
+CryptoPipeline::CryptoPipeline(Direction direction, int workers, QObject *parent) :
+    QObject(parent),
+    direction(direction),
+    pendingBytes(0),
+    transformNsecs(0)
+{
+    pool.setMaxThreadCount(qMax(workers, 1));
+}
+
+CryptoPipeline::~CryptoPipeline()
+{
+    while (!jobs.isEmpty()) {
+        Job job = jobs.dequeue();
+        job.watcher->waitForFinished();
+        delete job.watcher;
+#ifdef Q_OS_UNIX
+        if (job.frame.fileHandle >= 0)
+            close(job.frame.fileHandle);
+#endif
+    }
+}
+
+int CryptoPipeline::getWorkers() const
+{
+    return pool.maxThreadCount();
+}
+
+int CryptoPipeline::getPending() const
+{
+    return jobs.length();
+}
+
+qint64 CryptoPipeline::getPendingBytes() const
+{
+    return pendingBytes;
+}
+
+quint64 CryptoPipeline::getTransformNsecs() const
+{
+    return transformNsecs;
+}
+
+bool CryptoPipeline::isFull() const
+{
+    return jobs.length() >= pool.maxThreadCount() * 2;
+}
+
+void CryptoPipeline::setKey(const QByteArray &key, bool aes)
+{
+    this->key = key;
+    aesState = aes && !key.isEmpty() ? Crypto::expandAesKey(key) : QSharedPointer<crypto_aead_aes256gcm_state>();
+}
+
+void CryptoPipeline::setAuthKey(const QByteArray &key)
+{
+    authKey = key;
+}
+
+CryptoPipeline::Job CryptoPipeline::newJob(QByteArray &buffer, int offset, int length)
+{
+    Job job;
+    job.watcher = new QFutureWatcher<int>(this);
+    job.frame.buffer.swap(buffer);
+    job.frame.offset = offset;
+    job.frame.length = length;
+    job.frame.sourceLength = length;
+    job.frame.transform = false;
+    job.frame.raw = false;
+    job.frame.hashed = false;
+    job.frame.fileHandle = -1;
+    job.frame.fileOffset = 0;
+    job.frame.fileLength = 0;
+    job.skip = 0;
+    connect(job.watcher, &QFutureWatcher<int>::finished, this, &CryptoPipeline::resultReady);
+    return job;
+}
+
+// A decompressed record may grow to maxLength, or to the end of the buffer
+// if it is 0.
+void CryptoPipeline::submit(QByteArray &buffer, int offset, int length, bool transform, quint64 counter, int maxLength)
+{
+    Job job(newJob(buffer, offset, length));
+    job.frame.transform = transform;
+    job.skip = key.isEmpty() ? Crypto::NONCE_BYTES : 0;
+
+    SealJob sealJob;
+    sealJob.data = job.frame.buffer.data() + offset;
+    sealJob.length = length;
+    sealJob.capacity = job.frame.buffer.length() - offset - job.skip;
+    if (maxLength > 0)
+        sealJob.capacity = qMin(sealJob.capacity, maxLength);
+    sealJob.transform = transform;
+    sealJob.key = key;
+    sealJob.aesState = aesState;
+    sealJob.counter = counter;
+    sealJob.nsecs = &transformNsecs;
+    if (direction == ENCRYPT)
+        job.watcher->setFuture(QtConcurrent::run(&pool, sealRecord, sealJob));
+    else
+        job.watcher->setFuture(QtConcurrent::run(&pool, openRecord, sealJob));
+    jobs.enqueue(job);
+    pendingBytes += length;
+}
+
+void CryptoPipeline::submitRaw(QByteArray &buffer, int offset, int length, const QByteArray &nonce,
+                               int fileHandle, qint64 fileOffset, qint64 fileLength, bool hashed)
+{
+    Job job(newJob(buffer, offset, length));
+    job.frame.raw = true;
+    job.skip = Crypto::TAG_BYTES;
+    job.frame.fileHandle = fileHandle;
+    job.frame.fileOffset = fileOffset;
+    job.frame.fileLength = fileLength;
+    job.frame.hashed = hashed;
+
+    AuthJob authJob;
+    authJob.data = job.frame.buffer.data() + offset;
+    authJob.length = length;
+    authJob.key = authKey;
+    authJob.nonce = nonce;
+    authJob.fileHandle = fileHandle;
+    authJob.fileOffset = fileOffset;
+    authJob.fileLength = fileLength;
+    authJob.hash = hashed ? authJob.data + Crypto::TAG_BYTES + length : nullptr;
+    if (direction == ENCRYPT)
+        job.watcher->setFuture(QtConcurrent::run(&pool, signFileRecord, authJob));
+    else
+        job.watcher->setFuture(QtConcurrent::run(&pool, verifyRecord, authJob));
+    jobs.enqueue(job);
+    pendingBytes += length + fileLength;
+}
+
+bool CryptoPipeline::hasResult() const
+{
+    return !jobs.isEmpty() && jobs.head().watcher->isFinished();
+}
+
+CryptoFrame CryptoPipeline::takeResult()
+{
+    Job job = jobs.dequeue();
+    pendingBytes -= job.frame.length + job.frame.fileLength;
+    const int result = job.watcher->result();
+    job.watcher->deleteLater();
+
+    if (direction == DECRYPT)
+        job.frame.offset += job.skip;
+    job.frame.length = result;
+    return job.frame;
+}
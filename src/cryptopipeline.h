@@ -0,0 +1,72 @@
+#ifndef CRYPTOPIPELINE_H
+#define CRYPTOPIPELINE_H
+
+#include <QByteArray>
+#include <QFutureWatcher>
+#include <QObject>
+#include <QQueue>
+#include <QSharedPointer>
+#include <QThreadPool>
+
+#include <atomic>
+
+#include <sodium.h>
+
+struct CryptoFrame {
+    QByteArray buffer;
+    int offset;
+    int length;
+    int sourceLength;
+    bool transform;
+    bool raw;
+    bool hashed;
+    int fileHandle;
+    qint64 fileOffset;
+    qint64 fileLength;
+};
+
+class CryptoPipeline : public QObject {
+    Q_OBJECT
+public:
+    enum Direction {
+        ENCRYPT,
+        DECRYPT
+    };
+    enum {
+        OPEN_FAILED = -1,
+        DECOMPRESS_FAILED = -2
+    };
+    explicit CryptoPipeline(Direction direction, int workers, QObject *parent = nullptr);
+    ~CryptoPipeline();
+    int getWorkers() const;
+    int getPending() const;
+    qint64 getPendingBytes() const;
+    quint64 getTransformNsecs() const;
+    bool isFull() const;
+    void setKey(const QByteArray &key, bool aes = false);
+    void setAuthKey(const QByteArray &key);
+    void submit(QByteArray &buffer, int offset, int length, bool transform = false, quint64 counter = 0, int maxLength = 0);
+    void submitRaw(QByteArray &buffer, int offset, int length, const QByteArray &nonce,
+                   int fileHandle = -1, qint64 fileOffset = 0, qint64 fileLength = 0, bool hashed = false);
+    bool hasResult() const;
+    CryptoFrame takeResult();
+signals:
+    void resultReady();
+private:
+    struct Job {
+        QFutureWatcher<int> *watcher;
+        CryptoFrame frame;
+        int skip;
+    };
+    Direction direction;
+    QThreadPool pool;
+    QQueue<Job> jobs;
+    QByteArray key;
+    QSharedPointer<crypto_aead_aes256gcm_state> aesState;
+    QByteArray authKey;
+    qint64 pendingBytes;
+    std::atomic<quint64> transformNsecs;
+    Job newJob(QByteArray &buffer, int offset, int length);
+};
+
+#endif // CRYPTOPIPELINE_H
@@ -0,0 +1,343 @@
+#include "diskio.h"
+
+#include <QFile>
+#include <QtConcurrent>
+
+#include <cerrno>
+
+#ifdef Q_OS_UNIX
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+#ifdef Q_OS_LINUX
+#include <linux/falloc.h>
+#endif
+
+#ifdef HAVE_LIBURING
+#include <liburing.h>
+#include <sys/eventfd.h>
+#endif
+
+#include "metrics.h"
+
+using namespace std;
+
+DiskIo::DiskIo(int queueDepth, QObject *parent) :
+    QObject(parent),
+    queueDepth(qBound(1, queueDepth, static_cast<int>(MAX_QUEUE_DEPTH))),
+    running(0),
+    nextTicket(1),
+    ring(nullptr),
+    eventFd(-1),
+    notifier(nullptr)
+{
+    pool.setMaxThreadCount(this->queueDepth);
+#ifdef HAVE_LIBURING
+    // The pool takes over when the kernel has no io_uring or a sandbox
+    // forbids it.
+    ring = new io_uring;
+    eventFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (eventFd < 0 || io_uring_queue_init(RING_ENTRIES, ring, 0) < 0) {
+        delete ring;
+        ring = nullptr;
+    } else if (io_uring_register_eventfd(ring, eventFd) < 0) {
+        io_uring_queue_exit(ring);
+        delete ring;
+        ring = nullptr;
+    }
+    if (ring == nullptr) {
+        if (eventFd >= 0)
+            close(eventFd);
+        eventFd = -1;
+        return;
+    }
+    notifier = new QSocketNotifier(eventFd, QSocketNotifier::Read, this);
+    connect(notifier, &QSocketNotifier::activated, this, &DiskIo::reap);
+#endif
+}
+
+DiskIo::~DiskIo()
+{
+    drain();
+#ifdef HAVE_LIBURING
+    if (ring != nullptr) {
+        delete notifier;
+        io_uring_queue_exit(ring);
+        delete ring;
+        close(eventFd);
+    }
+#endif
+}
+
+int DiskIo::getQueueDepth() const
+{
+    return queueDepth;
+}
+
+int DiskIo::getPending() const
+{
+    return ops.size();
+}
+
+// Finished operations whose results have not been taken yet do not count,
+// so a reader waiting on the network never holds up the writers.
+bool DiskIo::canSubmit() const
+{
+    return running < queueDepth;
+}
+
+quint64 DiskIo::read(int handle, qint64 offset, QByteArray &buffer, int bufferOffset, int length)
+{
+    return submit(READ, handle, offset, buffer, bufferOffset, length);
+}
+
+quint64 DiskIo::write(int handle, qint64 offset, QByteArray &buffer, int bufferOffset, int length)
+{
+    return submit(WRITE, handle, offset, buffer, bufferOffset, length);
+}
+
+quint64 DiskIo::sync(int handle, Durability durability)
+{
+    QByteArray buffer;
+    return submit(durability == DURABILITY_FULL ? SYNC_FULL : SYNC_DATA, handle, 0, buffer, 0, 0);
+}
+
+bool DiskIo::isFinished(quint64 ticket) const
+{
+    QHash<quint64, Op>::const_iterator it = ops.constFind(ticket);
+    if (it == ops.constEnd())
+        return true;
+    return it->finished || (it->watcher != nullptr && it->watcher->isFinished());
+}
+
+void DiskIo::waitFor(quint64 ticket)
+{
+    QHash<quint64, Op>::iterator it = ops.find(ticket);
+    if (it == ops.end() || it->finished)
+        return;
+    if (it->watcher != nullptr) {
+        it->watcher->waitForFinished();
+        complete(*it, it->watcher->result());
+        return;
+    }
+#ifdef HAVE_LIBURING
+    // Other operations may complete on the way, the owner hears about them
+    // once it is back in the event loop.
+    bool completedOthers = false;
+    while (!ops[ticket].finished) {
+        io_uring_cqe *cqe;
+        if (io_uring_wait_cqe(ring, &cqe) < 0)
+            break;
+        completedOthers = processCompletions() || completedOthers;
+    }
+    if (completedOthers)
+        QMetaObject::invokeMethod(this, "completed", Qt::QueuedConnection);
+#endif
+}
+
+qint64 DiskIo::takeResult(quint64 ticket, QByteArray *buffer)
+{
+    if (!ops.contains(ticket))
+        return -EINVAL;
+    waitFor(ticket);
+    Op op(ops.take(ticket));
+    if (op.watcher != nullptr)
+        op.watcher->deleteLater();
+    if (buffer != nullptr)
+        buffer->swap(op.buffer);
+    return op.result;
+}
+
+void DiskIo::drain()
+{
+    foreach (quint64 ticket, ops.keys())
+        waitFor(ticket);
+}
+
+void DiskIo::willNeed(int handle, qint64 offset, qint64 length)
+{
+#ifdef Q_OS_LINUX
+    posix_fadvise(handle, static_cast<off_t>(offset), static_cast<off_t>(length), POSIX_FADV_WILLNEED);
+#else
+    Q_UNUSED(handle);
+    Q_UNUSED(offset);
+    Q_UNUSED(length);
+#endif
+}
+
+bool DiskIo::syncNow(int handle, Durability durability)
+{
+#ifdef Q_OS_LINUX
+    if (durability == DURABILITY_DATA)
+        return fdatasync(handle) == 0;
+#endif
+#ifdef Q_OS_UNIX
+    if (durability != DURABILITY_NONE)
+        return fsync(handle) == 0;
+#else
+    Q_UNUSED(handle);
+    Q_UNUSED(durability);
+#endif
+    return true;
+}
+
+// Either way the range reads back as zeros, false means the file system
+// cannot do it.
+bool DiskIo::punchHole(int handle, qint64 offset, qint64 length, bool keepAllocated)
+{
+#ifdef Q_OS_LINUX
+    const int mode = (keepAllocated ? FALLOC_FL_ZERO_RANGE : FALLOC_FL_PUNCH_HOLE) | FALLOC_FL_KEEP_SIZE;
+    return fallocate(handle, mode, static_cast<off_t>(offset), static_cast<off_t>(length)) == 0;
+#else
+    Q_UNUSED(handle);
+    Q_UNUSED(offset);
+    Q_UNUSED(length);
+    Q_UNUSED(keepAllocated);
+    return false;
+#endif
+}
+
+quint64 DiskIo::submit(Type type, int handle, qint64 offset, QByteArray &buffer, int bufferOffset, int length)
+{
+    const quint64 ticket = nextTicket++;
+    Op &op = ops[ticket];
+    op.type = type;
+    op.handle = handle;
+    op.offset = offset;
+    op.buffer.swap(buffer);
+    op.bufferOffset = bufferOffset;
+    op.length = length;
+    op.done = 0;
+    op.result = 0;
+    op.finished = false;
+    op.watcher = nullptr;
+    op.timer.start();
+    ++running;
+    start(ticket, op);
+    return ticket;
+}
+
+void DiskIo::start(quint64 ticket, Op &op)
+{
+    char *data = op.buffer.data() + op.bufferOffset + op.done;
+    const qint64 offset = op.offset + op.done;
+    const int length = op.length - op.done;
+#ifdef HAVE_LIBURING
+    if (ring != nullptr) {
+        io_uring_sqe *sqe = io_uring_get_sqe(ring);
+        if (sqe == nullptr) {
+            io_uring_submit(ring);
+            sqe = io_uring_get_sqe(ring);
+        }
+        if (sqe != nullptr) {
+            if (op.type == READ)
+                io_uring_prep_read(sqe, op.handle, data, static_cast<unsigned>(length), static_cast<__u64>(offset));
+            else if (op.type == WRITE)
+                io_uring_prep_write(sqe, op.handle, data, static_cast<unsigned>(length), static_cast<__u64>(offset));
+            else
+                io_uring_prep_fsync(sqe, op.handle, op.type == SYNC_DATA ? IORING_FSYNC_DATASYNC : 0);
+            sqe->user_data = ticket;
+            io_uring_submit(ring);
+            return;
+        }
+    }
+#endif
+#ifdef Q_OS_UNIX
+    op.watcher = new QFutureWatcher<qint64>(this);
+    connect(op.watcher, &QFutureWatcher<qint64>::finished, this, [this, ticket]() {
+        watcherFinished(ticket);
+    });
+    op.watcher->setFuture(QtConcurrent::run(&pool, &DiskIo::run, op.type, op.handle, offset, data, length));
+#else
+    // Without positional calls a handle has one file position, so the calls
+    // stay on the owner's thread.
+    Q_UNUSED(ticket);
+    complete(op, run(op.type, op.handle, offset, data, length));
+    QMetaObject::invokeMethod(this, "completed", Qt::QueuedConnection);
+#endif
+}
+
+qint64 DiskIo::run(Type type, int handle, qint64 offset, char *data, int length)
+{
+    if (type == SYNC_DATA || type == SYNC_FULL)
+        return syncNow(handle, type == SYNC_FULL ? DURABILITY_FULL : DURABILITY_DATA) ? 0 : -errno;
+#ifdef Q_OS_UNIX
+    int done = 0;
+    while (done < length) {
+        const ssize_t ret = type == READ ? pread(handle, data + done, static_cast<size_t>(length - done), static_cast<off_t>(offset + done))
+                                         : pwrite(handle, data + done, static_cast<size_t>(length - done), static_cast<off_t>(offset + done));
+        if (ret < 0 && errno == EINTR)
+            continue;
+        if (ret < 0)
+            return -errno;
+        if (ret == 0)
+            break;
+        done += static_cast<int>(ret);
+    }
+    return done;
+#else
+    QFile file;
+    if (!file.open(handle, type == READ ? QIODevice::ReadOnly : QIODevice::WriteOnly, QFileDevice::DontCloseHandle) || !file.seek(offset))
+        return -EIO;
+    const qint64 ret = type == READ ? file.read(data, length) : file.write(data, length);
+    return ret < 0 ? -EIO : ret;
+#endif
+}
+
+void DiskIo::complete(Op &op, qint64 result)
+{
+    op.result = result < 0 ? result : op.done + result;
+    op.finished = true;
+    --running;
+    if (op.type == READ)
+        Metrics::record(Metrics::READ, op.timer.nsecsElapsed());
+    else if (op.type == WRITE)
+        Metrics::record(Metrics::WRITE, op.timer.nsecsElapsed());
+}
+
+// A short read or write is continued from where it stopped, a read that
+// reaches the end of the file finishes with what it has.
+bool DiskIo::processCompletions()
+{
+    bool ret = false;
+#ifdef HAVE_LIBURING
+    io_uring_cqe *cqe;
+    while (io_uring_peek_cqe(ring, &cqe) == 0) {
+        const quint64 ticket = cqe->user_data;
+        const int res = cqe->res;
+        io_uring_cqe_seen(ring, cqe);
+        QHash<quint64, Op>::iterator it = ops.find(ticket);
+        if (it == ops.end() || it->finished)
+            continue;
+        if ((it->type == READ || it->type == WRITE) && res > 0 && it->done + res < it->length) {
+            it->done += res;
+            start(ticket, *it);
+            continue;
+        }
+        complete(*it, res);
+        ret = true;
+    }
+#endif
+    return ret;
+}
+
+void DiskIo::reap()
+{
+#ifdef HAVE_LIBURING
+    quint64 value;
+    const ssize_t ret = ::read(eventFd, &value, sizeof(value));
+    Q_UNUSED(ret);
+#endif
+    if (processCompletions())
+        emit completed();
+}
+
+void DiskIo::watcherFinished(quint64 ticket)
+{
+    QHash<quint64, Op>::iterator it = ops.find(ticket);
+    if (it == ops.end() || it->finished)
+        return;
+    complete(*it, it->watcher->result());
+    emit completed();
+}
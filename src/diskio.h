@@ -0,0 +1,88 @@
+#ifndef DISKIO_H
+#define DISKIO_H
+
+#include <QByteArray>
+#include <QElapsedTimer>
+#include <QFutureWatcher>
+#include <QHash>
+#include <QObject>
+#include <QSocketNotifier>
+#include <QThreadPool>
+
+struct io_uring;
+
+// Positional reads, writes and syncs that complete in the background, so the
+// engine can keep reading ahead of the sockets and writing behind them. Each
+// submission swaps its buffer in and returns a ticket, and takeResult() swaps
+// it back. With liburing the owner thread submits to an io_uring and reaps
+// completions through an eventfd, otherwise a thread pool runs the calls.
+class DiskIo : public QObject {
+    Q_OBJECT
+public:
+    enum Durability {
+        DURABILITY_NONE,
+        DURABILITY_DATA,
+        DURABILITY_FULL
+    };
+    enum {
+        DEFAULT_QUEUE_DEPTH = 8,
+        MAX_QUEUE_DEPTH = 256
+    };
+    explicit DiskIo(int queueDepth, QObject *parent = nullptr);
+    ~DiskIo();
+    int getQueueDepth() const;
+    int getPending() const;
+    bool canSubmit() const;
+    quint64 read(int handle, qint64 offset, QByteArray &buffer, int bufferOffset, int length);
+    quint64 write(int handle, qint64 offset, QByteArray &buffer, int bufferOffset, int length);
+    quint64 sync(int handle, Durability durability);
+    bool isFinished(quint64 ticket) const;
+    void waitFor(quint64 ticket);
+    qint64 takeResult(quint64 ticket, QByteArray *buffer = nullptr);
+    void drain();
+    static void willNeed(int handle, qint64 offset, qint64 length);
+    static bool syncNow(int handle, Durability durability);
+    static bool punchHole(int handle, qint64 offset, qint64 length, bool keepAllocated);
+signals:
+    void completed();
+private:
+    enum {
+        RING_ENTRIES = 2 * MAX_QUEUE_DEPTH
+    };
+    enum Type {
+        READ,
+        WRITE,
+        SYNC_DATA,
+        SYNC_FULL
+    };
+    struct Op {
+        Type type;
+        int handle;
+        qint64 offset;
+        QByteArray buffer;
+        int bufferOffset;
+        int length;
+        int done;
+        qint64 result;
+        bool finished;
+        QFutureWatcher<qint64> *watcher;
+        QElapsedTimer timer;
+    };
+    int queueDepth;
+    int running;
+    quint64 nextTicket;
+    QHash<quint64, Op> ops;
+    QThreadPool pool;
+    io_uring *ring;
+    int eventFd;
+    QSocketNotifier *notifier;
+    quint64 submit(Type type, int handle, qint64 offset, QByteArray &buffer, int bufferOffset, int length);
+    void start(quint64 ticket, Op &op);
+    static qint64 run(Type type, int handle, qint64 offset, char *data, int length);
+    void complete(Op &op, qint64 result);
+    bool processCompletions();
+    void reap();
+    void watcherFinished(quint64 ticket);
+};
+
+#endif // DISKIO_H
@@ -0,0 +1,45 @@
+#include "filedigest.h"
+
+#include <sodium.h>
+
+#include "protocol.h"
+
+using namespace std;
+
+void FileDigest::addPiece(qint64 offset, qint64 length, const QByteArray &hash)
+{
+    if (length > 0)
+        pieces.insert(offset, qMakePair(length, hash));
+}
+
+void FileDigest::clear()
+{
+    pieces.clear();
+}
+
+QByteArray FileDigest::getDigest() const
+{
+    // Pieces are hashed wherever their bytes pass through, in any order, and
+    // combined here by offset so that both peers agree on the result.
+    crypto_generichash_state state;
+    crypto_generichash_init(&state, nullptr, 0, Protocol::DIGEST_BYTES);
+    char header[16];
+    for (QMap<qint64, QPair<qint64, QByteArray> >::const_iterator it = pieces.constBegin(); it != pieces.constEnd(); ++it) {
+        Protocol::putUInt64(header, static_cast<quint64>(it.key()));
+        Protocol::putUInt64(header + 8, static_cast<quint64>(it.value().first));
+        crypto_generichash_update(&state, reinterpret_cast<const unsigned char *>(header), sizeof(header));
+        crypto_generichash_update(&state, reinterpret_cast<const unsigned char *>(it.value().second.constData()),
+                                  static_cast<unsigned long long>(it.value().second.length()));
+    }
+    QByteArray ret(Protocol::DIGEST_BYTES, 0);
+    crypto_generichash_final(&state, reinterpret_cast<unsigned char *>(ret.data()), Protocol::DIGEST_BYTES);
+    return ret;
+}
+
+QByteArray FileDigest::hash(const QByteArray &data)
+{
+    QByteArray ret(Protocol::DIGEST_BYTES, 0);
+    crypto_generichash(reinterpret_cast<unsigned char *>(ret.data()), Protocol::DIGEST_BYTES,
+                       reinterpret_cast<const unsigned char *>(data.constData()), static_cast<unsigned long long>(data.length()), nullptr, 0);
+    return ret;
+}
@@ -0,0 +1,18 @@
+#ifndef FILEDIGEST_H
+#define FILEDIGEST_H
+
+#include <QByteArray>
+#include <QMap>
+#include <QPair>
+
+class FileDigest {
+public:
+    void addPiece(qint64 offset, qint64 length, const QByteArray &hash);
+    void clear();
+    QByteArray getDigest() const;
+    static QByteArray hash(const QByteArray &data);
+private:
+    QMap<qint64, QPair<qint64, QByteArray> > pieces;
+};
+
+#endif // FILEDIGEST_H
@@ -4,63 +4,67 @@
 #include <QFileInfo>
 #include <QMessageBox>
 
-#include "crypto.h"
+static QString formatRate(double rate, qint64 remaining)
+{
+    QString ret(QString("%1 MB/s").arg(rate / 1e6, 0, 'f', 1));
+    if (remaining > 0 && rate >= 1) {
+        const qint64 seconds = static_cast<qint64>(remaining / rate);
+        ret += QString(" - ETA %1:%2").arg(seconds / 60).arg(seconds % 60, 2, 10, QChar('0'));
+    }
+    return ret;
+}
 
-MainWidget::MainWidget(const QString &savePath, QTcpSocket *socket, QWidget *parent) :
+MainWidget::MainWidget(const QString &savePath, QTcpSocket *socket, QTcpServer *server, const TransferOptions &options, QWidget *parent) :
     QWidget(parent),
     ui(new Ui::MainWidget),
-    saveDir(savePath),
-    socket(socket),
-    curJobIndex(0),
-    recvState(METADATA)
+    engine(new TransferEngine(savePath, socket, server, options)),
+    recvListModel("Receiving"),
+    sendListModel("Sending"),
+    lastBytesSent(0),
+    lastBytesReceived(0),
+    sendRate(0),
+    recvRate(0)
 {
     ui->setupUi(this);
-    socket->setParent(this);
-    socket->setSocketOption(QTcpSocket::LowDelayOption, 1);
 
     ui->receiveListView->setEditTriggers(QAbstractItemView::NoEditTriggers);
     ui->sendListView->setEditTriggers(QAbstractItemView::NoEditTriggers);
-    ui->receiveListView->setModel(&recvStringListModel);
-    ui->sendListView->setModel(&sendStringListModel);
-
-    connect(socket, &QTcpSocket::readyRead, this, &MainWidget::socketReadyRead);
-    connect(socket, &QTcpSocket::bytesWritten, this, &MainWidget::socketBytesWritten);
-    connect(socket, &QTcpSocket::disconnected, this, &MainWidget::socketDisconnected);
+    ui->receiveListView->setUniformItemSizes(true);
+    ui->sendListView->setUniformItemSizes(true);
+    ui->receiveListView->setModel(&recvListModel);
+    ui->sendListView->setModel(&sendListModel);
+
+    engine->moveToThread(&engineThread);
+    connect(&engineThread, &QThread::finished, engine, &QObject::deleteLater);
+    connect(ui->sendListView, &QListView::doubleClicked, this, &MainWidget::sendListViewDoubleClicked);
+    connect(this, &MainWidget::sendJobsAdded, engine, &TransferEngine::addSendJobs);
+    connect(this, &MainWidget::sendJobPriorityChanged, engine, &TransferEngine::setSendJobPriority);
+    connect(engine, &TransferEngine::sendJobStarted, this, &MainWidget::engineSendJobStarted);
+    connect(engine, &TransferEngine::sendJobFinished, this, &MainWidget::engineSendJobFinished);
+    connect(engine, &TransferEngine::sendProgress, ui->sendProgressBar, &QProgressBar::setValue);
+    connect(engine, &TransferEngine::sendStatsChanged, this, &MainWidget::engineSendStatsChanged);
+    connect(engine, &TransferEngine::compressionStatsChanged, this, &MainWidget::engineCompressionStatsChanged);
+    connect(engine, &TransferEngine::copyStatsChanged, this, &MainWidget::engineCopyStatsChanged);
+    connect(engine, &TransferEngine::metricsChanged, this, &MainWidget::engineMetricsChanged);
+    connect(engine, &TransferEngine::recvJobStarted, this, &MainWidget::engineRecvJobStarted);
+    connect(engine, &TransferEngine::recvJobFinished, this, &MainWidget::engineRecvJobFinished);
+    connect(engine, &TransferEngine::recvProgress, ui->receiveProgressBar, &QProgressBar::setValue);
+    connect(engine, &TransferEngine::protocolNegotiated, this, &MainWidget::engineProtocolNegotiated);
+    connect(engine, &TransferEngine::errorOccurred, this, &MainWidget::engineErrorOccurred);
+    connect(engine, &TransferEngine::disconnected, this, &MainWidget::engineDisconnected);
+    metricsElapsed.start();
+    engineThread.start();
+    QMetaObject::invokeMethod(engine, "start", Qt::QueuedConnection);
 }
 
 MainWidget::~MainWidget()
 {
+    disconnect(engine, nullptr, this, nullptr);
+    engineThread.quit();
+    engineThread.wait();
     delete ui;
 }
 
-void MainWidget::socketWriteEncrypt(const QByteArray &data)
-{
-    QByteArray cipherText = Crypto::encrypt(data);
-    const quint16 len = static_cast<quint16>(cipherText.length());
-    QByteArray lenBytes(2, 0);
-    lenBytes[0] = static_cast<char>(static_cast<unsigned char>(len >> 8));
-    lenBytes[1] = static_cast<char>(static_cast<unsigned char>(len & 0xFF));
-    cipherText = lenBytes + cipherText;
-    socket->write(cipherText);
-}
-
-void MainWidget::updateSendListView()
-{
-    QStringList sendStringList;
-    for (int i = 0; i < sendJobs.length(); ++i) {
-        QString entry(sendJobs[i]->getFilename() + " - ");
-        if (i < curJobIndex)
-            entry += "Done";
-        else if (i == curJobIndex)
-            entry += "Sending";
-        else
-            entry += "Waiting";
-        sendStringList.append(entry);
-    }
-    sendStringListModel.setStringList(sendStringList);
-    ui->sendListView->scrollToBottom();
-}
-
 void MainWidget::dragEnterEvent(QDragEnterEvent *e)
 {
     if (e->mimeData()->hasUrls())
@@ -69,126 +73,115 @@ void MainWidget::dragEnterEvent(QDragEnterEvent *e)
 
 void MainWidget::dropEvent(QDropEvent *e)
 {
-    const bool stopped = curJobIndex == sendJobs.length();
+    QStringList paths;
+    QStringList filenames;
 
     foreach (const QUrl &url, e->mimeData()->urls()) {
         const QString filename(url.toLocalFile());
         const QFileInfo info(filename);
-        if (!info.isFile()) {
-            QMessageBox::warning(this, "Warning", QString("%1 is not a file!").arg(filename));
+        if (!info.isFile() && !info.isDir()) {
+            QMessageBox::warning(this, "Warning", QString("%1 is not a file or directory!").arg(filename));
             continue;
         }
         if (!info.isReadable()) {
             QMessageBox::warning(this, "Warning", QString("%1 is not readable!").arg(filename));
             continue;
         }
-        if (info.size() == 0) {
-            QMessageBox::warning(this, "Warning", QString("%1 is an empty file!").arg(filename));
-            continue;
-        }
-        sendJobs.append(new SendJob(filename));
+        SendJob::collect(filename, &paths, &filenames);
     }
 
-    updateSendListView();
+    sendListModel.append(filenames);
+    ui->sendListView->scrollToBottom();
 
-    if (stopped)
-        socketBytesWritten();
+    if (!paths.isEmpty())
+        emit sendJobsAdded(paths, filenames);
 }
 
-void MainWidget::socketReadyRead()
+void MainWidget::sendListViewDoubleClicked(const QModelIndex &index)
 {
-    recvBuffer += socket->readAll();
+    if (sendListModel.getState(index.row()) != TransferListModel::WAITING)
+        return;
+    sendListModel.setPrioritized(index.row(), true);
+    emit sendJobPriorityChanged(index.row(), TransferEngine::MAX_PRIORITY);
+}
 
-    for (;;) {
-        const quint16 len = static_cast<quint16>((static_cast<unsigned char>(recvBuffer[0]) << 8) | static_cast<unsigned char>(recvBuffer[1]));
-        if (recvBuffer.length() < len + 2)
-            break;
+void MainWidget::engineSendJobStarted(int index)
+{
+    sendListModel.setState(index, TransferListModel::ACTIVE);
+}
 
-        const QByteArray buf(Crypto::decrypt(recvBuffer.mid(2, len)));
-        recvBuffer = recvBuffer.mid(len + 2);
-        if (buf.length() == 0) {
-            QMessageBox::critical(this, "Error", QString("The password seems to be incorrect!"));
-            close();
-        }
+void MainWidget::engineSendJobFinished(int index)
+{
+    sendListModel.setState(index, TransferListModel::DONE);
+}
 
-        if (recvState == METADATA) {
-            const QByteArray len(buf.left(8));
-            recvFileLen = 0;
-            for (int i = 0; i < len.length(); ++i) {
-                recvFileLen <<= 8;
-                recvFileLen |= static_cast<unsigned char>(len[i]);
-            }
-
-            bytesRecved = 0;
-
-            const QString filename(QString::fromUtf8(buf.mid(8)));
-            const QString path(saveDir.absoluteFilePath(filename));
-            recvFile.setFileName(path);
-            if (!recvFile.open(QIODevice::WriteOnly)) {
-                QMessageBox::critical(this, "Error", QString("Error opening file: %1").arg(path));
-                close();
-            }
-
-            QStringList recvStringList(recvStringListModel.stringList());
-            recvStringList.append(filename + " - Receiving");
-            recvStringListModel.setStringList(recvStringList);
-            ui->receiveListView->scrollToBottom();
-
-            recvState = CONTENT;
-        } else if (recvState == CONTENT) {
-            recvFile.write(buf);
-
-            bytesRecved += buf.length();
-            ui->receiveProgressBar->setValue(static_cast<int>(bytesRecved * 100 / recvFileLen));
-            if (recvFileLen == bytesRecved) {
-                recvFile.close();
-
-                QStringList recvStringList(recvStringListModel.stringList());
-                QString back(recvStringList.back());
-                back = back.left(back.length() - 9);
-                back += "Done";
-                recvStringList.pop_back();
-                recvStringList.append(back);
-                recvStringListModel.setStringList(recvStringList);
-                ui->receiveListView->scrollToBottom();
-
-                recvState = METADATA;
-            }
-        }
-    }
+void MainWidget::engineSendStatsChanged(const SendStats &stats)
+{
+    ui->sendStatsLabel->setText(QString("Window: %1 KiB - Refills: %2 - Underruns: %3 - Throttled: %4"
+                                        " - Out of Credit: %5 ms - Peer Out of Credit: %6 ms")
+                                .arg(stats.window / 1024)
+                                .arg(stats.refills)
+                                .arg(stats.underruns)
+                                .arg(stats.throttles)
+                                .arg(stats.creditStallNsecs / 1000000)
+                                .arg(stats.windowStallNsecs / 1000000));
 }
 
-void MainWidget::socketBytesWritten()
+void MainWidget::engineCompressionStatsChanged(const CompressionStats &stats)
 {
-    if (socket->bytesToWrite() > 0 || curJobIndex == sendJobs.length())
+    if (stats.bytesIn == 0)
         return;
+    ui->compressionStatsLabel->setText(QString("Compression: %1x - Compressed: %2 - Bypassed: %3 - CPU: %4 ms/GiB")
+                                       .arg(static_cast<double>(stats.bytesIn) / qMax(stats.bytesOut, static_cast<quint64>(1)), 0, 'f', 2)
+                                       .arg(stats.compressed)
+                                       .arg(stats.bypassed)
+                                       .arg(stats.nsecs / 1e6 / (stats.bytesIn / 1073741824.0), 0, 'f', 0));
+}
 
-    SendJob &curJob = *sendJobs[curJobIndex];
-    if (!curJob.metadataSent) {
-        qint64 fileSize = curJob.getFileSize();
-        const QString filename(curJob.getFilename());
-        QByteArray data(8, 0);
-        for (int i = data.length() - 1; i >= 0; --i) {
-            data[i] = static_cast<char>(static_cast<unsigned char>(fileSize & 0xFF));
-            fileSize >>= 8;
-        }
-        data += filename.toUtf8();
-        socketWriteEncrypt(data);
-        curJob.metadataSent = true;
+void MainWidget::engineCopyStatsChanged(const CopyStats &stats)
+{
+    ui->copyStatsLabel->setText(QString("Copied per GiB: Send %1 GiB - Receive %2 GiB")
+                                .arg(static_cast<double>(stats.sendCopied) / qMax(stats.sendPayload, static_cast<quint64>(1)), 0, 'f', 2)
+                                .arg(static_cast<double>(stats.recvCopied) / qMax(stats.recvPayload, static_cast<quint64>(1)), 0, 'f', 2));
+}
 
-        return;
-    }
+void MainWidget::engineMetricsChanged(const MetricsSnapshot &metrics)
+{
+    // Smooth the rates a little so that the ETA does not jump around.
+    const double seconds = qMax(metricsElapsed.restart(), static_cast<qint64>(1)) / 1000.0;
+    sendRate = 0.7 * sendRate + 0.3 * ((metrics.bytesSent - lastBytesSent) / seconds);
+    recvRate = 0.7 * recvRate + 0.3 * ((metrics.bytesReceived - lastBytesReceived) / seconds);
+    lastBytesSent = metrics.bytesSent;
+    lastBytesReceived = metrics.bytesReceived;
+    ui->sendRateLabel->setText(formatRate(sendRate, metrics.sendBytesTotal - metrics.bytesSent));
+    ui->receiveRateLabel->setText(formatRate(recvRate, metrics.recvBytesTotal - metrics.bytesReceived));
+}
 
-    socketWriteEncrypt(curJob.read(64000));
-    ui->sendProgressBar->setValue(static_cast<int>(curJob.getBytesRead() * 100 / curJob.getFileSize()));
+void MainWidget::engineRecvJobStarted(int id, const QString &filename)
+{
+    recvRows.insert(id, recvListModel.append(QStringList(filename), TransferListModel::ACTIVE));
+    ui->receiveListView->scrollToBottom();
+}
 
-    if (curJob.atEnd()) {
-        ++curJobIndex;
-        updateSendListView();
-    }
+void MainWidget::engineRecvJobFinished(int id)
+{
+    recvListModel.setState(recvRows.take(id), TransferListModel::DONE);
+}
+
+void MainWidget::engineProtocolNegotiated(int version, int frameSize, int streams, bool compression)
+{
+    setWindowTitle(QString("snftp - Protocol v%1, %2 KiB Frames, %3 Streams%4").arg(version).arg(frameSize / 1024).arg(streams)
+                   .arg(compression ? ", zstd" : ""));
+    ui->compressionStatsLabel->setVisible(compression);
+}
+
+void MainWidget::engineErrorOccurred(const QString &message)
+{
+    QMessageBox::critical(this, "Error", message);
+    close();
 }
 
-void MainWidget::socketDisconnected()
+void MainWidget::engineDisconnected()
 {
     QMessageBox::information(this, "Error", QString("Socket disconnected!"));
     close();
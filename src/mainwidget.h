@@ -1,15 +1,17 @@
 #ifndef MAINWIDGET_H
 #define MAINWIDGET_H
 
-#include <QDir>
 #include <QDragEnterEvent>
+#include <QElapsedTimer>
 #include <QMimeData>
-#include <QStringListModel>
+#include <QHash>
+#include <QTcpServer>
 #include <QTcpSocket>
-#include <QVector>
+#include <QThread>
 #include <QWidget>
 
-#include "sendjob.h"
+#include "transferengine.h"
+#include "transferlistmodel.h"
 
 namespace Ui {
     class MainWidget;
@@ -18,32 +20,38 @@ namespace Ui {
 class MainWidget : public QWidget {
     Q_OBJECT
 public:
-    explicit MainWidget(const QString &savePath, QTcpSocket *socket, QWidget *parent = nullptr);
+    explicit MainWidget(const QString &savePath, QTcpSocket *socket, QTcpServer *server, const TransferOptions &options, QWidget *parent = nullptr);
     ~MainWidget();
+signals:
+    void sendJobsAdded(const QStringList &paths, const QStringList &filenames);
+    void sendJobPriorityChanged(int index, int priority);
 private:
     Ui::MainWidget *ui;
-    QDir saveDir;
-    QTcpSocket *socket;
-    QVector<SendJob *> sendJobs;
-    int curJobIndex;
-    enum {
-        METADATA,
-        CONTENT
-    } recvState;
-    QByteArray recvBuffer;
-    qint64 recvFileLen;
-    qint64 bytesRecved;
-    QFile recvFile;
-    QStringListModel recvStringListModel;
-    QStringListModel sendStringListModel;
-    void socketWriteEncrypt(const QByteArray &data);
-    void updateSendListView();
+    QThread engineThread;
+    TransferEngine *engine;
+    QHash<int, int> recvRows;
+    TransferListModel recvListModel;
+    TransferListModel sendListModel;
+    QElapsedTimer metricsElapsed;
+    qint64 lastBytesSent;
+    qint64 lastBytesReceived;
+    double sendRate;
+    double recvRate;
 protected:
     void dragEnterEvent(QDragEnterEvent *e);
     void dropEvent(QDropEvent *e);
-    void socketReadyRead();
-    void socketBytesWritten();
-    void socketDisconnected();
+    void sendListViewDoubleClicked(const QModelIndex &index);
+    void engineSendJobStarted(int index);
+    void engineSendJobFinished(int index);
+    void engineSendStatsChanged(const SendStats &stats);
+    void engineCompressionStatsChanged(const CompressionStats &stats);
+    void engineCopyStatsChanged(const CopyStats &stats);
+    void engineMetricsChanged(const MetricsSnapshot &metrics);
+    void engineRecvJobStarted(int id, const QString &filename);
+    void engineRecvJobFinished(int id);
+    void engineProtocolNegotiated(int version, int frameSize, int streams, bool compression);
+    void engineErrorOccurred(const QString &message);
+    void engineDisconnected();
 };
 
 #endif // MAINWIDGET_H
@@ -0,0 +1,181 @@
+#include "metrics.h"
+
+#include <QTextStream>
+
+#include <atomic>
+#include <limits>
+
+using namespace std;
+
+namespace {
+
+atomic<bool> enabled(false);
+atomic<quint64> counters[Metrics::COUNTER_COUNT];
+atomic<quint64> counts[Metrics::HISTOGRAM_COUNT];
+atomic<quint64> nsecs[Metrics::HISTOGRAM_COUNT];
+atomic<quint64> buckets[Metrics::HISTOGRAM_COUNT][Metrics::BUCKETS];
+
+const char *const histogramNames[Metrics::HISTOGRAM_COUNT] = {
+    "read",
+    "encrypt",
+    "decrypt",
+    "write",
+    "backpressure",
+    "credit_stall",
+    "window_stall"
+};
+
+}
+
+Metrics::Timer::Timer(Histogram histogram) :
+    histogram(histogram)
+{
+    if (Metrics::isEnabled())
+        timer.start();
+    else
+        timer.invalidate();
+}
+
+Metrics::Timer::~Timer()
+{
+    if (timer.isValid())
+        Metrics::record(histogram, timer.nsecsElapsed());
+}
+
+bool Metrics::isEnabled()
+{
+    return enabled.load(memory_order_relaxed);
+}
+
+void Metrics::setEnabled(bool enabled)
+{
+    ::enabled.store(enabled, memory_order_relaxed);
+}
+
+void Metrics::count(Counter counter, quint64 value)
+{
+    if (isEnabled())
+        counters[counter].fetch_add(value, memory_order_relaxed);
+}
+
+void Metrics::record(Histogram histogram, qint64 nsecs)
+{
+    if (!isEnabled())
+        return;
+    // Bucket i holds durations of at most 2^i microseconds, the last one
+    // everything longer.
+    const quint64 micros = static_cast<quint64>(qMax(nsecs, static_cast<qint64>(0))) / 1000;
+    int bucket = 0;
+    while (bucket < BUCKETS - 1 && (static_cast<quint64>(1) << bucket) < micros)
+        ++bucket;
+    buckets[histogram][bucket].fetch_add(1, memory_order_relaxed);
+    counts[histogram].fetch_add(1, memory_order_relaxed);
+    ::nsecs[histogram].fetch_add(static_cast<quint64>(qMax(nsecs, static_cast<qint64>(0))), memory_order_relaxed);
+}
+
+void Metrics::snapshot(MetricsSnapshot *snapshot)
+{
+    for (int i = 0; i < COUNTER_COUNT; ++i)
+        snapshot->counters[i] = counters[i].load(memory_order_relaxed);
+    for (int i = 0; i < HISTOGRAM_COUNT; ++i) {
+        snapshot->counts[i] = counts[i].load(memory_order_relaxed);
+        snapshot->nsecs[i] = nsecs[i].load(memory_order_relaxed);
+        for (int j = 0; j < BUCKETS; ++j)
+            snapshot->buckets[i][j] = buckets[i][j].load(memory_order_relaxed);
+    }
+}
+
+double Metrics::bucketBound(int bucket)
+{
+    if (bucket >= BUCKETS - 1)
+        return numeric_limits<double>::infinity();
+    return static_cast<double>(static_cast<quint64>(1) << bucket) / 1e6;
+}
+
+double Metrics::getQuantile(const MetricsSnapshot &snapshot, Histogram histogram, double quantile)
+{
+    const quint64 total = snapshot.counts[histogram];
+    if (total == 0)
+        return 0;
+    const double target = quantile * static_cast<double>(total);
+    quint64 seen = 0;
+    for (int i = 0; i < BUCKETS - 1; ++i) {
+        seen += snapshot.buckets[histogram][i];
+        if (static_cast<double>(seen) >= target)
+            return bucketBound(i);
+    }
+    return bucketBound(BUCKETS - 2);
+}
+
+QJsonObject Metrics::toJson(const MetricsSnapshot &snapshot)
+{
+    QJsonObject stages;
+    for (int i = 0; i < HISTOGRAM_COUNT; ++i) {
+        const Histogram histogram = static_cast<Histogram>(i);
+        stages.insert(histogramNames[i], QJsonObject{{"count", static_cast<double>(snapshot.counts[i])},
+                                                     {"seconds", snapshot.nsecs[i] / 1e9},
+                                                     {"p50", getQuantile(snapshot, histogram, 0.5)},
+                                                     {"p99", getQuantile(snapshot, histogram, 0.99)}});
+    }
+    return QJsonObject{{"framesSent", static_cast<double>(snapshot.counters[FRAMES_SENT])},
+                       {"framesReceived", static_cast<double>(snapshot.counters[FRAMES_RECEIVED])},
+                       {"bytesSent", snapshot.bytesSent},
+                       {"sendBytesTotal", snapshot.sendBytesTotal},
+                       {"bytesReceived", snapshot.bytesReceived},
+                       {"receiveBytesTotal", snapshot.recvBytesTotal},
+                       {"encryptQueue", snapshot.encryptQueue},
+                       {"decryptQueue", snapshot.decryptQueue},
+                       {"diskQueue", snapshot.diskQueue},
+                       {"socketQueue", snapshot.socketQueue},
+                       {"stages", stages}};
+}
+
+QString Metrics::toPrometheus(const MetricsSnapshot &snapshot)
+{
+    QString ret;
+    QTextStream out(&ret);
+    out << "# HELP snftp_frames_sent_total Frames handed to the sockets.\n"
+        << "# TYPE snftp_frames_sent_total counter\n"
+        << "snftp_frames_sent_total " << snapshot.counters[FRAMES_SENT] << '\n'
+        << "# HELP snftp_frames_received_total Frames parsed from the sockets.\n"
+        << "# TYPE snftp_frames_received_total counter\n"
+        << "snftp_frames_received_total " << snapshot.counters[FRAMES_RECEIVED] << '\n'
+        << "# HELP snftp_sent_bytes File bytes sent in the current session.\n"
+        << "# TYPE snftp_sent_bytes gauge\n"
+        << "snftp_sent_bytes " << snapshot.bytesSent << '\n'
+        << "# HELP snftp_send_size_bytes File bytes queued for sending in the current session.\n"
+        << "# TYPE snftp_send_size_bytes gauge\n"
+        << "snftp_send_size_bytes " << snapshot.sendBytesTotal << '\n'
+        << "# HELP snftp_received_bytes File bytes received in the current session.\n"
+        << "# TYPE snftp_received_bytes gauge\n"
+        << "snftp_received_bytes " << snapshot.bytesReceived << '\n'
+        << "# HELP snftp_receive_size_bytes File bytes announced by the peer in the current session.\n"
+        << "# TYPE snftp_receive_size_bytes gauge\n"
+        << "snftp_receive_size_bytes " << snapshot.recvBytesTotal << '\n'
+        << "# HELP snftp_queue_depth Frames waiting in the crypto pipelines.\n"
+        << "# TYPE snftp_queue_depth gauge\n"
+        << "snftp_queue_depth{queue=\"encrypt\"} " << snapshot.encryptQueue << '\n'
+        << "snftp_queue_depth{queue=\"decrypt\"} " << snapshot.decryptQueue << '\n'
+        << "# HELP snftp_socket_queue_bytes Bytes written to the sockets but not yet sent.\n"
+        << "# TYPE snftp_socket_queue_bytes gauge\n"
+        << "snftp_socket_queue_bytes " << snapshot.socketQueue << '\n'
+        << "# HELP snftp_disk_queue_depth File reads and writes submitted but not yet collected.\n"
+        << "# TYPE snftp_disk_queue_depth gauge\n"
+        << "snftp_disk_queue_depth " << snapshot.diskQueue << '\n'
+        << "# HELP snftp_stage_duration_seconds Time spent per call in each stage of the data path.\n"
+        << "# TYPE snftp_stage_duration_seconds histogram\n";
+    for (int i = 0; i < HISTOGRAM_COUNT; ++i) {
+        quint64 cumulative = 0;
+        for (int j = 0; j < BUCKETS; ++j) {
+            cumulative += snapshot.buckets[i][j];
+            const QString bound = j < BUCKETS - 1 ? QString::number(bucketBound(j), 'g', 6) : QString("+Inf");
+            out << "snftp_stage_duration_seconds_bucket{stage=\"" << histogramNames[i] << "\",le=\"" << bound << "\"} "
+                << cumulative << '\n';
+        }
+        out << "snftp_stage_duration_seconds_sum{stage=\"" << histogramNames[i] << "\"} "
+            << QString::number(snapshot.nsecs[i] / 1e9, 'g', 9) << '\n'
+            << "snftp_stage_duration_seconds_count{stage=\"" << histogramNames[i] << "\"} " << cumulative << '\n';
+    }
+    out.flush();
+    return ret;
+}
@@ -0,0 +1,70 @@
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <QElapsedTimer>
+#include <QJsonObject>
+#include <QMetaType>
+#include <QString>
+
+struct MetricsSnapshot;
+
+// Process-wide counters and latency histograms for the hot path. Recording is
+// a relaxed atomic flag test while disabled, so call sites need no guards.
+class Metrics {
+public:
+    enum Histogram {
+        READ,
+        ENCRYPT,
+        DECRYPT,
+        WRITE,
+        BACKPRESSURE,
+        CREDIT_STALL,
+        WINDOW_STALL,
+        HISTOGRAM_COUNT
+    };
+    enum Counter {
+        FRAMES_SENT,
+        FRAMES_RECEIVED,
+        COUNTER_COUNT
+    };
+    enum {
+        BUCKETS = 24
+    };
+    class Timer {
+    public:
+        explicit Timer(Histogram histogram);
+        ~Timer();
+    private:
+        Histogram histogram;
+        QElapsedTimer timer;
+    };
+    static bool isEnabled();
+    static void setEnabled(bool enabled);
+    static void count(Counter counter, quint64 value = 1);
+    static void record(Histogram histogram, qint64 nsecs);
+    static void snapshot(MetricsSnapshot *snapshot);
+    static double getQuantile(const MetricsSnapshot &snapshot, Histogram histogram, double quantile);
+    static QJsonObject toJson(const MetricsSnapshot &snapshot);
+    static QString toPrometheus(const MetricsSnapshot &snapshot);
+private:
+    static double bucketBound(int bucket);
+};
+
+struct MetricsSnapshot {
+    quint64 counters[Metrics::COUNTER_COUNT];
+    quint64 counts[Metrics::HISTOGRAM_COUNT];
+    quint64 nsecs[Metrics::HISTOGRAM_COUNT];
+    quint64 buckets[Metrics::HISTOGRAM_COUNT][Metrics::BUCKETS];
+    qint64 bytesSent;
+    qint64 sendBytesTotal;
+    qint64 bytesReceived;
+    qint64 recvBytesTotal;
+    int encryptQueue;
+    int decryptQueue;
+    int diskQueue;
+    qint64 socketQueue;
+};
+
+Q_DECLARE_METATYPE(MetricsSnapshot)
+
+#endif // METRICS_H
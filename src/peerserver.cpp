@@ -0,0 +1,257 @@
+#include "peerserver.h"
+
+#include "crypto.h"
+#include "protocol.h"
+
+PeerServer::PeerServer(const QString &savePath, const TransferOptions &options, int workers, int maxSessions,
+                       qint64 connectionMemory, QObject *parent) :
+    QObject(parent),
+    saveDir(savePath),
+    options(options),
+    maxSessions(qMax(maxSessions, 1)),
+    server(nullptr),
+    workerLoads(qMax(workers, 1), 0),
+    routeTimer(new QTimer(this)),
+    nextSession(0)
+{
+    qRegisterMetaType<QTcpSocket *>();
+    this->options.client = false;
+
+    // Shrink frames, then the send and receive windows, until a connection
+    // fits its budget.
+    while (Connection::getMemoryEstimate(this->options) > connectionMemory && this->options.maxFrameSize > Protocol::MIN_FRAME_SIZE)
+        this->options.maxFrameSize = qMax(this->options.maxFrameSize / 2, static_cast<int>(Protocol::MIN_FRAME_SIZE));
+    while (Connection::getMemoryEstimate(this->options) > connectionMemory && this->options.sendWindow > Protocol::V1_FRAME_SIZE)
+        this->options.sendWindow = qMax(this->options.sendWindow / 2, static_cast<qint64>(Protocol::V1_FRAME_SIZE));
+    while (Connection::getMemoryEstimate(this->options) > connectionMemory && this->options.recvWindow > Protocol::V1_FRAME_SIZE)
+        this->options.recvWindow = qMax(this->options.recvWindow / 2, static_cast<qint64>(Protocol::V1_FRAME_SIZE));
+
+    for (int i = 0; i < workerLoads.length(); ++i) {
+        QThread *thread = new QThread(this);
+        thread->start();
+        this->workers.append(thread);
+    }
+    clock.start();
+    routeTimer->setInterval(ROUTE_TIMEOUT / 4);
+    connect(routeTimer, &QTimer::timeout, this, &PeerServer::routeTimeout);
+}
+
+PeerServer::~PeerServer()
+{
+    foreach (const Session &session, sessions) {
+        session.engine->disconnect(this);
+        session.engine->deleteLater();
+    }
+    foreach (QThread *thread, workers) {
+        thread->quit();
+        thread->wait();
+    }
+}
+
+bool PeerServer::listen(const QHostAddress &address, quint16 port)
+{
+    if (server == nullptr) {
+        server = new QTcpServer(this);
+        connect(server, &QTcpServer::newConnection, this, &PeerServer::serverNewConnection);
+    }
+    return server->listen(address, port);
+}
+
+QString PeerServer::getErrorString() const
+{
+    return server != nullptr ? server->errorString() : QString();
+}
+
+int PeerServer::getSessionCount() const
+{
+    return sessions.size();
+}
+
+void PeerServer::serverNewConnection()
+{
+    while (server->hasPendingConnections()) {
+        QTcpSocket *socket = server->nextPendingConnection();
+        if (pendingSockets.size() >= MAX_PENDING_SOCKETS) {
+            reject(socket, "Too many connections waiting for a handshake.");
+            continue;
+        }
+        pendingSockets.insert(socket, clock.elapsed());
+        connect(socket, &QTcpSocket::readyRead, this, &PeerServer::socketReadyRead);
+        connect(socket, &QTcpSocket::disconnected, this, &PeerServer::socketDisconnected);
+        if (!routeTimer->isActive())
+            routeTimer->start();
+        if (socket->bytesAvailable() > 0)
+            routeSocket(socket, false);
+    }
+}
+
+void PeerServer::socketReadyRead()
+{
+    QTcpSocket *socket = qobject_cast<QTcpSocket *>(sender());
+    if (pendingSockets.contains(socket))
+        routeSocket(socket, false);
+}
+
+void PeerServer::socketDisconnected()
+{
+    QTcpSocket *socket = qobject_cast<QTcpSocket *>(sender());
+    if (pendingSockets.remove(socket) > 0)
+        socket->deleteLater();
+}
+
+void PeerServer::routeTimeout()
+{
+    const qint64 now = clock.elapsed();
+    QList<QTcpSocket *> expired;
+    for (QHash<QTcpSocket *, qint64>::const_iterator it = pendingSockets.constBegin(); it != pendingSockets.constEnd(); ++it)
+        if (now - it.value() >= ROUTE_TIMEOUT)
+            expired.append(it.key());
+    foreach (QTcpSocket *socket, expired)
+        routeSocket(socket, true);
+    if (pendingSockets.isEmpty())
+        routeTimer->stop();
+}
+
+// The first frame of a connection is the client's password-sealed hello, it
+// is peeked rather than read so that the engine still sees all of it. Legacy
+// clients send no hello and start a session of their own.
+void PeerServer::routeSocket(QTcpSocket *socket, bool timedOut)
+{
+    Protocol::Hello hello;
+    bool decoded = false;
+    char header[Protocol::V1_HEADER_BYTES];
+    if (socket->peek(header, sizeof(header)) == static_cast<qint64>(sizeof(header))) {
+        const qint64 frameBytes = Protocol::V1_HEADER_BYTES + Protocol::getUInt16(header);
+        if (socket->bytesAvailable() < frameBytes && !timedOut)
+            return;
+        const QByteArray frame(socket->peek(frameBytes));
+        if (frame.length() == frameBytes) {
+            const QByteArray plainText(Crypto::decrypt(frame.mid(Protocol::V1_HEADER_BYTES)));
+            decoded = !plainText.isEmpty() && Protocol::decodeHello(plainText.constData(), plainText.length(), &hello);
+        }
+    } else if (!timedOut) {
+        return;
+    }
+
+    pendingSockets.remove(socket);
+    disconnect(socket, nullptr, this, nullptr);
+    if (!decoded || hello.streamIndex == 0) {
+        startSession(socket, decoded ? hello.sessionId : QByteArray());
+        return;
+    }
+
+    const QHash<QByteArray, int>::const_iterator it = sessionIds.constFind(hello.sessionId);
+    if (hello.sessionId.isEmpty() || it == sessionIds.constEnd()) {
+        reject(socket, "The stream belongs to no running session.");
+        return;
+    }
+    TransferEngine *engine = sessions[it.value()].engine;
+    socket->setParent(nullptr);
+    socket->moveToThread(engine->thread());
+    QMetaObject::invokeMethod(engine, "addStream", Qt::QueuedConnection, Q_ARG(QTcpSocket *, socket));
+}
+
+void PeerServer::reject(QTcpSocket *socket, const QString &reason)
+{
+    emit peerRejected(socket->peerAddress().toString(), reason);
+    socket->abort();
+    socket->deleteLater();
+}
+
+void PeerServer::startSession(QTcpSocket *socket, const QByteArray &sessionId)
+{
+    if (sessions.size() >= maxSessions) {
+        reject(socket, QString("Already receiving from %1 peers.").arg(maxSessions));
+        return;
+    }
+    if (!sessionId.isEmpty() && sessionIds.contains(sessionId)) {
+        reject(socket, "The session is already running.");
+        return;
+    }
+
+    Session session;
+    session.dirName = newDirName(socket->peerAddress());
+    if (!saveDir.mkpath(session.dirName)) {
+        reject(socket, QString("Unable to create %1").arg(saveDir.absoluteFilePath(session.dirName)));
+        return;
+    }
+    session.worker = 0;
+    for (int i = 1; i < workerLoads.length(); ++i)
+        if (workerLoads[i] < workerLoads[session.worker])
+            session.worker = i;
+    session.sessionId = sessionId;
+
+    const int id = nextSession++;
+    const QString address(socket->peerAddress().toString());
+    const quint16 port = socket->peerPort();
+    const QString savePath(saveDir.absoluteFilePath(session.dirName));
+    socket->setParent(nullptr);
+    TransferEngine *engine = new TransferEngine(savePath, socket, nullptr, options);
+    session.engine = engine;
+
+    connect(engine, &TransferEngine::recvJobStarted, this, [this, id](int recvId, const QString &filename) {
+        const QHash<int, Session>::iterator it = sessions.find(id);
+        if (it == sessions.end())
+            return;
+        it->recvFilenames.insert(recvId, filename);
+        emit recvJobStarted(id, filename);
+    });
+    connect(engine, &TransferEngine::recvJobFinished, this, [this, id](int recvId) {
+        const QHash<int, Session>::iterator it = sessions.find(id);
+        if (it != sessions.end())
+            emit recvJobFinished(id, it->recvFilenames.take(recvId));
+    });
+    // These run on the worker, where the engine can still be asked how it
+    // ended.
+    connect(engine, &TransferEngine::errorOccurred, engine, [this, engine, id](const QString &message) {
+        QMetaObject::invokeMethod(this, "finishSession", Qt::QueuedConnection, Q_ARG(int, id), Q_ARG(bool, false),
+                                  Q_ARG(QString, message), Q_ARG(qint64, engine->getBytesReceived()));
+    });
+    connect(engine, &TransferEngine::disconnected, engine, [this, engine, id]() {
+        const bool idle = engine->isIdle();
+        QMetaObject::invokeMethod(this, "finishSession", Qt::QueuedConnection, Q_ARG(int, id), Q_ARG(bool, idle),
+                                  Q_ARG(QString, idle ? QString() : QString("The peer disconnected in the middle of a transfer.")),
+                                  Q_ARG(qint64, engine->getBytesReceived()));
+    });
+
+    engine->moveToThread(workers[session.worker]);
+    ++workerLoads[session.worker];
+    sessions.insert(id, session);
+    if (!sessionId.isEmpty())
+        sessionIds.insert(sessionId, id);
+    emit sessionStarted(id, address, port, savePath);
+    QMetaObject::invokeMethod(engine, "start", Qt::QueuedConnection);
+}
+
+void PeerServer::finishSession(int session, bool ok, const QString &message, qint64 bytesReceived)
+{
+    const QHash<int, Session>::iterator it = sessions.find(session);
+    if (it == sessions.end())
+        return;
+    it->engine->disconnect(this);
+    it->engine->deleteLater();
+    --workerLoads[it->worker];
+    if (!it->sessionId.isEmpty())
+        sessionIds.remove(it->sessionId);
+    sessions.erase(it);
+    emit sessionFinished(session, ok, message, bytesReceived);
+}
+
+QString PeerServer::newDirName(const QHostAddress &address) const
+{
+    bool isIPv4;
+    const quint32 ipv4 = address.toIPv4Address(&isIPv4);
+    QString base(isIPv4 ? QHostAddress(ipv4).toString() : address.toString());
+    base.replace(':', '_');
+    base.replace('%', '_');
+
+    QString ret(base);
+    for (int i = 2; ; ++i) {
+        bool used = false;
+        foreach (const Session &session, sessions)
+            used = used || session.dirName == ret;
+        if (!used)
+            return ret;
+        ret = QString("%1-%2").arg(base).arg(i);
+    }
+}
@@ -0,0 +1,69 @@
+#ifndef PEERSERVER_H
+#define PEERSERVER_H
+
+#include <QDir>
+#include <QElapsedTimer>
+#include <QHash>
+#include <QObject>
+#include <QTcpServer>
+#include <QTcpSocket>
+#include <QThread>
+#include <QTimer>
+#include <QVector>
+
+#include "transferengine.h"
+
+// Receives from many peers at once. Every session gets its own engine and
+// save directory, and the engines share a fixed pool of worker threads.
+class PeerServer : public QObject {
+    Q_OBJECT
+public:
+    explicit PeerServer(const QString &savePath, const TransferOptions &options, int workers, int maxSessions,
+                        qint64 connectionMemory, QObject *parent = nullptr);
+    ~PeerServer();
+    bool listen(const QHostAddress &address, quint16 port);
+    QString getErrorString() const;
+    int getSessionCount() const;
+signals:
+    void sessionStarted(int session, const QString &address, quint16 port, const QString &savePath);
+    void sessionFinished(int session, bool ok, const QString &message, qint64 bytesReceived);
+    void recvJobStarted(int session, const QString &filename);
+    void recvJobFinished(int session, const QString &filename);
+    void peerRejected(const QString &address, const QString &reason);
+private:
+    enum {
+        ROUTE_TIMEOUT = 3000,
+        MAX_PENDING_SOCKETS = 256
+    };
+    struct Session {
+        TransferEngine *engine;
+        int worker;
+        QString dirName;
+        QByteArray sessionId;
+        QHash<int, QString> recvFilenames;
+    };
+    QDir saveDir;
+    TransferOptions options;
+    int maxSessions;
+    QTcpServer *server;
+    QVector<QThread *> workers;
+    QVector<int> workerLoads;
+    QHash<int, Session> sessions;
+    QHash<QByteArray, int> sessionIds;
+    QHash<QTcpSocket *, qint64> pendingSockets;
+    QElapsedTimer clock;
+    QTimer *routeTimer;
+    int nextSession;
+    void serverNewConnection();
+    void socketReadyRead();
+    void socketDisconnected();
+    void routeTimeout();
+    void routeSocket(QTcpSocket *socket, bool timedOut);
+    void reject(QTcpSocket *socket, const QString &reason);
+    void startSession(QTcpSocket *socket, const QByteArray &sessionId);
+    QString newDirName(const QHostAddress &address) const;
+private slots:
+    void finishSession(int session, bool ok, const QString &message, qint64 bytesReceived);
+};
+
+#endif // PEERSERVER_H
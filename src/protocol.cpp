@@ -0,0 +1,303 @@
+#include "protocol.h"
+
+#include <QDir>
+#include <QStringList>
+#include <QtEndian>
+
+#include <cstring>
+
+using namespace std;
+
+// A v1 metadata record starts with the 8-byte file size, which can never be
+// all ones, so a hello is unambiguous as the first frame of a session.
+const QByteArray Protocol::helloMagic(QByteArray(8, static_cast<char>(0xFF)) + "snftp");
+
+// A colon could name a drive on Windows, as in "C:/x" or "C:x", so it is
+// refused along with "..".
+QString Protocol::sanitizePath(const QString &path)
+{
+    QStringList parts;
+    foreach (const QString &part, QString(path).replace('\\', '/').split('/')) {
+        if (part == ".." || part.contains(':'))
+            return QString();
+        if (!part.isEmpty() && part != ".")
+            parts.append(part);
+    }
+    const QString ret(parts.join('/'));
+    return QDir::isAbsolutePath(ret) ? QString() : ret;
+}
+
+QByteArray Protocol::encodeHello(const Hello &hello)
+{
+    QByteArray ret(helloMagic);
+    ret.append(static_cast<char>(hello.version));
+    ret.append(4, 0);
+    putUInt32(ret.data() + ret.length() - 4, static_cast<quint32>(hello.maxFrameSize));
+    ret.append(static_cast<char>(hello.streams));
+    ret.append(static_cast<char>(hello.streamIndex));
+    ret.append(hello.sessionId.leftJustified(SESSION_ID_BYTES, 0, true));
+    ret.append(static_cast<char>(hello.features));
+    if (hello.publicKey.length() == PUBLIC_KEY_BYTES)
+        ret.append(hello.publicKey);
+    return ret;
+}
+
+bool Protocol::decodeHello(const char *data, int length, Hello *hello)
+{
+    const int magicLen = helloMagic.length();
+    if (length < magicLen + 5 || memcmp(data, helloMagic.constData(), static_cast<size_t>(magicLen)) != 0)
+        return false;
+    hello->version = static_cast<unsigned char>(data[magicLen]);
+    hello->maxFrameSize = static_cast<int>(qBound(static_cast<quint32>(MIN_FRAME_SIZE),
+                                                  getUInt32(data + magicLen + 1),
+                                                  static_cast<quint32>(MAX_FRAME_SIZE)));
+    hello->streams = 1;
+    hello->streamIndex = 0;
+    hello->sessionId.clear();
+    hello->features = 0;
+    hello->publicKey.clear();
+    if (length >= magicLen + 7 + SESSION_ID_BYTES) {
+        hello->streams = qBound(1, static_cast<int>(static_cast<unsigned char>(data[magicLen + 5])), static_cast<int>(MAX_STREAMS));
+        hello->streamIndex = static_cast<unsigned char>(data[magicLen + 6]);
+        hello->sessionId = QByteArray(data + magicLen + 7, SESSION_ID_BYTES);
+    }
+    if (length >= magicLen + 8 + SESSION_ID_BYTES)
+        hello->features = static_cast<unsigned char>(data[magicLen + 7 + SESSION_ID_BYTES]);
+    if (length >= magicLen + 8 + SESSION_ID_BYTES + PUBLIC_KEY_BYTES)
+        hello->publicKey = QByteArray(data + magicLen + 8 + SESSION_ID_BYTES, PUBLIC_KEY_BYTES);
+    return true;
+}
+
+QByteArray Protocol::encodeMetadata(int version, const Metadata &metadata)
+{
+    const QByteArray filename(metadata.filename.toUtf8());
+    if (version < 2) {
+        QByteArray ret(8, 0);
+        putUInt64(ret.data(), static_cast<quint64>(metadata.fileSize));
+        return ret + filename;
+    }
+
+    QByteArray ret(28, 0);
+    putUInt32(ret.data(), metadata.fileId);
+    putUInt64(ret.data() + 4, static_cast<quint64>(metadata.fileSize));
+    putUInt64(ret.data() + 12, static_cast<quint64>(metadata.offset));
+    putUInt64(ret.data() + 20, static_cast<quint64>(metadata.length));
+    return ret + filename;
+}
+
+bool Protocol::decodeMetadata(int version, const char *data, int length, Metadata *metadata)
+{
+    if (version < 2) {
+        if (length < 8)
+            return false;
+        metadata->fileId = 0;
+        metadata->fileSize = static_cast<qint64>(getUInt64(data));
+        metadata->offset = 0;
+        metadata->length = metadata->fileSize;
+        metadata->filename = QString::fromUtf8(data + 8, length - 8);
+    } else {
+        if (length < 28)
+            return false;
+        metadata->fileId = getUInt32(data);
+        metadata->fileSize = static_cast<qint64>(getUInt64(data + 4));
+        metadata->offset = static_cast<qint64>(getUInt64(data + 12));
+        metadata->length = static_cast<qint64>(getUInt64(data + 20));
+        metadata->filename = QString::fromUtf8(data + 28, length - 28);
+    }
+    metadata->filename = sanitizePath(metadata->filename);
+    return !metadata->filename.isEmpty() && metadata->fileSize >= 0 && metadata->offset >= 0 && metadata->length >= 0
+            && metadata->offset <= metadata->fileSize && metadata->length <= metadata->fileSize - metadata->offset;
+}
+
+QByteArray Protocol::encodeResume(const Resume &resume)
+{
+    QByteArray ret(12, 0);
+    putUInt32(ret.data(), resume.fileId);
+    putUInt64(ret.data() + 4, static_cast<quint64>(resume.offset));
+    return ret + resume.hash;
+}
+
+bool Protocol::decodeResume(const char *data, int length, Resume *resume)
+{
+    if (length < 12)
+        return false;
+    resume->fileId = getUInt32(data);
+    resume->offset = static_cast<qint64>(getUInt64(data + 4));
+    resume->hash = QByteArray(data + 12, length - 12);
+    return resume->offset >= 0;
+}
+
+QByteArray Protocol::encodeIndex(quint32 fileId, const IndexEntry *entries, int count)
+{
+    const int entryBytes = 4 + static_cast<int>(sizeof(entries->hash));
+    QByteArray ret(4 + count * entryBytes, 0);
+    putUInt32(ret.data(), fileId);
+    for (int i = 0; i < count; ++i) {
+        char *entry = ret.data() + 4 + i * entryBytes;
+        putUInt32(entry, static_cast<quint32>(entries[i].length));
+        memcpy(entry + 4, entries[i].hash, sizeof(entries->hash));
+    }
+    return ret;
+}
+
+bool Protocol::decodeIndex(const char *data, int length, quint32 *fileId, QVector<IndexEntry> *entries)
+{
+    const int entryBytes = 4 + static_cast<int>(sizeof(IndexEntry::hash));
+    if (length < 4 || (length - 4) % entryBytes != 0)
+        return false;
+    *fileId = getUInt32(data);
+    for (const char *entry = data + 4; entry < data + length; entry += entryBytes) {
+        IndexEntry indexEntry;
+        indexEntry.length = static_cast<int>(getUInt32(entry));
+        if (indexEntry.length <= 0)
+            return false;
+        memcpy(indexEntry.hash, entry + 4, sizeof(indexEntry.hash));
+        entries->append(indexEntry);
+    }
+    return true;
+}
+
+QByteArray Protocol::encodeCopies(quint32 fileId, const Copy *copies, int count)
+{
+    QByteArray ret(4 + count * 24, 0);
+    putUInt32(ret.data(), fileId);
+    for (int i = 0; i < count; ++i) {
+        char *copy = ret.data() + 4 + i * 24;
+        putUInt64(copy, static_cast<quint64>(copies[i].offset));
+        putUInt64(copy + 8, static_cast<quint64>(copies[i].sourceOffset));
+        putUInt64(copy + 16, static_cast<quint64>(copies[i].length));
+    }
+    return ret;
+}
+
+bool Protocol::decodeCopies(const char *data, int length, quint32 *fileId, QVector<Copy> *copies)
+{
+    if (length < 4 || (length - 4) % 24 != 0)
+        return false;
+    *fileId = getUInt32(data);
+    for (const char *entry = data + 4; entry < data + length; entry += 24) {
+        Copy copy;
+        copy.offset = static_cast<qint64>(getUInt64(entry));
+        copy.sourceOffset = static_cast<qint64>(getUInt64(entry + 8));
+        copy.length = static_cast<qint64>(getUInt64(entry + 16));
+        if (copy.offset < 0 || copy.sourceOffset < 0 || copy.length <= 0)
+            return false;
+        copies->append(copy);
+    }
+    return true;
+}
+
+QByteArray Protocol::encodeTrailer(const Trailer &trailer)
+{
+    QByteArray ret(4, 0);
+    putUInt32(ret.data(), trailer.fileId);
+    return ret + trailer.digest;
+}
+
+bool Protocol::decodeTrailer(const char *data, int length, Trailer *trailer)
+{
+    if (length != 4 + DIGEST_BYTES)
+        return false;
+    trailer->fileId = getUInt32(data);
+    trailer->digest = QByteArray(data + 4, DIGEST_BYTES);
+    return true;
+}
+
+QByteArray Protocol::encodeCredit(quint64 limit)
+{
+    QByteArray ret(8, 0);
+    putUInt64(ret.data(), limit);
+    return ret;
+}
+
+bool Protocol::decodeCredit(const char *data, int length, quint64 *limit)
+{
+    if (length != 8)
+        return false;
+    *limit = getUInt64(data);
+    return true;
+}
+
+QByteArray Protocol::encodeAck(quint32 fileId)
+{
+    QByteArray ret(4, 0);
+    putUInt32(ret.data(), fileId);
+    return ret;
+}
+
+bool Protocol::decodeAck(const char *data, int length, quint32 *fileId)
+{
+    if (length != 4)
+        return false;
+    *fileId = getUInt32(data);
+    return true;
+}
+
+QByteArray Protocol::encodeHole(qint64 length)
+{
+    QByteArray ret(8, 0);
+    putUInt64(ret.data(), static_cast<quint64>(length));
+    return ret;
+}
+
+bool Protocol::decodeHole(const char *data, int length, qint64 *holeLength)
+{
+    if (length != 8)
+        return false;
+    *holeLength = static_cast<qint64>(getUInt64(data));
+    return *holeLength > 0;
+}
+
+QByteArray Protocol::encodeBatchEntry(const BatchEntry &entry)
+{
+    const QByteArray filename(entry.filename.toUtf8());
+    QByteArray ret(14, 0);
+    putUInt32(ret.data(), entry.fileId);
+    putUInt64(ret.data() + 4, static_cast<quint64>(entry.fileSize));
+    putUInt16(ret.data() + 12, static_cast<quint16>(filename.length()));
+    return ret + filename;
+}
+
+int Protocol::decodeBatchEntry(const char *data, int length, BatchEntry *entry)
+{
+    if (length < 14)
+        return -1;
+    entry->fileId = getUInt32(data);
+    entry->fileSize = static_cast<qint64>(getUInt64(data + 4));
+    const int headerBytes = 14 + getUInt16(data + 12);
+    if (headerBytes > length || entry->fileSize < 0 || entry->fileSize > length - headerBytes)
+        return -1;
+    entry->filename = sanitizePath(QString::fromUtf8(data + 14, headerBytes - 14));
+    return entry->filename.isEmpty() ? -1 : headerBytes;
+}
+
+void Protocol::putUInt16(char *data, quint16 value)
+{
+    qToBigEndian<quint16>(value, reinterpret_cast<uchar *>(data));
+}
+
+void Protocol::putUInt32(char *data, quint32 value)
+{
+    qToBigEndian<quint32>(value, reinterpret_cast<uchar *>(data));
+}
+
+void Protocol::putUInt64(char *data, quint64 value)
+{
+    qToBigEndian<quint64>(value, reinterpret_cast<uchar *>(data));
+}
+
+quint16 Protocol::getUInt16(const char *data)
+{
+    return qFromBigEndian<quint16>(reinterpret_cast<const uchar *>(data));
+}
+
+quint32 Protocol::getUInt32(const char *data)
+{
+    return qFromBigEndian<quint32>(reinterpret_cast<const uchar *>(data));
+}
+
+quint64 Protocol::getUInt64(const char *data)
+{
+    return qFromBigEndian<quint64>(reinterpret_cast<const uchar *>(data));
+}
+
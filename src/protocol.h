@@ -0,0 +1,117 @@
+#ifndef PROTOCOL_H
+#define PROTOCOL_H
+
+#include <QByteArray>
+#include <QString>
+#include <QVector>
+
+class Protocol {
+public:
+    enum {
+        VERSION = 6,
+        V1_HEADER_BYTES = 2,
+        V2_HEADER_BYTES = 4,
+        V1_FRAME_SIZE = 64000,
+        V1_MAX_SEALED_BYTES = 65535,
+        MIN_FRAME_SIZE = 64 * 1024,
+        DEFAULT_FRAME_SIZE = 4 * 1024 * 1024,
+        MAX_FRAME_SIZE = 16 * 1024 * 1024,
+        SESSION_ID_BYTES = 16,
+        PUBLIC_KEY_BYTES = 32,
+        MAX_STREAMS = 64,
+        DIGEST_BYTES = 32
+    };
+    enum Feature {
+        FEATURE_COMPRESSION = 1,
+        FEATURE_DELTA = 2,
+        FEATURE_PLAINTEXT = 4,
+        FEATURE_AES_GCM = 8,
+        FEATURE_CREDIT = 16,
+        FEATURE_SPARSE = 32
+    };
+    static const quint32 RAW_FRAME_FLAG = 0x80000000U;
+    enum RecordType {
+        METADATA = 0,
+        DATA = 1,
+        OFFER = 2,
+        RESUME = 3,
+        DATA_COMPRESSED = 4,
+        INDEX = 5,
+        COPY = 6,
+        BATCH = 7,
+        TRAILER = 8,
+        CREDIT = 9,
+        HOLE = 10,
+        ACK = 11
+    };
+    struct Hello {
+        int version;
+        int maxFrameSize;
+        int streams;
+        int streamIndex;
+        QByteArray sessionId;
+        int features;
+        QByteArray publicKey;
+    };
+    struct Metadata {
+        quint32 fileId;
+        qint64 fileSize;
+        qint64 offset;
+        qint64 length;
+        QString filename;
+    };
+    struct Resume {
+        quint32 fileId;
+        qint64 offset;
+        QByteArray hash;
+    };
+    struct IndexEntry {
+        int length;
+        char hash[16];
+    };
+    struct Copy {
+        qint64 offset;
+        qint64 sourceOffset;
+        qint64 length;
+    };
+    struct Trailer {
+        quint32 fileId;
+        QByteArray digest;
+    };
+    struct BatchEntry {
+        quint32 fileId;
+        qint64 fileSize;
+        QString filename;
+    };
+    static QString sanitizePath(const QString &path);
+    static QByteArray encodeHello(const Hello &hello);
+    static bool decodeHello(const char *data, int length, Hello *hello);
+    static QByteArray encodeMetadata(int version, const Metadata &metadata);
+    static bool decodeMetadata(int version, const char *data, int length, Metadata *metadata);
+    static QByteArray encodeResume(const Resume &resume);
+    static bool decodeResume(const char *data, int length, Resume *resume);
+    static QByteArray encodeIndex(quint32 fileId, const IndexEntry *entries, int count);
+    static bool decodeIndex(const char *data, int length, quint32 *fileId, QVector<IndexEntry> *entries);
+    static QByteArray encodeCopies(quint32 fileId, const Copy *copies, int count);
+    static bool decodeCopies(const char *data, int length, quint32 *fileId, QVector<Copy> *copies);
+    static QByteArray encodeTrailer(const Trailer &trailer);
+    static bool decodeTrailer(const char *data, int length, Trailer *trailer);
+    static QByteArray encodeCredit(quint64 limit);
+    static bool decodeCredit(const char *data, int length, quint64 *limit);
+    static QByteArray encodeAck(quint32 fileId);
+    static bool decodeAck(const char *data, int length, quint32 *fileId);
+    static QByteArray encodeHole(qint64 length);
+    static bool decodeHole(const char *data, int length, qint64 *holeLength);
+    static QByteArray encodeBatchEntry(const BatchEntry &entry);
+    static int decodeBatchEntry(const char *data, int length, BatchEntry *entry);
+    static void putUInt16(char *data, quint16 value);
+    static void putUInt32(char *data, quint32 value);
+    static void putUInt64(char *data, quint64 value);
+    static quint16 getUInt16(const char *data);
+    static quint32 getUInt32(const char *data);
+    static quint64 getUInt64(const char *data);
+private:
+    const static QByteArray helloMagic;
+};
+
+#endif // PROTOCOL_H
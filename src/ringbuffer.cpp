@@ -0,0 +1,66 @@
+#include "ringbuffer.h"
+
+#include <cstring>
+
+RingBuffer::RingBuffer(qint64 capacity) : buffer(static_cast<int>(capacity), Qt::Uninitialized), head(0), size(0) {}
+
+qint64 RingBuffer::getCapacity() const
+{
+    return buffer.size();
+}
+
+qint64 RingBuffer::getSize() const
+{
+    return size;
+}
+
+qint64 RingBuffer::getFreeSpace() const
+{
+    return buffer.size() - size;
+}
+
+void RingBuffer::reserve(qint64 capacity)
+{
+    if (capacity <= buffer.size())
+        return;
+    QByteArray grown(static_cast<int>(capacity), Qt::Uninitialized);
+    peek(0, grown.data(), size);
+    buffer.swap(grown);
+    head = 0;
+}
+
+char *RingBuffer::writePointer(qint64 *maxLen)
+{
+    const qint64 tail = (head + size) % buffer.size();
+    if (size == buffer.size())
+        *maxLen = 0;
+    else if (tail >= head)
+        *maxLen = buffer.size() - tail;
+    else
+        *maxLen = head - tail;
+    return buffer.data() + tail;
+}
+
+void RingBuffer::commit(qint64 len)
+{
+    size += len;
+}
+
+bool RingBuffer::peek(qint64 offset, char *data, qint64 len) const
+{
+    if (offset + len > size)
+        return false;
+    const qint64 start = (head + offset) % buffer.size();
+    const qint64 first = qMin(len, buffer.size() - start);
+    memcpy(data, buffer.constData() + start, static_cast<size_t>(first));
+    memcpy(data + first, buffer.constData(), static_cast<size_t>(len - first));
+    return true;
+}
+
+void RingBuffer::consume(qint64 len)
+{
+    head = (head + len) % buffer.size();
+    size -= len;
+    if (size == 0)
+        head = 0;
+}
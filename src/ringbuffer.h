@@ -0,0 +1,23 @@
+#ifndef RINGBUFFER_H
+#define RINGBUFFER_H
+
+#include <QByteArray>
+
+class RingBuffer {
+public:
+    explicit RingBuffer(qint64 capacity);
+    qint64 getCapacity() const;
+    qint64 getSize() const;
+    qint64 getFreeSpace() const;
+    void reserve(qint64 capacity);
+    char *writePointer(qint64 *maxLen);
+    void commit(qint64 len);
+    bool peek(qint64 offset, char *data, qint64 len) const;
+    void consume(qint64 len);
+private:
+    QByteArray buffer;
+    qint64 head;
+    qint64 size;
+};
+
+#endif // RINGBUFFER_H
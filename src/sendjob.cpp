@@ -1,42 +1,227 @@
 #include "sendjob.h"
 
+#include <QDir>
+#include <QDirIterator>
 #include <QFileInfo>
 
+#include <cerrno>
+#include <stdexcept>
+
+#ifdef Q_OS_UNIX
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
 using namespace std;
 
-SendJob::SendJob(const QString &path) : metadataSent(false), bytesRead(0), file(path) {}
+SendJob::SendJob(const QString &path, const QString &filename) :
+    filename(filename), fileSize(QFileInfo(path).size()), nextRange(0), bytesSent(0), started(false), ready(false), priority(0), file(path),
+    pendingPieces(0), acknowledged(false)
+{
+    skipTo(0);
+}
 
-QString SendJob::getFilename()
+SendJob::~SendJob() {}
+
+void SendJob::collect(const QString &path, QStringList *paths, QStringList *filenames)
+{
+    const QFileInfo info(path);
+    if (!info.isDir()) {
+        paths->append(info.absoluteFilePath());
+        filenames->append(info.fileName());
+        return;
+    }
+
+    const QDir base(info.absolutePath());
+    QDirIterator it(info.absoluteFilePath(), QDir::Files | QDir::Hidden, QDirIterator::Subdirectories);
+    while (it.hasNext()) {
+        const QString filePath(it.next());
+        paths->append(filePath);
+        filenames->append(base.relativeFilePath(filePath));
+    }
+}
+
+QString SendJob::getPath()
 {
-    return QFileInfo(file).fileName();
+    return file.fileName();
 }
 
-qint64 SendJob::getBytesRead()
+QString SendJob::getFilename()
 {
-    return bytesRead;
+    return filename;
 }
 
 qint64 SendJob::getFileSize()
 {
-    return file.size();
+    return fileSize;
 }
 
-bool SendJob::atEnd()
+qint64 SendJob::getBytesSent()
 {
-    return bytesRead == file.size();
+    return bytesSent;
 }
 
-QByteArray SendJob::read(qint64 size)
+bool SendJob::isStarted()
 {
-    if (atEnd())
-        return QByteArray();
+    return started;
+}
 
-    if (bytesRead == 0)
-        if (!file.open(QIODevice::ReadOnly))
-            throw runtime_error(QString("error opening file: %1").arg(file.fileName()).toLocal8Bit().data());
-    QByteArray ret = file.read(size);
-    bytesRead += ret.length();
-    if (atEnd())
-        file.close();
+bool SendJob::isReady()
+{
+    return ready;
+}
+
+void SendJob::setReady(bool ready)
+{
+    this->ready = ready;
+}
+
+int SendJob::getPriority()
+{
+    return priority;
+}
+
+void SendJob::setPriority(int priority)
+{
+    this->priority = priority;
+}
+
+void SendJob::skipTo(qint64 offset)
+{
+    QVector<QPair<qint64, qint64> > rest;
+    if (offset < fileSize || fileSize == 0)
+        rest.append(qMakePair(offset, fileSize - offset));
+    setRanges(rest);
+    bytesSent = offset;
+    started = offset > 0;
+}
+
+void SendJob::setRanges(const QVector<QPair<qint64, qint64> > &ranges)
+{
+    this->ranges = ranges;
+    nextRange = 0;
+}
+
+bool SendJob::hasUnassignedRange()
+{
+    return nextRange < ranges.length();
+}
+
+qint64 SendJob::getUnassignedBytes()
+{
+    qint64 ret = 0;
+    for (int i = nextRange; i < ranges.length(); ++i)
+        ret += ranges[i].second;
     return ret;
 }
+
+qint64 SendJob::takeRange(qint64 maxLen, qint64 *offset)
+{
+    QPair<qint64, qint64> &range = ranges[nextRange];
+    *offset = range.first;
+    const qint64 ret = qMin(maxLen, range.second);
+    range.first += ret;
+    range.second -= ret;
+    if (range.second == 0)
+        ++nextRange;
+    started = true;
+    return ret;
+}
+
+void SendJob::open()
+{
+    if (file.isOpen())
+        return;
+    if (!file.open(QIODevice::ReadOnly | QIODevice::Unbuffered))
+        throw runtime_error(QString("error opening file: %1").arg(file.fileName()).toLocal8Bit().data());
+#ifdef Q_OS_LINUX
+    posix_fadvise(file.handle(), 0, 0, POSIX_FADV_SEQUENTIAL);
+#endif
+}
+
+int SendJob::handle()
+{
+    open();
+    return file.handle();
+}
+
+// How much of the file at offset is a hole, 0 if there is data there or the
+// file system cannot tell.
+qint64 SendJob::getHoleLength(qint64 offset, qint64 maxLen)
+{
+#if defined(Q_OS_UNIX) && defined(SEEK_DATA)
+    const off_t data = lseek(handle(), static_cast<off_t>(offset), SEEK_DATA);
+    if (data < 0)
+        return errno == ENXIO ? maxLen : 0;
+    return qMin(static_cast<qint64>(data) - offset, maxLen);
+#else
+    Q_UNUSED(offset);
+    Q_UNUSED(maxLen);
+    return 0;
+#endif
+}
+
+// How much of the file at offset is data before the next hole.
+qint64 SendJob::getDataLength(qint64 offset, qint64 maxLen)
+{
+#if defined(Q_OS_UNIX) && defined(SEEK_HOLE)
+    const off_t hole = lseek(handle(), static_cast<off_t>(offset), SEEK_HOLE);
+    if (hole <= static_cast<off_t>(offset))
+        return maxLen;
+    return qMin(static_cast<qint64>(hole) - offset, maxLen);
+#else
+    Q_UNUSED(offset);
+    return maxLen;
+#endif
+}
+
+void SendJob::addDigestPiece(qint64 offset, qint64 length, const QByteArray &hash)
+{
+    digest.addPiece(offset, length, hash);
+}
+
+// Pieces hashed elsewhere are counted until they arrive, the digest is only
+// complete once none are left.
+void SendJob::beginDigestPiece()
+{
+    ++pendingPieces;
+}
+
+void SendJob::finishDigestPiece(qint64 offset, qint64 length, const QByteArray &hash)
+{
+    --pendingPieces;
+    digest.addPiece(offset, length, hash);
+}
+
+bool SendJob::isDigestReady()
+{
+    return pendingPieces == 0;
+}
+
+QByteArray SendJob::getDigest()
+{
+    return digest.getDigest();
+}
+
+void SendJob::addBytesSent(qint64 len)
+{
+    bytesSent += len;
+    started = true;
+    if (isDone())
+        file.close();
+}
+
+bool SendJob::isDone()
+{
+    return bytesSent == fileSize;
+}
+
+bool SendJob::isAcknowledged()
+{
+    return acknowledged;
+}
+
+void SendJob::setAcknowledged()
+{
+    acknowledged = true;
+}
@@ -2,20 +2,57 @@
 #define SENDJOB_H
 
 #include <QFile>
+#include <QPair>
+#include <QStringList>
+#include <QVector>
+
+#include "filedigest.h"
 
 class SendJob {
 public:
-    SendJob(const QString &path);
+    SendJob(const QString &path, const QString &filename);
     ~SendJob();
+    static void collect(const QString &path, QStringList *paths, QStringList *filenames);
+    QString getPath();
     QString getFilename();
-    qint64 getBytesRead();
     qint64 getFileSize();
-    bool atEnd();
-    QByteArray read(qint64 size);
-    bool metadataSent;
+    qint64 getBytesSent();
+    bool isStarted();
+    bool isReady();
+    void setReady(bool ready);
+    int getPriority();
+    void setPriority(int priority);
+    void skipTo(qint64 offset);
+    void setRanges(const QVector<QPair<qint64, qint64> > &ranges);
+    bool hasUnassignedRange();
+    qint64 getUnassignedBytes();
+    qint64 takeRange(qint64 maxLen, qint64 *offset);
+    int handle();
+    qint64 getHoleLength(qint64 offset, qint64 maxLen);
+    qint64 getDataLength(qint64 offset, qint64 maxLen);
+    void addDigestPiece(qint64 offset, qint64 length, const QByteArray &hash);
+    void beginDigestPiece();
+    void finishDigestPiece(qint64 offset, qint64 length, const QByteArray &hash);
+    bool isDigestReady();
+    QByteArray getDigest();
+    void addBytesSent(qint64 len);
+    bool isDone();
+    bool isAcknowledged();
+    void setAcknowledged();
 private:
-    qint64 bytesRead;
+    QString filename;
+    qint64 fileSize;
+    QVector<QPair<qint64, qint64> > ranges;
+    int nextRange;
+    qint64 bytesSent;
+    bool started;
+    bool ready;
+    int priority;
     QFile file;
+    FileDigest digest;
+    int pendingPieces;
+    bool acknowledged;
+    void open();
 };
 
 #endif // SENDJOB_H
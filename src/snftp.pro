@@ -8,21 +8,19 @@ DEFINES += QT_DISABLE_DEPRECATED_BEFORE=0x060000
 
 CONFIG += c++11
 
+include(core.pri)
+
 SOURCES += \
-        crypto.cpp \
         main.cpp \
         mainwidget.cpp \
-        sendjob.cpp \
-        startupdialog.cpp
+        startupdialog.cpp \
+        transferlistmodel.cpp
 
 HEADERS += \
-        crypto.h \
         mainwidget.h \
-        sendjob.h \
-        startupdialog.h
+        startupdialog.h \
+        transferlistmodel.h
 
 FORMS += \
         mainwidget.ui \
         startupdialog.ui
-
-LIBS += -lsodium
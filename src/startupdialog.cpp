@@ -8,9 +8,11 @@
 #include <QMessageBox>
 #include <QNetworkInterface>
 #include <QStandardPaths>
+#include <QThread>
 
 #include "crypto.h"
 #include "mainwidget.h"
+#include "udpsocket.h"
 
 StartupDialog::StartupDialog(QWidget *parent) : QDialog(parent), ui(new Ui::StartupDialog), server(nullptr), socket(nullptr), broadcastSocket(new QUdpSocket(this))
 {
@@ -27,6 +29,7 @@ StartupDialog::StartupDialog(QWidget *parent) : QDialog(parent), ui(new Ui::Star
 
     const QDir downloadsDir(QStandardPaths::writableLocation(QStandardPaths::DownloadLocation));
     ui->savePathLineEdit->setText(downloadsDir.absoluteFilePath("snftp"));
+    ui->cryptoThreadsSpinBox->setValue(QThread::idealThreadCount());
     ui->hostListView->setEditTriggers(QAbstractItemView::NoEditTriggers);
     ui->hostListView->setModel(&hostStringListModel);
     broadcastSocket->bind(DEFAULT_PORT);
@@ -47,6 +50,20 @@ void StartupDialog::setUiEnabled(bool enabled)
     ui->hostListView->setEnabled(enabled);
     ui->refreshPushButton->setEnabled(enabled);
     ui->passwordLineEdit->setEnabled(enabled);
+    ui->sendWindowSpinBox->setEnabled(enabled);
+    ui->recvWindowSpinBox->setEnabled(enabled);
+    ui->cryptoThreadsSpinBox->setEnabled(enabled);
+    ui->frameSizeSpinBox->setEnabled(enabled);
+    ui->streamsSpinBox->setEnabled(enabled);
+    ui->legacyProtocolCheckBox->setEnabled(enabled);
+    ui->compressionCheckBox->setEnabled(enabled);
+    ui->deltaCheckBox->setEnabled(enabled);
+    ui->plaintextCheckBox->setEnabled(enabled);
+    ui->preallocateCheckBox->setEnabled(enabled);
+    ui->ioDepthSpinBox->setEnabled(enabled);
+    ui->durabilityComboBox->setEnabled(enabled);
+    ui->udpCheckBox->setEnabled(enabled);
+    ui->fecGroupSpinBox->setEnabled(enabled);
     ui->savePathLineEdit->setEnabled(enabled);
     ui->selectSavePathToolButton->setEnabled(enabled);
     ui->launchPushButton->setEnabled(enabled);
@@ -108,7 +125,35 @@ void StartupDialog::launchPushButtonClicked()
         return;
     }
 
-    if (isServer) {
+    if (ui->udpCheckBox->isChecked()) {
+        UdpSocket *udpSocket = new UdpSocket(this);
+        udpSocket->setFecGroup(ui->fecGroupSpinBox->value());
+        socket = udpSocket;
+        connect(socket, &QTcpSocket::connected, this, &StartupDialog::socketConnected);
+        connect(socket, QOverload<QAbstractSocket::SocketError>::of(&QTcpSocket::error),
+                this, &StartupDialog::socketErrored);
+        if (isServer) {
+            // The discovery socket shares the default port and would take
+            // the transfer's datagrams.
+            sendOffline();
+            broadcastSocket->close();
+            if (!udpSocket->listen(QHostAddress(address), port)) {
+                socket->deleteLater();
+                socket = nullptr;
+                broadcastSocket->bind(DEFAULT_PORT);
+                QMessageBox::critical(this, "Error", QString("Unable to listen on %1:%2").arg(address).arg(port));
+                ui->addressLineEdit->setFocus();
+                return;
+            }
+            ui->launchPushButton->setText("Listening...");
+        } else {
+            socket->connectToHost(address, port);
+            if (socket == nullptr)
+                // Already failed.
+                return;
+            ui->launchPushButton->setText("Connecting...");
+        }
+    } else if (isServer) {
         server = new QTcpServer(this);
         connect(server, &QTcpServer::newConnection, this, &StartupDialog::serverNewConnection);
         if (!server->listen(QHostAddress(address), port)) {
@@ -139,9 +184,8 @@ void StartupDialog::serverNewConnection()
     socket = server->nextPendingConnection();
     socket->setParent(nullptr);
 
-    server->close();
-    server->deleteLater();
-    server = nullptr;
+    disconnect(server, &QTcpServer::newConnection, this, &StartupDialog::serverNewConnection);
+    server->setParent(nullptr);
 
     startMainWidget();
 }
@@ -171,7 +215,25 @@ void StartupDialog::socketErrored()
 void StartupDialog::startMainWidget()
 {
     Crypto::setPassword(ui->passwordLineEdit->text());
-    MainWidget *mainWidget = new MainWidget(ui->savePathLineEdit->text(), socket);
+    TransferOptions options;
+    options.client = ui->clientRadioButton->isChecked();
+    options.legacyProtocol = ui->legacyProtocolCheckBox->isChecked();
+    options.maxFrameSize = ui->frameSizeSpinBox->value() * 1024;
+    // Extra streams only help TCP, a paced UDP stream fills the link alone.
+    options.streams = qobject_cast<UdpSocket *>(socket) != nullptr ? 1 : ui->streamsSpinBox->value();
+    options.compression = ui->compressionCheckBox->isChecked();
+    options.delta = ui->deltaCheckBox->isChecked();
+    options.plaintext = ui->plaintextCheckBox->isChecked();
+    options.preallocate = ui->preallocateCheckBox->isChecked();
+    options.sendWindow = static_cast<qint64>(ui->sendWindowSpinBox->value()) * 1024 * 1024;
+    options.recvWindow = static_cast<qint64>(ui->recvWindowSpinBox->value()) * 1024 * 1024;
+    options.cryptoThreads = ui->cryptoThreadsSpinBox->value();
+    options.ioDepth = ui->ioDepthSpinBox->value();
+    options.durability = ui->durabilityComboBox->currentIndex();
+    options.metrics = false;
+    options.metricsInterval = METRICS_INTERVAL;
+    MainWidget *mainWidget = new MainWidget(ui->savePathLineEdit->text(), socket, server, options);
+    server = nullptr;
     mainWidget->setAttribute(Qt::WA_DeleteOnClose);
     mainWidget->show();
     close();
@@ -19,7 +19,8 @@ public:
 private:
     Ui::StartupDialog *ui;
     enum {
-        DEFAULT_PORT = 7638
+        DEFAULT_PORT = 7638,
+        METRICS_INTERVAL = 1000
     };
     QTcpServer *server;
     QTcpSocket *socket;
@@ -0,0 +1,1823 @@
+#include "transferengine.h"
+
+#include <QDir>
+#include <QFileInfo>
+#include <QFutureWatcher>
+#include <QtConcurrent>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <stdexcept>
+
+#ifdef Q_OS_UNIX
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+using namespace std;
+
+TransferEngine::TransferEngine(const QString &savePath, QTcpSocket *socket, QTcpServer *server, const TransferOptions &options, QObject *parent) :
+    QObject(parent),
+    saveDir(savePath),
+    options(options),
+    server(server),
+    sessionId(Protocol::SESSION_ID_BYTES, 0),
+    streams(1),
+    firstUnassignedJob(0),
+    nextAnnouncedJob(0),
+    nextBatchJob(0),
+    scheduledJob(-1),
+    smallJobStreak(0),
+    acknowledgedJobs(0),
+    resumable(false),
+    sendBytesTotal(0),
+    sendBytesDone(0),
+    diskIo(new DiskIo(options.ioDepth, this)),
+    writePool(0),
+    nextV1FileId(0),
+    nextRecvId(0),
+    recvBytesTotal(0),
+    recvBytesDone(0),
+    failed(false),
+    idleNotified(false),
+    pendingUpdates(0),
+    updateTimer(new QTimer(this)),
+    metricsTimer(new QTimer(this))
+{
+    updateTimer->setSingleShot(true);
+    updateTimer->setInterval(UPDATE_INTERVAL);
+    connect(updateTimer, &QTimer::timeout, this, &TransferEngine::emitUpdates);
+    qRegisterMetaType<MetricsSnapshot>();
+    Metrics::setEnabled(options.metrics);
+    connect(metricsTimer, &QTimer::timeout, this, &TransferEngine::emitMetrics);
+    connect(diskIo, &DiskIo::completed, this, &TransferEngine::diskCompleted);
+    diskCopyStats.sendPayload = 0;
+    diskCopyStats.sendCopied = 0;
+    diskCopyStats.recvPayload = 0;
+    diskCopyStats.recvCopied = 0;
+    randombytes_buf(sessionId.data(), static_cast<size_t>(sessionId.length()));
+    if (server != nullptr)
+        server->setParent(this);
+    addConnection(socket, options.client ? Connection::CLIENT : Connection::SERVER, true);
+}
+
+TransferEngine::~TransferEngine()
+{
+    diskIo->drain();
+    qDeleteAll(sendJobs);
+    qDeleteAll(recvFiles);
+}
+
+bool TransferEngine::isIdle() const
+{
+    return isDrained() && !hasUnacknowledgedJobs();
+}
+
+// Everything has been sent, but the peer has not confirmed every file as
+// verified and on its disk yet.
+bool TransferEngine::isUnconfirmed() const
+{
+    return isDrained() && hasUnacknowledgedJobs();
+}
+
+bool TransferEngine::isDrained() const
+{
+    if (!sendRanges.isEmpty() || !pendingBatches.isEmpty() || !recvFiles.isEmpty() || !pendingHashes.isEmpty())
+        return false;
+    foreach (Connection *connection, connections)
+        if (!connection->isFlushed())
+            return false;
+    for (int i = firstUnassignedJob; i < sendJobs.length(); ++i)
+        if (!sendJobs[i]->isReady() || sendJobs[i]->hasUnassignedRange() || !sendJobs[i]->isDone())
+            return false;
+    return true;
+}
+
+bool TransferEngine::hasUnacknowledgedJobs() const
+{
+    return hasTrailers() && acknowledgedJobs < sendJobs.length();
+}
+
+qint64 TransferEngine::getBytesSent() const
+{
+    return sendBytesDone;
+}
+
+qint64 TransferEngine::getBytesReceived() const
+{
+    return recvBytesDone;
+}
+
+qint64 TransferEngine::getCreditStallMsecs() const
+{
+    quint64 nsecs = 0;
+    foreach (Connection *connection, connections)
+        nsecs += connection->getSendStats().creditStallNsecs;
+    return static_cast<qint64>(nsecs / 1000000);
+}
+
+qint64 TransferEngine::getWindowStallMsecs() const
+{
+    quint64 nsecs = 0;
+    foreach (Connection *connection, connections)
+        nsecs += connection->getSendStats().windowStallNsecs;
+    return static_cast<qint64>(nsecs / 1000000);
+}
+
+MetricsSnapshot TransferEngine::getMetrics() const
+{
+    MetricsSnapshot ret;
+    Metrics::snapshot(&ret);
+    ret.bytesSent = sendBytesDone;
+    ret.sendBytesTotal = sendBytesTotal;
+    ret.bytesReceived = recvBytesDone;
+    ret.recvBytesTotal = recvBytesTotal;
+    ret.encryptQueue = 0;
+    ret.decryptQueue = 0;
+    ret.diskQueue = diskIo->getPending();
+    ret.socketQueue = 0;
+    foreach (Connection *connection, connections) {
+        ret.encryptQueue += connection->getEncryptQueue();
+        ret.decryptQueue += connection->getDecryptQueue();
+        ret.socketQueue += connection->getSocketQueue();
+    }
+    return ret;
+}
+
+void TransferEngine::start()
+{
+    if (server != nullptr) {
+        connect(server, &QTcpServer::newConnection, this, &TransferEngine::serverNewConnection);
+        if (options.legacyProtocol)
+            closeServer();
+    }
+
+    emitSendStats();
+    if (options.metricsInterval > 0)
+        metricsTimer->start(options.metricsInterval);
+    connections.first()->start(localHello(0));
+}
+
+void TransferEngine::addSendJobs(const QStringList &paths, const QStringList &filenames)
+{
+    for (int i = 0; i < paths.length(); ++i) {
+        SendJob *job = new SendJob(paths[i], filenames[i]);
+        sendBytesTotal += job->getFileSize();
+        sendJobs.append(job);
+    }
+
+    if (connections.first()->isReady())
+        announceSendJobs();
+    idleNotified = false;
+    fillConnections();
+}
+
+void TransferEngine::setSendJobPriority(int index, int priority)
+{
+    if (index < 0 || index >= sendJobs.length())
+        return;
+    sendJobs[index]->setPriority(qBound(0, priority, static_cast<int>(MAX_PRIORITY)));
+    if (priority > 0 && !priorityJobs.contains(index))
+        priorityJobs.append(index);
+    fillConnections();
+}
+
+void TransferEngine::shutdown()
+{
+    if (failed)
+        return;
+    failed = true;
+    closeServer();
+    foreach (Connection *connection, connections)
+        connection->shutdown();
+}
+
+Connection *TransferEngine::addConnection(QTcpSocket *socket, Connection::Role role, bool primary)
+{
+    Connection *connection = new Connection(socket, role, primary, options, this);
+    connect(connection, &Connection::helloReceived, this, &TransferEngine::connectionHelloReceived);
+    connect(connection, &Connection::handshakeFinished, this, &TransferEngine::connectionHandshakeFinished);
+    connect(connection, &Connection::recordReceived, this, &TransferEngine::connectionRecordReceived);
+    connect(connection, &Connection::readyToSend, this, &TransferEngine::connectionReadyToSend);
+    connect(connection, &Connection::fileRecordHashed, this, &TransferEngine::connectionFileRecordHashed);
+    connect(connection, &Connection::errorOccurred, this, &TransferEngine::connectionErrorOccurred);
+    connect(connection, &Connection::disconnected, this, &TransferEngine::connectionDisconnected);
+    connections.append(connection);
+    return connection;
+}
+
+Protocol::Hello TransferEngine::localHello(int streamIndex) const
+{
+    Protocol::Hello hello;
+    hello.version = Protocol::VERSION;
+    hello.maxFrameSize = options.maxFrameSize;
+    hello.streams = options.client && streamIndex == 0 ? qBound(1, options.streams, static_cast<int>(Protocol::MAX_STREAMS)) : streams;
+    hello.streamIndex = streamIndex;
+    hello.sessionId = sessionId;
+    hello.features = (options.compression ? Protocol::FEATURE_COMPRESSION : 0) | (options.delta ? Protocol::FEATURE_DELTA : 0)
+            | (options.plaintext ? Protocol::FEATURE_PLAINTEXT : 0) | (Crypto::isAesAvailable() ? Protocol::FEATURE_AES_GCM : 0)
+            | Protocol::FEATURE_CREDIT | Protocol::FEATURE_SPARSE;
+    return hello;
+}
+
+void TransferEngine::openExtraStreams()
+{
+    const QHostAddress address(connections.first()->getPeerAddress());
+    const quint16 port = connections.first()->getPeerPort();
+
+    for (int i = 1; i < streams; ++i) {
+        QTcpSocket *socket = new QTcpSocket(this);
+        connect(socket, &QTcpSocket::connected, this, [this, socket, i]() {
+            socket->disconnect(this);
+            if (failed) {
+                socket->deleteLater();
+                return;
+            }
+            addConnection(socket, Connection::CLIENT, false)->start(localHello(i));
+        });
+        connect(socket, QOverload<QAbstractSocket::SocketError>::of(&QTcpSocket::error), this, [this, socket]() {
+            fail(QString("Error opening stream: %1").arg(socket->errorString()));
+        });
+        socket->connectToHost(address, port);
+    }
+}
+
+void TransferEngine::closeServer()
+{
+    if (server == nullptr)
+        return;
+    server->close();
+    server->deleteLater();
+    server = nullptr;
+}
+
+void TransferEngine::fail(const QString &message)
+{
+    if (failed)
+        return;
+    failed = true;
+    closeServer();
+    foreach (Connection *connection, connections)
+        connection->close();
+    emit errorOccurred(message);
+}
+
+void TransferEngine::announceSendJobs()
+{
+    for (; nextAnnouncedJob < sendJobs.length(); ++nextAnnouncedJob) {
+        SendJob *job = sendJobs[nextAnnouncedJob];
+        if (!resumable || isPackable(job)) {
+            job->setReady(true);
+            continue;
+        }
+        Protocol::Metadata metadata;
+        metadata.fileId = static_cast<quint32>(nextAnnouncedJob);
+        metadata.fileSize = job->getFileSize();
+        metadata.offset = 0;
+        metadata.length = 0;
+        metadata.filename = job->getFilename();
+        connections.first()->sendRecord(Protocol::OFFER, Protocol::encodeMetadata(Protocol::VERSION, metadata));
+    }
+}
+
+void TransferEngine::fillConnections()
+{
+    foreach (Connection *connection, connections)
+        fillConnection(connection);
+}
+
+void TransferEngine::fillConnection(Connection *connection)
+{
+    if (failed || !connection->canSend())
+        return;
+    if (!sendRanges.contains(connection) && !pendingBatches.contains(connection) && !hasBatchJob() && !assignRange(connection))
+        return;
+
+    connection->beginRefill();
+    while (!failed && connection->canSend() && sendNextRecord(connection))
+        ;
+    connection->endRefill(sendRanges.contains(connection) && !connection->canSend());
+    scheduleUpdate(UPDATE_STATS);
+}
+
+bool TransferEngine::assignRange(Connection *connection)
+{
+    skipAssignedJobs();
+    const int i = scheduleJob();
+    if (i < 0)
+        return false;
+    SendJob *job = sendJobs[i];
+    if (!job->isStarted())
+        emit sendJobStarted(i);
+
+    SendRange range;
+    range.jobIndex = i;
+    range.remaining = job->takeRange(connection->getProtocolVersion() >= 2 ? STRIPE_SIZE : job->getFileSize(), &range.offset);
+    range.metadataSent = false;
+    range.start = range.offset;
+    range.hashed = hasTrailers();
+    if (range.hashed)
+        crypto_generichash_init(&range.hashState, nullptr, 0, Protocol::DIGEST_BYTES);
+    range.readOffset = range.offset;
+    sendRanges.insert(connection, range);
+
+    if (job->hasUnassignedRange()) {
+        deficits[i] -= range.remaining;
+    } else {
+        deficits.remove(i);
+        priorityJobs.removeOne(i);
+    }
+    return true;
+}
+
+bool TransferEngine::isSchedulable(int jobIndex)
+{
+    SendJob *job = sendJobs[jobIndex];
+    return job->isReady() && job->hasUnassignedRange() && !isPackable(job);
+}
+
+// Every stripe starts with its own metadata record, so jobs can take turns
+// on a connection stripe by stripe. Jobs that fit in one stripe go first,
+// shortest first, unless another job has a higher priority. The rest share
+// the link by deficit round robin with a quantum that grows with their
+// priority, and get a stripe after every SMALL_JOB_STREAK small jobs.
+int TransferEngine::scheduleJob()
+{
+    QVector<int> candidates;
+    const int end = qMin(sendJobs.length(), firstUnassignedJob + static_cast<int>(SCHEDULE_SCAN));
+    for (int i = firstUnassignedJob; i < end && candidates.length() < SCHEDULE_WINDOW; ++i)
+        if (isSchedulable(i))
+            candidates.append(i);
+    foreach (int i, priorityJobs)
+        if (i >= end && isSchedulable(i))
+            candidates.append(i);
+    if (candidates.isEmpty())
+        return -1;
+    sort(candidates.begin(), candidates.end());
+
+    int topPriority = 0;
+    foreach (int i, candidates)
+        topPriority = qMax(topPriority, sendJobs[i]->getPriority());
+    int best = -1;
+    qint64 bestBytes = 0;
+    QVector<int> others;
+    foreach (int i, candidates) {
+        const qint64 bytes = sendJobs[i]->getUnassignedBytes();
+        if (bytes > STRIPE_SIZE || sendJobs[i]->getPriority() < topPriority) {
+            others.append(i);
+            continue;
+        }
+        if (best < 0 || bytes < bestBytes) {
+            best = i;
+            bestBytes = bytes;
+        }
+    }
+    if (best >= 0 && (others.isEmpty() || ++smallJobStreak < SMALL_JOB_STREAK))
+        return best;
+    smallJobStreak = 0;
+
+    if (others.contains(scheduledJob) && deficits.value(scheduledJob) >= STRIPE_SIZE)
+        return scheduledJob;
+    const QVector<int>::const_iterator next = upper_bound(others.constBegin(), others.constEnd(), scheduledJob);
+    scheduledJob = next != others.constEnd() ? *next : others.first();
+    deficits[scheduledJob] += static_cast<qint64>(STRIPE_SIZE) << sendJobs[scheduledJob]->getPriority();
+    return scheduledJob;
+}
+
+void TransferEngine::skipAssignedJobs()
+{
+    while (firstUnassignedJob < sendJobs.length() && sendJobs[firstUnassignedJob]->isReady()
+           && !sendJobs[firstUnassignedJob]->hasUnassignedRange())
+        ++firstUnassignedJob;
+}
+
+bool TransferEngine::isPackable(SendJob *job) const
+{
+    return connections.first()->getProtocolVersion() >= 4 && job->getFileSize() <= SMALL_FILE_SIZE;
+}
+
+bool TransferEngine::hasTrailers() const
+{
+    return connections.first()->getProtocolVersion() >= 5;
+}
+
+bool TransferEngine::hasBatchJob()
+{
+    for (; nextBatchJob < sendJobs.length(); ++nextBatchJob) {
+        SendJob *job = sendJobs[nextBatchJob];
+        if (!isPackable(job) || (job->isReady() && !job->hasUnassignedRange()))
+            continue;
+        return job->isReady();
+    }
+    return false;
+}
+
+// Small files travel whole, several to a record, each behind a short
+// header instead of a metadata record of its own. Their reads go through the
+// disk queue, and sendBatch() sends the record once all of them are back.
+bool TransferEngine::readBatch(Connection *connection)
+{
+    PendingBatch batch;
+    char *data = connection->beginRecord(Protocol::BATCH, &batch.buffer);
+    batch.dataOffset = static_cast<int>(data - batch.buffer.constData());
+    batch.length = 0;
+    const int capacity = connection->getMaxRecordBytes();
+    while (hasBatchJob()) {
+        const int jobIndex = nextBatchJob;
+        SendJob *job = sendJobs[jobIndex];
+        Protocol::BatchEntry entry;
+        entry.fileId = static_cast<quint32>(jobIndex);
+        entry.fileSize = job->getFileSize();
+        entry.filename = job->getFilename();
+        const QByteArray header(Protocol::encodeBatchEntry(entry));
+        if (batch.length + header.length() + entry.fileSize > capacity || header.length() - 14 > 0xFFFF) {
+            if (batch.length > 0)
+                break;
+            fail(QString("File name too long: %1").arg(entry.filename));
+            return false;
+        }
+        int handle;
+        try {
+            handle = job->handle();
+        } catch (const runtime_error &e) {
+            fail(QString::fromLocal8Bit(e.what()));
+            return false;
+        }
+
+        qint64 offset;
+        job->takeRange(entry.fileSize, &offset);
+        memcpy(data + batch.length, header.constData(), static_cast<size_t>(header.length()));
+        batch.length += header.length();
+        PendingRead read;
+        read.ticket = 0;
+        read.bufferOffset = batch.length;
+        read.length = static_cast<int>(entry.fileSize);
+        if (read.length > 0) {
+            QByteArray buffer(read.length, Qt::Uninitialized);
+            read.ticket = diskIo->read(handle, 0, buffer, 0, read.length);
+        }
+        batch.reads.append(read);
+        batch.jobIndexes.append(jobIndex);
+        batch.length += read.length;
+        emit sendJobStarted(jobIndex);
+    }
+    pendingBatches.insert(connection, batch);
+    return true;
+}
+
+bool TransferEngine::sendBatch(Connection *connection)
+{
+    if (!pendingBatches.contains(connection) && !readBatch(connection))
+        return false;
+    foreach (const PendingRead &read, pendingBatches[connection].reads)
+        if (!diskIo->isFinished(read.ticket))
+            return false;
+
+    PendingBatch batch(pendingBatches.take(connection));
+    char *data = batch.buffer.data() + batch.dataOffset;
+    for (int i = 0; i < batch.reads.length(); ++i) {
+        const PendingRead &read = batch.reads[i];
+        const int jobIndex = batch.jobIndexes[i];
+        SendJob *job = sendJobs[jobIndex];
+        if (read.ticket != 0) {
+            QByteArray buffer;
+            const qint64 ret = diskIo->takeResult(read.ticket, &buffer);
+            if (ret != read.length) {
+                fail(QString(ret < 0 ? "error reading file: %1" : "file changed while sending: %1").arg(job->getPath()));
+                return false;
+            }
+            memcpy(data + read.bufferOffset, buffer.constData(), static_cast<size_t>(read.length));
+        }
+        job->addBytesSent(read.length);
+        sendBytesDone += read.length;
+        diskCopyStats.sendCopied += 2 * static_cast<quint64>(read.length);
+        emit sendJobFinished(jobIndex);
+    }
+
+    connection->commitRecord(batch.buffer, batch.length);
+    skipAssignedJobs();
+    scheduleUpdate(UPDATE_SEND_PROGRESS);
+    return true;
+}
+
+int TransferEngine::getReadDepth() const
+{
+    return qMax(1, diskIo->getQueueDepth() / connections.length());
+}
+
+// Reads for the next records go straight into the buffers they are sealed
+// in. A connection with nothing queued may always read, so a full disk
+// queue never stalls it behind the others.
+bool TransferEngine::readAhead(Connection *connection, SendRange *range, SendJob *job)
+{
+    int handle;
+    try {
+        handle = job->handle();
+    } catch (const runtime_error &e) {
+        fail(QString::fromLocal8Bit(e.what()));
+        return false;
+    }
+    const qint64 end = range->offset + range->remaining;
+    const bool sparse = (connection->getFeatures() & Protocol::FEATURE_SPARSE) != 0;
+    while (range->reads.length() < getReadDepth() && range->readOffset < end && (range->reads.isEmpty() || diskIo->canSubmit())) {
+        PendingRead read;
+        read.length = static_cast<int>(qMin(end - range->readOffset, static_cast<qint64>(connection->getMaxRecordBytes())));
+        const qint64 hole = sparse ? job->getHoleLength(range->readOffset, end - range->readOffset) : 0;
+        if (hole > 0) {
+            read.ticket = 0;
+            read.bufferOffset = 0;
+            read.length = static_cast<int>(hole);
+            range->reads.enqueue(read);
+            range->readOffset += hole;
+            continue;
+        }
+        if (sparse)
+            read.length = static_cast<int>(job->getDataLength(range->readOffset, read.length));
+        QByteArray buffer;
+        char *data = connection->beginRecord(Protocol::DATA, &buffer);
+        read.bufferOffset = static_cast<int>(data - buffer.constData());
+        read.ticket = diskIo->read(handle, range->readOffset, buffer, read.bufferOffset, read.length);
+        range->reads.enqueue(read);
+        range->readOffset += read.length;
+    }
+    return true;
+}
+
+bool TransferEngine::sendNextRecord(Connection *connection)
+{
+    if (!sendRanges.contains(connection)) {
+        if (pendingBatches.contains(connection) || hasBatchJob())
+            return sendBatch(connection);
+        if (failed || !assignRange(connection))
+            return false;
+    }
+
+    SendRange &range = sendRanges[connection];
+    SendJob *job = sendJobs[range.jobIndex];
+    if (!range.metadataSent) {
+        Protocol::Metadata metadata;
+        metadata.fileId = static_cast<quint32>(range.jobIndex);
+        metadata.fileSize = job->getFileSize();
+        metadata.offset = range.offset;
+        metadata.length = range.remaining;
+        metadata.filename = job->getFilename();
+        connection->sendRecord(Protocol::METADATA, Protocol::encodeMetadata(connection->getProtocolVersion(), metadata));
+        range.metadataSent = true;
+        if (range.remaining == 0) {
+            const int jobIndex = range.jobIndex;
+            sendRanges.remove(connection);
+            finishSendJob(connection, jobIndex);
+        }
+        return true;
+    }
+
+    const bool sparse = (connection->getFeatures() & Protocol::FEATURE_SPARSE) != 0;
+    qint64 len = qMin(range.remaining, static_cast<qint64>(connection->getMaxRecordBytes()));
+    if (connection->isPlaintext()) {
+        int handle;
+        qint64 hole = 0;
+        try {
+            handle = job->handle();
+            if (sparse)
+                hole = job->getHoleLength(range.offset, range.remaining);
+            if (sparse && hole == 0)
+                len = job->getDataLength(range.offset, len);
+        } catch (const runtime_error &e) {
+            fail(QString::fromLocal8Bit(e.what()));
+            return false;
+        }
+        if (hole > 0) {
+            sendHole(connection, &range, hole);
+            return true;
+        }
+        const qint64 adviseEnd = qMin(range.offset + range.remaining, range.offset + getReadDepth() * len);
+        if (adviseEnd > range.readOffset) {
+            DiskIo::willNeed(handle, range.readOffset, adviseEnd - range.readOffset);
+            range.readOffset = adviseEnd;
+        }
+        // Each record is a digest piece of its own, hashed by the crypto
+        // worker from the read it makes for the tag.
+        if (range.hashed) {
+            PendingHash pending;
+            pending.jobIndex = range.jobIndex;
+            pending.offset = range.offset;
+            pending.length = len;
+            pendingHashes[connection].enqueue(pending);
+            job->beginDigestPiece();
+            range.start = range.offset + len;
+        }
+        connection->sendFileRecord(Protocol::DATA, handle, range.offset, static_cast<int>(len), range.hashed);
+        advanceSendRange(connection, &range, len);
+        return true;
+    }
+
+    if (!readAhead(connection, &range, job))
+        return false;
+    if (range.reads.head().ticket == 0) {
+        const PendingRead hole(range.reads.dequeue());
+        readAhead(connection, &range, job);
+        sendHole(connection, &range, hole.length);
+        return true;
+    }
+    if (!diskIo->isFinished(range.reads.head().ticket))
+        return false;
+    const PendingRead read(range.reads.dequeue());
+    QByteArray buffer;
+    const qint64 ret = diskIo->takeResult(read.ticket, &buffer);
+    if (ret != read.length) {
+        fail(QString(ret < 0 ? "error reading file: %1" : "file changed while sending: %1").arg(job->getPath()));
+        return false;
+    }
+    char *data = buffer.data() + read.bufferOffset;
+    // Zeros that were written out rather than left as a hole go as one too.
+    const int zeros = sparse ? getZeroTail(data, read.length) : 0;
+    if (zeros == read.length) {
+        connection->discardRecord(buffer);
+        readAhead(connection, &range, job);
+        sendHole(connection, &range, zeros);
+        return true;
+    }
+    len = zeros >= ZERO_BLOCK ? read.length - zeros : read.length;
+    if (range.hashed)
+        crypto_generichash_update(&range.hashState, reinterpret_cast<const unsigned char *>(data), static_cast<unsigned long long>(len));
+    connection->commitRecord(buffer, static_cast<int>(len));
+    diskCopyStats.sendCopied += static_cast<quint64>(len);
+    readAhead(connection, &range, job);
+    advanceSendRange(connection, &range, len);
+    if (len < read.length)
+        sendHole(connection, &range, read.length - len);
+    return true;
+}
+
+// How many bytes at the end of data are zero, in whole blocks counted from
+// the start, so that the check stops at the first block with data.
+int TransferEngine::getZeroTail(const char *data, int length)
+{
+    static const char zeros[ZERO_BLOCK] = {};
+    int end = length;
+    while (end > 0) {
+        const int start = (end - 1) / ZERO_BLOCK * ZERO_BLOCK;
+        if (memcmp(data + start, zeros, static_cast<size_t>(end - start)) != 0)
+            break;
+        end = start;
+    }
+    return length - end;
+}
+
+// A hole gets a digest piece of its own without a hash, as its content is
+// implied by its length. The receiver splits its pieces the same way.
+void TransferEngine::sendHole(Connection *connection, SendRange *range, qint64 length)
+{
+    connection->sendRecord(Protocol::HOLE, Protocol::encodeHole(length));
+    if (range->hashed) {
+        SendJob *job = sendJobs[range->jobIndex];
+        QByteArray hash(Protocol::DIGEST_BYTES, 0);
+        crypto_generichash_final(&range->hashState, reinterpret_cast<unsigned char *>(hash.data()), Protocol::DIGEST_BYTES);
+        job->addDigestPiece(range->start, range->offset - range->start, hash);
+        job->addDigestPiece(range->offset, length, QByteArray());
+        crypto_generichash_init(&range->hashState, nullptr, 0, Protocol::DIGEST_BYTES);
+        range->start = range->offset + length;
+    }
+    advanceSendRange(connection, range, length);
+}
+
+// The range is removed once it is done, so it must not be used afterwards.
+void TransferEngine::advanceSendRange(Connection *connection, SendRange *range, qint64 length)
+{
+    SendJob *job = sendJobs[range->jobIndex];
+    range->offset += length;
+    range->remaining -= length;
+    job->addBytesSent(length);
+    sendBytesDone += length;
+    scheduleUpdate(UPDATE_SEND_PROGRESS);
+
+    if (range->remaining == 0) {
+        const int jobIndex = range->jobIndex;
+        if (range->hashed) {
+            QByteArray hash(Protocol::DIGEST_BYTES, 0);
+            crypto_generichash_final(&range->hashState, reinterpret_cast<unsigned char *>(hash.data()), Protocol::DIGEST_BYTES);
+            job->addDigestPiece(range->start, range->offset - range->start, hash);
+        }
+        sendRanges.remove(connection);
+        if (job->isDone())
+            finishSendJob(connection, jobIndex);
+    }
+}
+
+// While pieces are still being hashed, the trailer waits for the last one.
+void TransferEngine::finishSendJob(Connection *connection, int jobIndex)
+{
+    if (hasTrailers() && sendJobs[jobIndex]->isDigestReady())
+        sendTrailer(connection, jobIndex);
+    emit sendJobFinished(jobIndex);
+}
+
+void TransferEngine::sendTrailer(Connection *connection, int jobIndex)
+{
+    Protocol::Trailer trailer;
+    trailer.fileId = static_cast<quint32>(jobIndex);
+    trailer.digest = sendJobs[jobIndex]->getDigest();
+    connection->sendRecord(Protocol::TRAILER, Protocol::encodeTrailer(trailer));
+}
+
+// Progress and stats change with every frame, the UI only needs them a few
+// dozen times a second.
+void TransferEngine::scheduleUpdate(int updates)
+{
+    pendingUpdates |= updates;
+    if (!updateTimer->isActive())
+        updateTimer->start();
+}
+
+void TransferEngine::emitUpdates()
+{
+    const int updates = pendingUpdates;
+    pendingUpdates = 0;
+    if (updates & UPDATE_SEND_PROGRESS)
+        emitSendProgress();
+    if (updates & UPDATE_RECV_PROGRESS)
+        emitRecvProgress();
+    if (updates & UPDATE_STATS)
+        emitSendStats();
+}
+
+void TransferEngine::emitSendProgress()
+{
+    emit sendProgress(sendBytesTotal > 0 ? static_cast<int>(sendBytesDone * 100 / sendBytesTotal) : 100);
+}
+
+void TransferEngine::emitRecvProgress()
+{
+    emit recvProgress(recvBytesTotal > 0 ? static_cast<int>(recvBytesDone * 100 / recvBytesTotal) : 100);
+}
+
+void TransferEngine::emitMetrics()
+{
+    emit metricsChanged(getMetrics());
+}
+
+void TransferEngine::emitSendStats()
+{
+    SendStats stats;
+    stats.window = 0;
+    stats.refills = 0;
+    stats.underruns = 0;
+    stats.throttles = 0;
+    stats.frames = 0;
+    stats.creditStalls = 0;
+    stats.creditStallNsecs = 0;
+    stats.windowStalls = 0;
+    stats.windowStallNsecs = 0;
+    CompressionStats compression;
+    compression.bytesIn = 0;
+    compression.bytesOut = 0;
+    compression.compressed = 0;
+    compression.bypassed = 0;
+    compression.nsecs = 0;
+    CopyStats copies(diskCopyStats);
+    foreach (Connection *connection, connections) {
+        const SendStats &connectionStats = connection->getSendStats();
+        stats.window += connectionStats.window;
+        stats.refills += connectionStats.refills;
+        stats.underruns += connectionStats.underruns;
+        stats.throttles += connectionStats.throttles;
+        stats.frames += connectionStats.frames;
+        stats.creditStalls += connectionStats.creditStalls;
+        stats.creditStallNsecs += connectionStats.creditStallNsecs;
+        stats.windowStalls += connectionStats.windowStalls;
+        stats.windowStallNsecs += connectionStats.windowStallNsecs;
+        const CompressionStats connectionCompression(connection->getCompressionStats());
+        compression.bytesIn += connectionCompression.bytesIn;
+        compression.bytesOut += connectionCompression.bytesOut;
+        compression.compressed += connectionCompression.compressed;
+        compression.bypassed += connectionCompression.bypassed;
+        compression.nsecs += connectionCompression.nsecs;
+        const CopyStats &connectionCopies = connection->getCopyStats();
+        copies.sendPayload += connectionCopies.sendPayload;
+        copies.sendCopied += connectionCopies.sendCopied;
+        copies.recvPayload += connectionCopies.recvPayload;
+        copies.recvCopied += connectionCopies.recvCopied;
+    }
+    emit sendStatsChanged(stats);
+    emit compressionStatsChanged(compression);
+    emit copyStatsChanged(copies);
+}
+
+void TransferEngine::checkIdle()
+{
+    if (failed || idleNotified || !connections.first()->isReady() || !isIdle())
+        return;
+    idleNotified = true;
+    emit idle();
+}
+
+void TransferEngine::resumeVerified(int jobIndex, qint64 offset, const QByteArray &hash, bool ok)
+{
+    if (failed)
+        return;
+
+    SendJob *job = sendJobs[jobIndex];
+    if (ok && offset > 0) {
+        job->skipTo(offset);
+        job->addDigestPiece(0, offset, hash);
+        sendBytesDone += offset;
+        emit sendJobStarted(jobIndex);
+        scheduleUpdate(UPDATE_SEND_PROGRESS);
+        if (job->isDone())
+            finishSendJob(connections.first(), jobIndex);
+    }
+    job->setReady(true);
+    fillConnections();
+}
+
+void TransferEngine::deltaPlanned(int jobIndex, const DeltaPlan &plan)
+{
+    if (failed)
+        return;
+
+    SendJob *job = sendJobs[jobIndex];
+    qint64 literalBytes = 0;
+    for (int i = 0; i < plan.literals.length(); ++i)
+        literalBytes += plan.literals[i].second;
+    if (plan.ok && plan.copyBytes + literalBytes == job->getFileSize()) {
+        Connection *connection = connections.first();
+        const int maxCopies = (connection->getMaxRecordBytes() - 4) / 24;
+        for (int i = 0; i < plan.copies.length(); i += maxCopies)
+            connection->sendRecord(Protocol::COPY, Protocol::encodeCopies(static_cast<quint32>(jobIndex), plan.copies.constData() + i,
+                                                                          qMin(maxCopies, plan.copies.length() - i)));
+        job->setRanges(plan.literals);
+        for (int i = 0; i < plan.copies.length(); ++i)
+            job->addDigestPiece(plan.copies[i].offset, plan.copies[i].length, plan.copyHashes[i]);
+        if (plan.copyBytes > 0) {
+            emit sendJobStarted(jobIndex);
+            job->addBytesSent(plan.copyBytes);
+            sendBytesDone += plan.copyBytes;
+            scheduleUpdate(UPDATE_SEND_PROGRESS);
+        }
+        if (job->isDone())
+            finishSendJob(connection, jobIndex);
+    }
+    job->setReady(true);
+    fillConnections();
+}
+
+TransferEngine::RecvFile *TransferEngine::newRecvFile(const Protocol::Metadata &metadata)
+{
+    RecvFile *file = new RecvFile;
+    file->fileId = metadata.fileId;
+    file->id = nextRecvId++;
+    file->filename = metadata.filename;
+    file->checkpoint = nullptr;
+    file->fileSize = metadata.fileSize;
+    file->resumedBytes = 0;
+    file->bytesRecved = 0;
+    file->finishing = false;
+    file->synced = false;
+    recvFiles.insert(metadata.fileId, file);
+    idleNotified = false;
+    return file;
+}
+
+// The names are sanitized when they are decoded, this makes sure that
+// nothing the platform resolves differently gets out of the save path.
+QString TransferEngine::getSavePath(const QString &filename)
+{
+    const QString root(QDir::cleanPath(saveDir.absolutePath()));
+    const QString path(QDir::cleanPath(saveDir.absoluteFilePath(filename)));
+    if (!path.startsWith(root.endsWith('/') ? root : root + '/')) {
+        fail(QString("Invalid file name: %1").arg(filename));
+        return QString();
+    }
+    return path;
+}
+
+TransferEngine::RecvFile *TransferEngine::openRecvFile(const Protocol::Metadata &metadata, bool checkpointed, bool resume)
+{
+    const QString path(getSavePath(metadata.filename));
+    if (path.isEmpty())
+        return nullptr;
+    RecvFile *file = newRecvFile(metadata);
+    file->file.setFileName(path);
+    if (!saveDir.mkpath(QFileInfo(path).path())) {
+        fail(QString("Error creating directory for: %1").arg(path));
+        return nullptr;
+    }
+    if (checkpointed) {
+        file->checkpoint = new Checkpoint(path);
+        if (resume && file->file.exists() && file->checkpoint->load(metadata.fileSize))
+            file->resumedBytes = file->checkpoint->getVerifiedBytes();
+        else if (!file->checkpoint->create(metadata.fileSize)) {
+            fail(QString("Error creating checkpoint: %1").arg(file->checkpoint->getPath()));
+            return nullptr;
+        }
+    }
+    if (!file->file.open((file->resumedBytes > 0 ? QIODevice::ReadWrite : QIODevice::WriteOnly) | QIODevice::Unbuffered)) {
+        fail(QString("Error opening file: %1").arg(path));
+        return nullptr;
+    }
+    if (!preallocate(&file->file, metadata.fileSize))
+        return nullptr;
+
+    file->bytesRecved = file->resumedBytes;
+    recvBytesTotal += metadata.fileSize;
+    recvBytesDone += file->resumedBytes;
+    emit recvJobStarted(file->id, file->filename);
+    return file;
+}
+
+bool TransferEngine::preallocate(QFile *file, qint64 size)
+{
+#ifdef Q_OS_LINUX
+    if (options.preallocate && size > 0 && posix_fallocate(file->handle(), 0, static_cast<off_t>(size)) == ENOSPC) {
+        fail(QString("Not enough disk space for: %1").arg(file->fileName()));
+        return false;
+    }
+#else
+    Q_UNUSED(file);
+    Q_UNUSED(size);
+#endif
+    return true;
+}
+
+void TransferEngine::openDeltaRecvFile(Connection *connection, const Protocol::Metadata &metadata)
+{
+    const QString path(getSavePath(metadata.filename));
+    if (path.isEmpty())
+        return;
+    RecvFile *file = newRecvFile(metadata);
+    file->targetPath = path;
+    file->basis.setFileName(file->targetPath);
+    file->file.setFileName(file->targetPath + ".snftp-delta");
+    if (!file->basis.open(QIODevice::ReadOnly | QIODevice::Unbuffered) || !file->file.open(QIODevice::WriteOnly | QIODevice::Unbuffered)) {
+        fail(QString("Error opening file: %1").arg(file->targetPath));
+        return;
+    }
+    if (!preallocate(&file->file, metadata.fileSize))
+        return;
+    recvBytesTotal += metadata.fileSize;
+    emit recvJobStarted(file->id, file->filename);
+
+    QFutureWatcher<QVector<Protocol::IndexEntry> > *watcher = new QFutureWatcher<QVector<Protocol::IndexEntry> >(this);
+    const quint32 fileId = metadata.fileId;
+    connect(watcher, &QFutureWatcher<QVector<Protocol::IndexEntry> >::finished, this, [this, watcher, connection, fileId]() {
+        deltaIndexed(connection, fileId, watcher->result());
+        watcher->deleteLater();
+    });
+    watcher->setFuture(QtConcurrent::run(ChunkIndex::load, file->targetPath));
+}
+
+void TransferEngine::deltaIndexed(Connection *connection, quint32 fileId, const QVector<Protocol::IndexEntry> &index)
+{
+    if (failed)
+        return;
+
+    const int maxEntries = (connection->getMaxRecordBytes() - 4) / (4 + static_cast<int>(sizeof(Protocol::IndexEntry::hash)));
+    for (int i = 0; i < index.length(); i += maxEntries)
+        connection->sendRecord(Protocol::INDEX, Protocol::encodeIndex(fileId, index.constData() + i, qMin(maxEntries, index.length() - i)));
+
+    Protocol::Resume resume;
+    resume.fileId = fileId;
+    resume.offset = 0;
+    connection->sendRecord(Protocol::RESUME, Protocol::encodeResume(resume));
+
+    RecvFile *file = recvFiles.value(fileId);
+    qint64 offset = 0;
+    foreach (const Protocol::IndexEntry &entry, index) {
+        file->indexOffsets.append(offset);
+        offset += entry.length;
+    }
+    file->indexOffsets.append(offset);
+    if (file->fileSize == 0)
+        checkRecvFile(file);
+}
+
+void TransferEngine::checkRecvFile(RecvFile *file)
+{
+    if (file->bytesRecved != file->fileSize || (hasTrailers() && file->trailer.isEmpty()))
+        return;
+    if (hasTrailers() && file->digest.getDigest() != file->trailer) {
+        if (file->checkpoint != nullptr)
+            file->checkpoint->remove();
+        fail(QString("Integrity check failed: %1").arg(file->filename));
+        return;
+    }
+    finishRecvFile(file);
+}
+
+// A file is only closed once its writes have completed and, if the policy
+// asks for it, once it has been synced. writesCompleted() calls back here.
+void TransferEngine::finishRecvFile(RecvFile *file)
+{
+    file->finishing = true;
+    if (!file->pendingWrites.isEmpty())
+        return;
+    // A hole at the end leaves nothing written there.
+    if (file->file.size() < file->fileSize && !file->file.resize(file->fileSize)) {
+        fail(QString("Error writing file: %1").arg(file->file.fileName()));
+        return;
+    }
+    if (!file->synced && options.durability != DiskIo::DURABILITY_NONE) {
+        file->synced = true;
+        const quint64 ticket = diskIo->sync(file->file.handle(), static_cast<DiskIo::Durability>(options.durability));
+        file->pendingWrites.insert(ticket, 0);
+        DiskWrite &write = diskWrites[ticket];
+        write.file = file;
+        write.connection = nullptr;
+        return;
+    }
+
+    file->file.close();
+    if (file->checkpoint != nullptr)
+        file->checkpoint->remove();
+    if (!file->targetPath.isEmpty()) {
+        file->basis.close();
+        QFile::remove(ChunkIndex::cachePath(file->targetPath));
+        if (!QFile::remove(file->targetPath) || !file->file.rename(file->targetPath)) {
+            fail(QString("Error replacing file: %1").arg(file->targetPath));
+            return;
+        }
+    }
+    // The sender only counts the file as delivered once this arrives.
+    if (hasTrailers())
+        connections.first()->sendRecord(Protocol::ACK, Protocol::encodeAck(file->fileId));
+    emit recvJobFinished(file->id);
+    recvFiles.remove(file->fileId);
+    delete file;
+    checkIdle();
+}
+
+// A chunk goes into the checkpoint once every write of its file up to the
+// one that completes it has reached the disk. Without data, the bytes are
+// zeros, and a whole chunk of them always has the same hash.
+void TransferEngine::checkpointChunks(RecvRange *range, const char *data, qint64 length, quint64 ticket)
+{
+    static const QByteArray zeros(ZERO_BLOCK, 0);
+    static const QByteArray zeroChunkHash([]() {
+        crypto_generichash_state state;
+        crypto_generichash_init(&state, nullptr, 0, Checkpoint::HASH_BYTES);
+        for (qint64 i = 0; i < Checkpoint::CHUNK_SIZE; i += ZERO_BLOCK)
+            crypto_generichash_update(&state, reinterpret_cast<const unsigned char *>(zeros.constData()), ZERO_BLOCK);
+        QByteArray ret(Checkpoint::HASH_BYTES, 0);
+        crypto_generichash_final(&state, reinterpret_cast<unsigned char *>(ret.data()), Checkpoint::HASH_BYTES);
+        return ret;
+    }());
+
+    RecvFile *file = range->file;
+    qint64 offset = range->offset;
+    while (length > 0) {
+        const qint64 len = qMin(length, Checkpoint::CHUNK_SIZE - offset % Checkpoint::CHUNK_SIZE);
+        const bool zeroChunk = data == nullptr && len == Checkpoint::CHUNK_SIZE;
+        if (data != nullptr) {
+            crypto_generichash_update(&range->chunkState, reinterpret_cast<const unsigned char *>(data), static_cast<unsigned long long>(len));
+            data += len;
+        } else if (!zeroChunk) {
+            for (qint64 i = 0; i < len; i += ZERO_BLOCK)
+                crypto_generichash_update(&range->chunkState, reinterpret_cast<const unsigned char *>(zeros.constData()),
+                                          static_cast<unsigned long long>(qMin(len - i, static_cast<qint64>(ZERO_BLOCK))));
+        }
+        offset += len;
+        length -= len;
+        if (offset % Checkpoint::CHUNK_SIZE != 0 && offset != file->fileSize)
+            continue;
+
+        PendingChunk chunk;
+        chunk.ticket = ticket;
+        chunk.index = (offset - 1) / Checkpoint::CHUNK_SIZE;
+        if (zeroChunk) {
+            chunk.hash = zeroChunkHash;
+        } else {
+            chunk.hash = QByteArray(Checkpoint::HASH_BYTES, 0);
+            crypto_generichash_final(&range->chunkState, reinterpret_cast<unsigned char *>(chunk.hash.data()), Checkpoint::HASH_BYTES);
+            crypto_generichash_init(&range->chunkState, nullptr, 0, Checkpoint::HASH_BYTES);
+        }
+        file->pendingChunks.append(chunk);
+    }
+}
+
+// Writes of less than half a record get a buffer of their own, so a batch
+// of small files holds no more memory than its record.
+QByteArray TransferEngine::acquireWriteBuffer(Connection *connection, int length)
+{
+    if (length < connection->getMaxRecordBytes() / 2)
+        return QByteArray(length, Qt::Uninitialized);
+    if (writePool.getBufferSize() < length)
+        writePool.setBufferSize(qMax(length, connection->getMaxRecordBytes()));
+    return writePool.acquire();
+}
+
+quint64 TransferEngine::submitWrite(Connection *connection, RecvFile *file, qint64 offset, QByteArray &buffer, int length, bool credited)
+{
+    const quint64 ticket = diskIo->write(file->file.handle(), offset, buffer, 0, length);
+    file->pendingWrites.insert(ticket, length);
+    DiskWrite &write = diskWrites[ticket];
+    write.file = file;
+    write.connection = credited ? connection : nullptr;
+    return ticket;
+}
+
+// The data is copied out of the frame and written in the background. The
+// engine never waits for the disk, while its queue is full the records
+// after this one are held back instead. The peer is granted credited bytes
+// back once they are on the disk.
+quint64 TransferEngine::writeBehind(Connection *connection, RecvFile *file, qint64 offset, const char *data, int length, bool credited)
+{
+    QByteArray buffer(acquireWriteBuffer(connection, length));
+    memcpy(buffer.data(), data, static_cast<size_t>(length));
+    return submitWrite(connection, file, offset, buffer, length, credited);
+}
+
+void TransferEngine::reapWrites()
+{
+    QList<RecvFile *> files;
+    QMap<quint64, DiskWrite>::iterator it = diskWrites.begin();
+    while (it != diskWrites.end()) {
+        if (!diskIo->isFinished(it.key())) {
+            ++it;
+            continue;
+        }
+        RecvFile *file = it->file;
+        QByteArray buffer;
+        const qint64 ret = diskIo->takeResult(it.key(), &buffer);
+        writePool.release(buffer);
+        const qint64 expected = file->pendingWrites.take(it.key());
+        if (ret != expected)
+            fail(QString("Error writing file: %1").arg(file->file.fileName()));
+        else if (it->connection != nullptr)
+            it->connection->grantCredit(expected);
+        if (!files.contains(file))
+            files.append(file);
+        it = diskWrites.erase(it);
+    }
+    foreach (RecvFile *file, files)
+        writesCompleted(file);
+}
+
+void TransferEngine::writesCompleted(RecvFile *file)
+{
+    if (failed)
+        return;
+    while (!file->pendingChunks.isEmpty()
+           && (file->pendingWrites.isEmpty() || file->pendingChunks.first().ticket < file->pendingWrites.firstKey())) {
+        const PendingChunk chunk(file->pendingChunks.takeFirst());
+        if (!file->checkpoint->addChunk(chunk.index, chunk.hash)) {
+            fail(QString("Error writing checkpoint: %1").arg(file->checkpoint->getPath()));
+            return;
+        }
+    }
+    if (file->finishing && file->pendingWrites.isEmpty())
+        finishRecvFile(file);
+}
+
+bool TransferEngine::hasDiskTask(Connection *connection) const
+{
+    const QHash<Connection *, RecvRange>::const_iterator range = recvRanges.constFind(connection);
+    return copyTasks.contains(connection) || (range != recvRanges.constEnd() && range->holeLength > 0);
+}
+
+// A record that needs more disk operations than the queue had room for is
+// continued here, and its connection's records are let through once it is
+// done and the queue has room again.
+void TransferEngine::continueDiskTasks()
+{
+    foreach (Connection *connection, connections) {
+        if (!failed && recvRanges.contains(connection) && recvRanges[connection].holeLength > 0)
+            continueHole(connection);
+        if (!failed && copyTasks.contains(connection))
+            continueCopies(connection);
+        if (!failed && diskIo->canSubmit() && !hasDiskTask(connection))
+            connection->resumeRecords();
+    }
+}
+
+void TransferEngine::processOffer(Connection *connection, const char *data, int length)
+{
+    Protocol::Metadata metadata;
+    if (!Protocol::decodeMetadata(connection->getProtocolVersion(), data, length, &metadata) || recvFiles.contains(metadata.fileId)) {
+        fail("Unexpected offer record!");
+        return;
+    }
+
+    const QString path(getSavePath(metadata.filename));
+    if (path.isEmpty())
+        return;
+    if ((connection->getFeatures() & Protocol::FEATURE_DELTA) != 0 && QFileInfo(path).isFile() && QFileInfo(path).size() > 0
+            && !QFile::exists(Checkpoint(path).getPath())) {
+        openDeltaRecvFile(connection, metadata);
+        return;
+    }
+
+    RecvFile *file = openRecvFile(metadata, true, true);
+    if (file == nullptr)
+        return;
+    if (file->resumedBytes == 0) {
+        resumeChecked(connection, file, QVector<QByteArray>());
+        return;
+    }
+
+    // The prefix the checkpoint claims is read back from the file before it
+    // is offered, see Checkpoint::verify().
+    QFutureWatcher<QVector<QByteArray> > *watcher = new QFutureWatcher<QVector<QByteArray> >(this);
+    const quint32 fileId = metadata.fileId;
+    connect(watcher, &QFutureWatcher<QVector<QByteArray> >::finished, this, [this, watcher, connection, fileId]() {
+        if (!failed)
+            resumeChecked(connection, recvFiles.value(fileId), watcher->result());
+        watcher->deleteLater();
+    });
+    watcher->setFuture(QtConcurrent::run(Checkpoint::hashChunks, file->file.fileName(), file->resumedBytes));
+}
+
+void TransferEngine::resumeChecked(Connection *connection, RecvFile *file, const QVector<QByteArray> &hashes)
+{
+    if (!file->checkpoint->verify(hashes)) {
+        fail(QString("Error writing checkpoint: %1").arg(file->checkpoint->getPath()));
+        return;
+    }
+    const qint64 dropped = file->resumedBytes - file->checkpoint->getVerifiedBytes();
+    file->resumedBytes -= dropped;
+    file->bytesRecved -= dropped;
+    recvBytesDone -= dropped;
+
+    Protocol::Resume resume;
+    resume.fileId = file->fileId;
+    resume.offset = file->resumedBytes;
+    if (resume.offset > 0) {
+        // Taken from what was read back rather than from the sidecar, so the
+        // digest covers the bytes that are actually on the disk.
+        const int count = static_cast<int>((resume.offset + Checkpoint::CHUNK_SIZE - 1) / Checkpoint::CHUNK_SIZE);
+        resume.hash = Checkpoint::combine(hashes.mid(0, count));
+        file->digest.addPiece(0, resume.offset, resume.hash);
+    }
+    connection->sendRecord(Protocol::RESUME, Protocol::encodeResume(resume));
+
+    if (file->fileSize > 0)
+        checkRecvFile(file);
+}
+
+void TransferEngine::processResume(Connection *connection, const char *data, int length)
+{
+    Q_UNUSED(connection);
+
+    Protocol::Resume resume;
+    if (!Protocol::decodeResume(data, length, &resume) || resume.fileId >= static_cast<quint32>(sendJobs.length())
+            || sendJobs[static_cast<int>(resume.fileId)]->isReady()
+            || resume.offset > sendJobs[static_cast<int>(resume.fileId)]->getFileSize()) {
+        fail("Unexpected resume record!");
+        return;
+    }
+
+    const int jobIndex = static_cast<int>(resume.fileId);
+    if (resume.offset == 0 && peerIndexes.contains(jobIndex)) {
+        QFutureWatcher<DeltaPlan> *watcher = new QFutureWatcher<DeltaPlan>(this);
+        connect(watcher, &QFutureWatcher<DeltaPlan>::finished, this, [this, watcher, jobIndex]() {
+            deltaPlanned(jobIndex, watcher->result());
+            watcher->deleteLater();
+        });
+        watcher->setFuture(QtConcurrent::run(ChunkIndex::plan, sendJobs[jobIndex]->getPath(), peerIndexes.take(jobIndex)));
+        return;
+    }
+    if (resume.offset == 0) {
+        resumeVerified(jobIndex, 0, QByteArray(), true);
+        return;
+    }
+
+    QFutureWatcher<QByteArray> *watcher = new QFutureWatcher<QByteArray>(this);
+    const qint64 offset = resume.offset;
+    const QByteArray hash(resume.hash);
+    connect(watcher, &QFutureWatcher<QByteArray>::finished, this, [this, watcher, jobIndex, offset, hash]() {
+        resumeVerified(jobIndex, offset, hash, watcher->result() == hash);
+        watcher->deleteLater();
+    });
+    watcher->setFuture(QtConcurrent::run(Checkpoint::hashFilePrefix, sendJobs[jobIndex]->getPath(), offset));
+}
+
+void TransferEngine::processIndex(Connection *connection, const char *data, int length)
+{
+    Q_UNUSED(connection);
+
+    quint32 fileId;
+    QVector<Protocol::IndexEntry> entries;
+    if (!Protocol::decodeIndex(data, length, &fileId, &entries) || fileId >= static_cast<quint32>(sendJobs.length())
+            || sendJobs[static_cast<int>(fileId)]->isReady()) {
+        fail("Unexpected index record!");
+        return;
+    }
+    peerIndexes[static_cast<int>(fileId)] += entries;
+}
+
+void TransferEngine::processCopies(Connection *connection, const char *data, int length)
+{
+    quint32 fileId;
+    QVector<Protocol::Copy> copies;
+    RecvFile *file;
+    if (!Protocol::decodeCopies(data, length, &fileId, &copies) || (file = recvFiles.value(fileId)) == nullptr || file->targetPath.isEmpty()) {
+        fail("Unexpected copy record!");
+        return;
+    }
+
+    const qint64 basisSize = file->basis.size();
+    foreach (const Protocol::Copy &copy, copies) {
+        if (copy.offset > file->fileSize || copy.length > file->fileSize - copy.offset
+                || copy.sourceOffset > basisSize || copy.length > basisSize - copy.sourceOffset) {
+            fail("Unexpected copy record!");
+            return;
+        }
+    }
+
+    CopyTask &task = copyTasks[connection];
+    task.file = file;
+    task.copies = copies;
+    task.index = 0;
+    task.done = 0;
+    task.readIndex = 0;
+    task.readDone = 0;
+    task.reads.clear();
+    continueCopies(connection);
+}
+
+// The basis is read through the disk queue and written behind like data,
+// but without credit as it never crossed the network. The reads come back
+// in the order they were made, each is written where the copies are at.
+// Whatever does not fit in the queue waits for diskCompleted().
+void TransferEngine::continueCopies(Connection *connection)
+{
+    CopyTask &task = copyTasks[connection];
+    RecvFile *file = task.file;
+    const int hashBytes = static_cast<int>(sizeof(Protocol::IndexEntry::hash));
+    while (!task.reads.isEmpty() && diskIo->isFinished(task.reads.head().ticket)) {
+        const PendingRead read(task.reads.dequeue());
+        const Protocol::Copy &copy = task.copies[task.index];
+        if (task.done == 0 && !beginCopy(&task))
+            return;
+        QByteArray buffer;
+        if (diskIo->takeResult(read.ticket, &buffer) != read.length) {
+            fail(QString("Error copying file: %1").arg(file->targetPath));
+            return;
+        }
+        for (int hashed = 0; task.chunk >= 0 && hashed < read.length;) {
+            if (task.chunk >= file->indexOffsets.length() - 1) {
+                fail("Unexpected copy record!");
+                return;
+            }
+            const qint64 position = copy.sourceOffset + task.done + hashed;
+            const int step = static_cast<int>(qMin(static_cast<qint64>(read.length - hashed), file->indexOffsets[task.chunk + 1] - position));
+            crypto_generichash_update(&task.state, reinterpret_cast<const unsigned char *>(buffer.constData() + hashed),
+                                      static_cast<unsigned long long>(step));
+            hashed += step;
+            if (position + step != file->indexOffsets[task.chunk + 1])
+                continue;
+            unsigned char hash[sizeof(Protocol::IndexEntry::hash)];
+            crypto_generichash_final(&task.state, hash, sizeof(hash));
+            task.chunkHashes.append(reinterpret_cast<const char *>(hash), hashBytes);
+            crypto_generichash_init(&task.state, nullptr, 0, sizeof(hash));
+            ++task.chunk;
+        }
+        submitWrite(connection, file, copy.offset + task.done, buffer, read.length, false);
+        diskCopyStats.recvCopied += 2 * static_cast<quint64>(read.length);
+        task.done += read.length;
+        if (task.done == copy.length && !finishCopy(&task))
+            return;
+    }
+
+    if (task.index < task.copies.length()) {
+        while (task.readIndex < task.copies.length() && diskIo->canSubmit()) {
+            const Protocol::Copy &copy = task.copies[task.readIndex];
+            PendingRead read;
+            read.bufferOffset = 0;
+            read.length = static_cast<int>(qMin(copy.length - task.readDone, static_cast<qint64>(connection->getMaxRecordBytes())));
+            QByteArray buffer(acquireWriteBuffer(connection, read.length));
+            read.ticket = diskIo->read(file->basis.handle(), copy.sourceOffset + task.readDone, buffer, 0, read.length);
+            task.reads.enqueue(read);
+            task.readDone += read.length;
+            if (task.readDone == copy.length) {
+                ++task.readIndex;
+                task.readDone = 0;
+            }
+        }
+        return;
+    }
+
+    copyTasks.remove(connection);
+    scheduleUpdate(UPDATE_RECV_PROGRESS);
+    checkRecvFile(file);
+}
+
+// Copies start and end on chunks of our own index. Rehashing those chunks
+// while the basis is read catches a basis that changed since it was indexed.
+bool TransferEngine::beginCopy(CopyTask *task)
+{
+    const Protocol::Copy &copy = task->copies[task->index];
+    RecvFile *file = task->file;
+    task->chunk = -1;
+    if (hasTrailers()) {
+        task->chunk = static_cast<int>(lower_bound(file->indexOffsets.constBegin(), file->indexOffsets.constEnd(), copy.sourceOffset)
+                                       - file->indexOffsets.constBegin());
+        if (task->chunk >= file->indexOffsets.length() - 1 || file->indexOffsets[task->chunk] != copy.sourceOffset) {
+            fail("Unexpected copy record!");
+            return false;
+        }
+    }
+    crypto_generichash_init(&task->state, nullptr, 0, sizeof(Protocol::IndexEntry::hash));
+    task->chunkHashes.clear();
+    return true;
+}
+
+bool TransferEngine::finishCopy(CopyTask *task)
+{
+    const Protocol::Copy &copy = task->copies[task->index];
+    RecvFile *file = task->file;
+    if (task->chunk >= 0) {
+        if (file->indexOffsets[task->chunk] != copy.sourceOffset + copy.length) {
+            fail("Unexpected copy record!");
+            return false;
+        }
+        file->digest.addPiece(copy.offset, copy.length, FileDigest::hash(task->chunkHashes));
+    }
+    file->bytesRecved += copy.length;
+    recvBytesDone += copy.length;
+    ++task->index;
+    task->done = 0;
+    return true;
+}
+
+// Packed files are written behind and synced like any other, so a batch
+// never waits for the disk. The entry headers are granted back right away,
+// the file bytes once they are written.
+void TransferEngine::processBatch(Connection *connection, const char *data, int length)
+{
+    qint64 headerTotal = 0;
+    while (length > 0 && !failed) {
+        Protocol::BatchEntry entry;
+        const int headerBytes = Protocol::decodeBatchEntry(data, length, &entry);
+        if (headerBytes < 0 || recvFiles.contains(entry.fileId)) {
+            fail("Invalid batch record!");
+            return;
+        }
+        Protocol::Metadata metadata;
+        metadata.fileId = entry.fileId;
+        metadata.fileSize = entry.fileSize;
+        metadata.offset = 0;
+        metadata.length = entry.fileSize;
+        metadata.filename = entry.filename;
+        const QString path(getSavePath(entry.filename));
+        if (path.isEmpty())
+            return;
+        RecvFile *file = newRecvFile(metadata);
+        file->file.setFileName(path);
+        if (!saveDir.mkpath(QFileInfo(path).path()) || !file->file.open(QIODevice::WriteOnly | QIODevice::Unbuffered)) {
+            fail(QString("Error writing file: %1").arg(path));
+            return;
+        }
+        emit recvJobStarted(file->id, file->filename);
+        if (entry.fileSize > 0)
+            writeBehind(connection, file, 0, data + headerBytes, static_cast<int>(entry.fileSize));
+
+        diskCopyStats.recvCopied += 2 * static_cast<quint64>(entry.fileSize);
+        file->bytesRecved = entry.fileSize;
+        recvBytesTotal += entry.fileSize;
+        recvBytesDone += entry.fileSize;
+        headerTotal += headerBytes;
+        data += headerBytes + entry.fileSize;
+        length -= headerBytes + static_cast<int>(entry.fileSize);
+        if (!failed)
+            finishRecvFile(file);
+    }
+    connection->grantCredit(headerTotal);
+    scheduleUpdate(UPDATE_RECV_PROGRESS);
+}
+
+void TransferEngine::processTrailer(Connection *connection, const char *data, int length)
+{
+    Q_UNUSED(connection);
+
+    Protocol::Trailer trailer;
+    RecvFile *file;
+    if (!hasTrailers() || !Protocol::decodeTrailer(data, length, &trailer) || (file = recvFiles.value(trailer.fileId)) == nullptr
+            || !file->trailer.isEmpty()) {
+        fail("Unexpected trailer record!");
+        return;
+    }
+    file->trailer = trailer.digest;
+    checkRecvFile(file);
+}
+
+void TransferEngine::processAck(Connection *connection, const char *data, int length)
+{
+    Q_UNUSED(connection);
+
+    quint32 fileId;
+    if (!hasTrailers() || !Protocol::decodeAck(data, length, &fileId) || fileId >= static_cast<quint32>(sendJobs.length())
+            || !sendJobs[static_cast<int>(fileId)]->isDone() || sendJobs[static_cast<int>(fileId)]->isAcknowledged()) {
+        fail("Unexpected acknowledgement record!");
+        return;
+    }
+    sendJobs[static_cast<int>(fileId)]->setAcknowledged();
+    ++acknowledgedJobs;
+    checkIdle();
+}
+
+void TransferEngine::processMetadata(Connection *connection, const char *data, int length)
+{
+    Protocol::Metadata metadata;
+    if (recvRanges.contains(connection) || !Protocol::decodeMetadata(connection->getProtocolVersion(), data, length, &metadata)) {
+        fail("Unexpected metadata record!");
+        return;
+    }
+    if (connection->getProtocolVersion() < 2)
+        metadata.fileId = nextV1FileId++;
+
+    const bool checkpointed = connection->getProtocolVersion() >= 3;
+    RecvFile *file = recvFiles.value(metadata.fileId);
+    if (file == nullptr) {
+        file = openRecvFile(metadata, checkpointed, false);
+        if (file == nullptr)
+            return;
+    } else if (file->fileSize != metadata.fileSize) {
+        fail("Unexpected metadata record!");
+        return;
+    }
+
+    if (checkpointed && metadata.offset < file->resumedBytes) {
+        // The sender rejected our checkpoint and starts over from scratch.
+        file->bytesRecved -= file->resumedBytes;
+        recvBytesDone -= file->resumedBytes;
+        file->resumedBytes = 0;
+        file->digest.clear();
+        if (!file->checkpoint->create(file->fileSize)) {
+            fail(QString("Error creating checkpoint: %1").arg(file->checkpoint->getPath()));
+            return;
+        }
+    }
+    if (file->checkpoint != nullptr && metadata.offset % Checkpoint::CHUNK_SIZE != 0) {
+        fail("Unaligned metadata record!");
+        return;
+    }
+
+    if (metadata.length > 0) {
+        RecvRange &range = recvRanges[connection];
+        range.file = file;
+        range.offset = metadata.offset;
+        range.remaining = metadata.length;
+        range.start = metadata.offset;
+        crypto_generichash_init(&range.chunkState, nullptr, 0, Checkpoint::HASH_BYTES);
+        crypto_generichash_init(&range.hashState, nullptr, 0, Protocol::DIGEST_BYTES);
+        range.holeLength = 0;
+        range.zeroOffset = 0;
+        range.zeroEnd = 0;
+    } else if (file->fileSize == 0) {
+        checkRecvFile(file);
+    }
+}
+
+void TransferEngine::processContent(Connection *connection, const char *data, int length)
+{
+    if (!recvRanges.contains(connection) || recvRanges[connection].remaining < length) {
+        fail("Unexpected data record!");
+        return;
+    }
+
+    RecvRange &range = recvRanges[connection];
+    RecvFile *file = range.file;
+    const quint64 ticket = writeBehind(connection, file, range.offset, data, length);
+    if (failed)
+        return;
+    if (file->checkpoint != nullptr)
+        checkpointChunks(&range, data, length, ticket);
+    // A plaintext record is a digest piece of its own, as the sender hashes it
+    // while reading it for the tag.
+    if (hasTrailers() && connection->isPlaintext()) {
+        file->digest.addPiece(range.offset, length, FileDigest::hash(QByteArray::fromRawData(data, length)));
+        range.start = range.offset + length;
+    } else if (hasTrailers()) {
+        crypto_generichash_update(&range.hashState, reinterpret_cast<const unsigned char *>(data), static_cast<unsigned long long>(length));
+    }
+    // Once into the write buffer and once into the page cache.
+    diskCopyStats.recvCopied += 2 * static_cast<quint64>(length);
+    advanceRecvRange(connection, &range, length);
+}
+
+// A hole is punched rather than written, so it reads back as zeros whatever
+// the file held before and takes no space. A preallocated file keeps its
+// blocks. Without hole punching, zeros are written over whatever part of the
+// hole the file already has from an earlier attempt.
+void TransferEngine::processHole(Connection *connection, const char *data, int length)
+{
+    qint64 holeLength;
+    if (!recvRanges.contains(connection) || !Protocol::decodeHole(data, length, &holeLength)
+            || recvRanges[connection].remaining < holeLength) {
+        fail("Unexpected hole record!");
+        return;
+    }
+
+    RecvRange &range = recvRanges[connection];
+    RecvFile *file = range.file;
+    range.holeLength = holeLength;
+    range.zeroOffset = range.offset;
+    range.zeroEnd = range.offset;
+    if (!DiskIo::punchHole(file->file.handle(), range.offset, holeLength, options.preallocate))
+        range.zeroEnd = qMax(range.offset, qMin(range.offset + holeLength, file->file.size()));
+    continueHole(connection);
+}
+
+// The zeros were never sent, so no credit is returned for them. Once the
+// queue is full the rest waits for diskCompleted().
+void TransferEngine::continueHole(Connection *connection)
+{
+    RecvRange &range = recvRanges[connection];
+    RecvFile *file = range.file;
+    while (range.zeroOffset < range.zeroEnd && diskIo->canSubmit()) {
+        const int len = static_cast<int>(qMin(range.zeroEnd - range.zeroOffset, static_cast<qint64>(connection->getMaxRecordBytes())));
+        QByteArray buffer(acquireWriteBuffer(connection, len));
+        memset(buffer.data(), 0, static_cast<size_t>(len));
+        submitWrite(connection, file, range.zeroOffset, buffer, len, false);
+        range.zeroOffset += len;
+    }
+    if (range.zeroOffset < range.zeroEnd)
+        return;
+
+    const qint64 holeLength = range.holeLength;
+    range.holeLength = 0;
+    if (file->checkpoint != nullptr) {
+        checkpointChunks(&range, nullptr, holeLength, file->pendingWrites.isEmpty() ? 0 : file->pendingWrites.lastKey());
+        writesCompleted(file);
+        if (failed)
+            return;
+    }
+    if (hasTrailers()) {
+        QByteArray hash(Protocol::DIGEST_BYTES, 0);
+        crypto_generichash_final(&range.hashState, reinterpret_cast<unsigned char *>(hash.data()), Protocol::DIGEST_BYTES);
+        file->digest.addPiece(range.start, range.offset - range.start, hash);
+        file->digest.addPiece(range.offset, holeLength, QByteArray());
+        crypto_generichash_init(&range.hashState, nullptr, 0, Protocol::DIGEST_BYTES);
+        range.start = range.offset + holeLength;
+    }
+    advanceRecvRange(connection, &range, holeLength);
+}
+
+// The range is removed once it is done, so it must not be used afterwards.
+void TransferEngine::advanceRecvRange(Connection *connection, RecvRange *range, qint64 length)
+{
+    RecvFile *file = range->file;
+    range->offset += length;
+    range->remaining -= length;
+    if (range->remaining == 0) {
+        if (hasTrailers()) {
+            QByteArray hash(Protocol::DIGEST_BYTES, 0);
+            crypto_generichash_final(&range->hashState, reinterpret_cast<unsigned char *>(hash.data()), Protocol::DIGEST_BYTES);
+            file->digest.addPiece(range->start, range->offset - range->start, hash);
+        }
+        recvRanges.remove(connection);
+    }
+
+    file->bytesRecved += length;
+    recvBytesDone += length;
+    scheduleUpdate(UPDATE_RECV_PROGRESS);
+    checkRecvFile(file);
+}
+
+void TransferEngine::serverNewConnection()
+{
+    while (server != nullptr && server->hasPendingConnections())
+        addStream(server->nextPendingConnection());
+}
+
+void TransferEngine::addStream(QTcpSocket *socket)
+{
+    if (failed || connections.length() >= streams) {
+        socket->abort();
+        socket->deleteLater();
+        return;
+    }
+    addConnection(socket, Connection::SERVER, false)->start(localHello(0));
+}
+
+void TransferEngine::connectionHelloReceived(const Protocol::Hello &hello)
+{
+    Connection *connection = qobject_cast<Connection *>(sender());
+    Protocol::Hello reply(hello);
+
+    if (connection == connections.first()) {
+        sessionId = hello.sessionId;
+        streams = sessionId.isEmpty() ? 1 : qMin(hello.streams, qBound(1, options.streams, static_cast<int>(Protocol::MAX_STREAMS)));
+    } else if (hello.sessionId != sessionId || hello.streamIndex <= 0 || hello.streamIndex >= streams) {
+        connections.removeOne(connection);
+        connection->close();
+        connection->deleteLater();
+        return;
+    }
+
+    reply.streams = streams;
+    connection->acceptHello(reply);
+}
+
+void TransferEngine::connectionHandshakeFinished()
+{
+    Connection *connection = qobject_cast<Connection *>(sender());
+
+    if (connection == connections.first()) {
+        resumable = connection->getProtocolVersion() >= 3;
+        announceSendJobs();
+        if (connection->getProtocolVersion() < 2)
+            streams = 1;
+        else if (options.client)
+            streams = qBound(1, connection->getPeerHello().streams, static_cast<int>(Protocol::MAX_STREAMS));
+        emit protocolNegotiated(connection->getProtocolVersion(), connection->getFrameSize(), streams,
+                                (connection->getFeatures() & Protocol::FEATURE_COMPRESSION) != 0);
+        if (options.client)
+            openExtraStreams();
+    }
+
+    if (connections.length() >= streams)
+        closeServer();
+}
+
+void TransferEngine::connectionRecordReceived(int type, const char *data, int length)
+{
+    Connection *connection = qobject_cast<Connection *>(sender());
+
+    switch (type) {
+    case Protocol::METADATA:
+        processMetadata(connection, data, length);
+        break;
+    case Protocol::DATA:
+        processContent(connection, data, length);
+        break;
+    case Protocol::HOLE:
+        processHole(connection, data, length);
+        break;
+    case Protocol::OFFER:
+        processOffer(connection, data, length);
+        break;
+    case Protocol::RESUME:
+        processResume(connection, data, length);
+        break;
+    case Protocol::INDEX:
+        processIndex(connection, data, length);
+        break;
+    case Protocol::COPY:
+        processCopies(connection, data, length);
+        break;
+    case Protocol::BATCH:
+        processBatch(connection, data, length);
+        break;
+    case Protocol::TRAILER:
+        processTrailer(connection, data, length);
+        break;
+    case Protocol::ACK:
+        processAck(connection, data, length);
+        break;
+    default:
+        fail(QString("Unknown record type: %1").arg(type));
+        break;
+    }
+    // The disk catches up before more records are taken, diskCompleted()
+    // lets them through again.
+    if (!failed && (!diskIo->canSubmit() || hasDiskTask(connection)))
+        connection->pauseRecords();
+}
+
+void TransferEngine::connectionReadyToSend()
+{
+    fillConnection(qobject_cast<Connection *>(sender()));
+    checkIdle();
+}
+
+void TransferEngine::connectionFileRecordHashed(const QByteArray &hash)
+{
+    Connection *connection = qobject_cast<Connection *>(sender());
+    if (failed || !pendingHashes.contains(connection))
+        return;
+
+    QQueue<PendingHash> &queue = pendingHashes[connection];
+    const PendingHash pending(queue.dequeue());
+    if (queue.isEmpty())
+        pendingHashes.remove(connection);
+    SendJob *job = sendJobs[pending.jobIndex];
+    job->finishDigestPiece(pending.offset, pending.length, hash);
+    if (job->isDone() && job->isDigestReady())
+        sendTrailer(connection, pending.jobIndex);
+    checkIdle();
+}
+
+void TransferEngine::connectionErrorOccurred(const QString &message)
+{
+    fail(message);
+}
+
+void TransferEngine::diskCompleted()
+{
+    reapWrites();
+    continueDiskTasks();
+    fillConnections();
+}
+
+void TransferEngine::connectionDisconnected()
+{
+    if (failed)
+        return;
+    failed = true;
+    closeServer();
+    foreach (Connection *connection, connections)
+        connection->close();
+    emit disconnected();
+}
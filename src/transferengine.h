@@ -0,0 +1,279 @@
+#ifndef TRANSFERENGINE_H
+#define TRANSFERENGINE_H
+
+#include <QDir>
+#include <QFile>
+#include <QHash>
+#include <QMap>
+#include <QObject>
+#include <QQueue>
+#include <QStringList>
+#include <QTcpServer>
+#include <QTcpSocket>
+#include <QTimer>
+#include <QVector>
+
+#include "bufferpool.h"
+#include "checkpoint.h"
+#include "chunkindex.h"
+#include "connection.h"
+#include "crypto.h"
+#include "diskio.h"
+#include "filedigest.h"
+#include "metrics.h"
+#include "sendjob.h"
+
+class TransferEngine : public QObject {
+    Q_OBJECT
+public:
+    enum {
+        MAX_PRIORITY = 3
+    };
+    explicit TransferEngine(const QString &savePath, QTcpSocket *socket, QTcpServer *server, const TransferOptions &options, QObject *parent = nullptr);
+    ~TransferEngine();
+    bool isIdle() const;
+    bool isUnconfirmed() const;
+    qint64 getBytesSent() const;
+    qint64 getBytesReceived() const;
+    qint64 getCreditStallMsecs() const;
+    qint64 getWindowStallMsecs() const;
+    MetricsSnapshot getMetrics() const;
+public slots:
+    void start();
+    void addSendJobs(const QStringList &paths, const QStringList &filenames);
+    void shutdown();
+    void addStream(QTcpSocket *socket);
+    void setSendJobPriority(int index, int priority);
+signals:
+    void sendJobStarted(int index);
+    void sendJobFinished(int index);
+    void sendProgress(int percent);
+    void sendStatsChanged(const SendStats &stats);
+    void compressionStatsChanged(const CompressionStats &stats);
+    void copyStatsChanged(const CopyStats &stats);
+    void metricsChanged(const MetricsSnapshot &metrics);
+    void recvJobStarted(int id, const QString &filename);
+    void recvJobFinished(int id);
+    void recvProgress(int percent);
+    void protocolNegotiated(int version, int frameSize, int streams, bool compression);
+    void errorOccurred(const QString &message);
+    void disconnected();
+    void idle();
+private:
+    enum {
+        STRIPE_SIZE = 32 * 1024 * 1024,
+        SMALL_FILE_SIZE = 32 * 1024,
+        UPDATE_INTERVAL = 40,
+        SCHEDULE_WINDOW = 32,
+        SCHEDULE_SCAN = 1024,
+        SMALL_JOB_STREAK = 8,
+        ZERO_BLOCK = 64 * 1024
+    };
+    enum Update {
+        UPDATE_SEND_PROGRESS = 1,
+        UPDATE_RECV_PROGRESS = 2,
+        UPDATE_STATS = 4
+    };
+    // A hole in the file is queued with a ticket of 0.
+    struct PendingRead {
+        quint64 ticket;
+        int bufferOffset;
+        int length;
+    };
+    struct SendRange {
+        int jobIndex;
+        qint64 offset;
+        qint64 remaining;
+        bool metadataSent;
+        qint64 start;
+        bool hashed;
+        crypto_generichash_state hashState;
+        qint64 readOffset;
+        QQueue<PendingRead> reads;
+    };
+    // The files of a batch are read into buffers of their own and copied
+    // into the record once all of them are back.
+    struct PendingBatch {
+        QByteArray buffer;
+        int dataOffset;
+        int length;
+        QList<PendingRead> reads;
+        QList<int> jobIndexes;
+    };
+    struct PendingHash {
+        int jobIndex;
+        qint64 offset;
+        qint64 length;
+    };
+    struct PendingChunk {
+        quint64 ticket;
+        qint64 index;
+        QByteArray hash;
+    };
+    struct RecvFile {
+        quint32 fileId;
+        int id;
+        QString filename;
+        QFile file;
+        QFile basis;
+        QString targetPath;
+        Checkpoint *checkpoint;
+        qint64 fileSize;
+        qint64 resumedBytes;
+        qint64 bytesRecved;
+        FileDigest digest;
+        QByteArray trailer;
+        QVector<qint64> indexOffsets;
+        QMap<quint64, qint64> pendingWrites;
+        QList<PendingChunk> pendingChunks;
+        bool finishing;
+        bool synced;
+        ~RecvFile() { delete checkpoint; }
+    };
+    struct DiskWrite {
+        RecvFile *file;
+        Connection *connection;
+    };
+    // A hole that has to be written as zeros is done once zeroOffset reaches
+    // zeroEnd, with holeLength 0 when there is none.
+    struct RecvRange {
+        RecvFile *file;
+        qint64 offset;
+        qint64 remaining;
+        qint64 start;
+        crypto_generichash_state chunkState;
+        crypto_generichash_state hashState;
+        qint64 holeLength;
+        qint64 zeroOffset;
+        qint64 zeroEnd;
+    };
+    struct CopyTask {
+        RecvFile *file;
+        QVector<Protocol::Copy> copies;
+        int index;
+        qint64 done;
+        int readIndex;
+        qint64 readDone;
+        QQueue<PendingRead> reads;
+        int chunk;
+        crypto_generichash_state state;
+        QByteArray chunkHashes;
+    };
+    QDir saveDir;
+    TransferOptions options;
+    QTcpServer *server;
+    QByteArray sessionId;
+    int streams;
+    QVector<Connection *> connections;
+    QHash<Connection *, SendRange> sendRanges;
+    QHash<Connection *, PendingBatch> pendingBatches;
+    QHash<Connection *, RecvRange> recvRanges;
+    QHash<Connection *, CopyTask> copyTasks;
+    QHash<Connection *, QQueue<PendingHash> > pendingHashes;
+    QVector<SendJob *> sendJobs;
+    int firstUnassignedJob;
+    int nextAnnouncedJob;
+    int nextBatchJob;
+    int scheduledJob;
+    int smallJobStreak;
+    int acknowledgedJobs;
+    QHash<int, qint64> deficits;
+    QList<int> priorityJobs;
+    bool resumable;
+    qint64 sendBytesTotal;
+    qint64 sendBytesDone;
+    QHash<int, QVector<Protocol::IndexEntry> > peerIndexes;
+    QHash<quint32, RecvFile *> recvFiles;
+    DiskIo *diskIo;
+    BufferPool writePool;
+    QMap<quint64, DiskWrite> diskWrites;
+    CopyStats diskCopyStats;
+    quint32 nextV1FileId;
+    int nextRecvId;
+    qint64 recvBytesTotal;
+    qint64 recvBytesDone;
+    bool failed;
+    bool idleNotified;
+    int pendingUpdates;
+    QTimer *updateTimer;
+    QTimer *metricsTimer;
+    Connection *addConnection(QTcpSocket *socket, Connection::Role role, bool primary);
+    Protocol::Hello localHello(int streamIndex) const;
+    void openExtraStreams();
+    void closeServer();
+    void fail(const QString &message);
+    bool isDrained() const;
+    bool hasUnacknowledgedJobs() const;
+    void announceSendJobs();
+    void fillConnections();
+    void fillConnection(Connection *connection);
+    bool assignRange(Connection *connection);
+    bool isSchedulable(int jobIndex);
+    int scheduleJob();
+    void skipAssignedJobs();
+    bool isPackable(SendJob *job) const;
+    bool hasTrailers() const;
+    bool hasBatchJob();
+    bool readBatch(Connection *connection);
+    bool sendBatch(Connection *connection);
+    int getReadDepth() const;
+    bool readAhead(Connection *connection, SendRange *range, SendJob *job);
+    bool sendNextRecord(Connection *connection);
+    static int getZeroTail(const char *data, int length);
+    void sendHole(Connection *connection, SendRange *range, qint64 length);
+    void advanceSendRange(Connection *connection, SendRange *range, qint64 length);
+    void finishSendJob(Connection *connection, int jobIndex);
+    void sendTrailer(Connection *connection, int jobIndex);
+    void scheduleUpdate(int updates);
+    void emitUpdates();
+    void emitSendProgress();
+    void emitRecvProgress();
+    void emitSendStats();
+    void emitMetrics();
+    void checkIdle();
+    void resumeVerified(int jobIndex, qint64 offset, const QByteArray &hash, bool ok);
+    void deltaPlanned(int jobIndex, const DeltaPlan &plan);
+    QString getSavePath(const QString &filename);
+    RecvFile *newRecvFile(const Protocol::Metadata &metadata);
+    RecvFile *openRecvFile(const Protocol::Metadata &metadata, bool checkpointed, bool resume);
+    bool preallocate(QFile *file, qint64 size);
+    void openDeltaRecvFile(Connection *connection, const Protocol::Metadata &metadata);
+    void deltaIndexed(Connection *connection, quint32 fileId, const QVector<Protocol::IndexEntry> &index);
+    void checkRecvFile(RecvFile *file);
+    void finishRecvFile(RecvFile *file);
+    void checkpointChunks(RecvRange *range, const char *data, qint64 length, quint64 ticket);
+    QByteArray acquireWriteBuffer(Connection *connection, int length);
+    quint64 submitWrite(Connection *connection, RecvFile *file, qint64 offset, QByteArray &buffer, int length, bool credited);
+    quint64 writeBehind(Connection *connection, RecvFile *file, qint64 offset, const char *data, int length, bool credited = true);
+    void reapWrites();
+    void writesCompleted(RecvFile *file);
+    bool hasDiskTask(Connection *connection) const;
+    void continueDiskTasks();
+    void continueHole(Connection *connection);
+    void continueCopies(Connection *connection);
+    bool beginCopy(CopyTask *task);
+    bool finishCopy(CopyTask *task);
+    void processOffer(Connection *connection, const char *data, int length);
+    void resumeChecked(Connection *connection, RecvFile *file, const QVector<QByteArray> &hashes);
+    void processResume(Connection *connection, const char *data, int length);
+    void processIndex(Connection *connection, const char *data, int length);
+    void processCopies(Connection *connection, const char *data, int length);
+    void processBatch(Connection *connection, const char *data, int length);
+    void processTrailer(Connection *connection, const char *data, int length);
+    void processAck(Connection *connection, const char *data, int length);
+    void processMetadata(Connection *connection, const char *data, int length);
+    void processContent(Connection *connection, const char *data, int length);
+    void processHole(Connection *connection, const char *data, int length);
+    void advanceRecvRange(Connection *connection, RecvRange *range, qint64 length);
+    void serverNewConnection();
+    void connectionHelloReceived(const Protocol::Hello &hello);
+    void connectionHandshakeFinished();
+    void connectionRecordReceived(int type, const char *data, int length);
+    void connectionReadyToSend();
+    void connectionFileRecordHashed(const QByteArray &hash);
+    void connectionErrorOccurred(const QString &message);
+    void connectionDisconnected();
+    void diskCompleted();
+};
+
+#endif // TRANSFERENGINE_H
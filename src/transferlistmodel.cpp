@@ -0,0 +1,65 @@
+#include "transferlistmodel.h"
+
+#include <QFont>
+
+TransferListModel::TransferListModel(const QString &activeText, QObject *parent) :
+    QAbstractListModel(parent),
+    activeText(activeText)
+{
+}
+
+int TransferListModel::rowCount(const QModelIndex &parent) const
+{
+    return parent.isValid() ? 0 : filenames.length();
+}
+
+QVariant TransferListModel::data(const QModelIndex &index, int role) const
+{
+    if (!index.isValid() || index.row() >= filenames.length())
+        return QVariant();
+    if (role == Qt::FontRole && prioritized[index.row()]) {
+        QFont font;
+        font.setBold(true);
+        return font;
+    }
+    if (role != Qt::DisplayRole)
+        return QVariant();
+    const State state = states[index.row()];
+    return filenames[index.row()] + " - " + (state == DONE ? QString("Done") : state == ACTIVE ? activeText : QString("Waiting"));
+}
+
+int TransferListModel::append(const QStringList &filenames, State state)
+{
+    const int first = this->filenames.length();
+    if (filenames.isEmpty())
+        return first;
+    beginInsertRows(QModelIndex(), first, first + filenames.length() - 1);
+    this->filenames.append(filenames);
+    states.insert(states.end(), filenames.length(), state);
+    prioritized.insert(prioritized.end(), filenames.length(), false);
+    endInsertRows();
+    return first;
+}
+
+TransferListModel::State TransferListModel::getState(int row) const
+{
+    return states.value(row, DONE);
+}
+
+void TransferListModel::setState(int row, State state)
+{
+    if (row < 0 || row >= states.length() || states[row] == state)
+        return;
+    states[row] = state;
+    const QModelIndex changed(index(row));
+    emit dataChanged(changed, changed, QVector<int>() << Qt::DisplayRole);
+}
+
+void TransferListModel::setPrioritized(int row, bool prioritized)
+{
+    if (row < 0 || row >= this->prioritized.length() || this->prioritized[row] == prioritized)
+        return;
+    this->prioritized[row] = prioritized;
+    const QModelIndex changed(index(row));
+    emit dataChanged(changed, changed, QVector<int>() << Qt::FontRole);
+}
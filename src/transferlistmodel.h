@@ -0,0 +1,30 @@
+#ifndef TRANSFERLISTMODEL_H
+#define TRANSFERLISTMODEL_H
+
+#include <QAbstractListModel>
+#include <QStringList>
+#include <QVector>
+
+class TransferListModel : public QAbstractListModel {
+    Q_OBJECT
+public:
+    enum State {
+        WAITING,
+        ACTIVE,
+        DONE
+    };
+    explicit TransferListModel(const QString &activeText, QObject *parent = nullptr);
+    int rowCount(const QModelIndex &parent = QModelIndex()) const;
+    QVariant data(const QModelIndex &index, int role = Qt::DisplayRole) const;
+    int append(const QStringList &filenames, State state = WAITING);
+    State getState(int row) const;
+    void setState(int row, State state);
+    void setPrioritized(int row, bool prioritized);
+private:
+    QString activeText;
+    QStringList filenames;
+    QVector<State> states;
+    QVector<bool> prioritized;
+};
+
+#endif // TRANSFERLISTMODEL_H
@@ -0,0 +1,934 @@
+#include "udpsocket.h"
+
+#include <cstring>
+#include <limits>
+
+#include <sodium.h>
+
+#include "protocol.h"
+
+using namespace std;
+
+namespace {
+
+const double STARTUP_GAIN = 2.89;
+const double CWND_GAIN = 2;
+const double STARTUP_GROWTH = 1.25;
+const double PROBE_GAINS[] = {1.25, 0.75, 1, 1, 1, 1, 1, 1};
+const int PROBE_CYCLE = sizeof(PROBE_GAINS) / sizeof(PROBE_GAINS[0]);
+
+void xorInto(QByteArray *target, const QByteArray &source)
+{
+    if (target->size() < source.size())
+        target->append(QByteArray(source.size() - target->size(), 0));
+    char *data = target->data();
+    const char *other = source.constData();
+    for (int i = 0; i < source.size(); ++i)
+        data[i] ^= other[i];
+}
+
+}
+
+UdpSocket::UdpSocket(QObject *parent) :
+    QTcpSocket(parent),
+    udp(new QUdpSocket(this)),
+    pacingTimer(new QTimer(this)),
+    ackTimer(new QTimer(this)),
+    controlTimer(new QTimer(this)),
+    fecGroup(0)
+{
+    pacingTimer->setTimerType(Qt::PreciseTimer);
+    pacingTimer->setInterval(PACING_INTERVAL);
+    ackTimer->setTimerType(Qt::PreciseTimer);
+    ackTimer->setSingleShot(true);
+    ackTimer->setInterval(ACK_DELAY);
+    controlTimer->setInterval(CONTROL_INTERVAL);
+    connect(udp, &QUdpSocket::readyRead, this, &UdpSocket::udpReadyRead);
+    connect(pacingTimer, &QTimer::timeout, this, &UdpSocket::pump);
+    connect(ackTimer, &QTimer::timeout, this, &UdpSocket::sendAck);
+    connect(controlTimer, &QTimer::timeout, this, &UdpSocket::controlTimeout);
+    clock.start();
+    resetState();
+}
+
+UdpSocket::~UdpSocket()
+{
+    // QAbstractSocket aborts a live socket from its own destructor, after
+    // the overrides here are gone.
+    close();
+}
+
+bool UdpSocket::listen(const QHostAddress &address, quint16 port)
+{
+    if (state() != UnconnectedState)
+        return false;
+    resetState();
+    if (!bindUdp(address, port))
+        return false;
+    server = true;
+    setSocketState(ListeningState);
+    emit stateChanged(ListeningState);
+    return true;
+}
+
+void UdpSocket::setFecGroup(int packets)
+{
+    fecGroup = packets < 2 ? 0 : qMin(packets, static_cast<int>(MAX_FEC_GROUP));
+}
+
+UdpStats UdpSocket::getStats() const
+{
+    UdpStats ret = stats;
+    ret.pacingRate = getPacingRate() * 1e6;
+    ret.srttMsecs = srttUsecs / 1000.0;
+    return ret;
+}
+
+void UdpSocket::connectToHost(const QString &hostName, quint16 port, OpenMode openMode, NetworkLayerProtocol protocol)
+{
+    Q_UNUSED(openMode);
+    Q_UNUSED(protocol);
+    if (state() != UnconnectedState)
+        return;
+    resetState();
+    setPeerName(hostName);
+    setPeerPort(port);
+    setSocketState(HostLookupState);
+    emit stateChanged(HostLookupState);
+    const QHostAddress address(hostName);
+    if (address.isNull())
+        QHostInfo::lookupHost(hostName, this, SLOT(hostLookedUp(QHostInfo)));
+    else
+        startConnect(address);
+}
+
+void UdpSocket::disconnectFromHost()
+{
+    const SocketState current = state();
+    if (current == ConnectedState) {
+        closing = true;
+        setSocketState(ClosingState);
+        emit stateChanged(ClosingState);
+        // Finishes at once when everything written has been acknowledged.
+        pump();
+    } else if (current != ClosingState && current != UnconnectedState) {
+        close();
+    }
+}
+
+qint64 UdpSocket::bytesAvailable() const
+{
+    return readBuffer.size() - readOffset + QIODevice::bytesAvailable();
+}
+
+qint64 UdpSocket::bytesToWrite() const
+{
+    // Unacknowledged bytes still count, so a flushed connection really has
+    // delivered everything before it reports idle.
+    return sendBuffer.size() - sendOffset + unackedBytes;
+}
+
+void UdpSocket::close()
+{
+    const SocketState current = state();
+    if (current == ConnectedState || current == ClosingState)
+        sendFin();
+    if (current != UnconnectedState)
+        finish();
+    readBuffer.clear();
+    readOffset = 0;
+    QIODevice::close();
+}
+
+qint64 UdpSocket::readData(char *data, qint64 maxSize)
+{
+    const int available = readBuffer.size() - readOffset;
+    if (available == 0)
+        return state() == UnconnectedState ? -1 : 0;
+    const int length = static_cast<int>(qMin(maxSize, static_cast<qint64>(available)));
+    memcpy(data, readBuffer.constData() + readOffset, static_cast<size_t>(length));
+    readOffset += length;
+    if (readOffset == readBuffer.size()) {
+        readBuffer.clear();
+        readOffset = 0;
+    } else if (readOffset >= COMPACT_BYTES) {
+        readBuffer.remove(0, readOffset);
+        readOffset = 0;
+    }
+    if (advertisedWindow < RECV_BUFFER / 2 && getRecvWindow() >= RECV_BUFFER / 2)
+        sendAck();
+    return length;
+}
+
+qint64 UdpSocket::writeData(const char *data, qint64 maxSize)
+{
+    if (state() != ConnectedState)
+        return -1;
+    sendBuffer.append(data, static_cast<int>(maxSize));
+    if (!pacingTimer->isActive())
+        pacingTimer->start();
+    return maxSize;
+}
+
+qint64 UdpSocket::nowUsecs() const
+{
+    return clock.nsecsElapsed() / 1000;
+}
+
+void UdpSocket::resetState()
+{
+    connectionId = 0;
+    server = false;
+    closing = false;
+    readable = false;
+    peerFecGroup = 0;
+    lastHeardUsecs = 0;
+    lastSentUsecs = 0;
+    stats = UdpStats();
+
+    sendBuffer.clear();
+    sendOffset = 0;
+    nextSeq = 0;
+    unacked.clear();
+    lossQueue.clear();
+    inflightBytes = 0;
+    unackedBytes = 0;
+    peerWindow = RECV_BUFFER;
+    ackedEnd = 0;
+    delivered = 0;
+    deliveredUsecs = 0;
+    rtoUsecs = static_cast<qint64>(MIN_RTO) * 1000;
+    lastAckUsecs = 0;
+    fecParity.clear();
+    fecLengths = 0;
+    fecCount = 0;
+    fecSent = 0;
+
+    mode = STARTUP;
+    pacingGain = STARTUP_GAIN;
+    cycleIndex = 0;
+    cycleUsecs = 0;
+    budget = 0;
+    lastPaceUsecs = 0;
+    round = 0;
+    roundDelivered = 0;
+    bwSamples.clear();
+    fullBw = 0;
+    fullBwRounds = 0;
+    minRttUsecs = 0;
+    minRttStamp = 0;
+    srttUsecs = 0;
+
+    readBuffer.clear();
+    readOffset = 0;
+    recvNext = 0;
+    peerFinSeq = numeric_limits<quint64>::max();
+    outOfOrder.clear();
+    outOfOrderBytes = 0;
+    sackRanges.clear();
+    fecGroups.clear();
+    fecFloor = 0;
+    unackedPackets = 0;
+    advertisedWindow = RECV_BUFFER;
+}
+
+bool UdpSocket::bindUdp(const QHostAddress &address, quint16 port)
+{
+    if (!udp->bind(address, port)) {
+        setSocketError(udp->error());
+        setErrorString(udp->errorString());
+        return false;
+    }
+    udp->setSocketOption(QAbstractSocket::ReceiveBufferSizeSocketOption, SOCKET_BUFFER);
+    udp->setSocketOption(QAbstractSocket::SendBufferSizeSocketOption, SOCKET_BUFFER);
+    setLocalAddress(udp->localAddress());
+    setLocalPort(udp->localPort());
+    return true;
+}
+
+void UdpSocket::startConnect(const QHostAddress &address)
+{
+    const bool ipv6 = address.protocol() == QAbstractSocket::IPv6Protocol;
+    if (!bindUdp(ipv6 ? QHostAddress(QHostAddress::AnyIPv6) : QHostAddress(QHostAddress::AnyIPv4), 0)) {
+        fail(error(), errorString());
+        return;
+    }
+    connectionId = randombytes_random();
+    setPeerAddress(address);
+    setSocketState(ConnectingState);
+    emit stateChanged(ConnectingState);
+    lastHeardUsecs = nowUsecs();
+    sendHandshake(SYN);
+    controlTimer->start();
+}
+
+void UdpSocket::setConnected(const QHostAddress &address, quint16 port)
+{
+    setPeerAddress(address);
+    setPeerPort(port);
+    QIODevice::open(ReadWrite | Unbuffered);
+    setSocketState(ConnectedState);
+    const qint64 now = nowUsecs();
+    lastHeardUsecs = now;
+    lastPaceUsecs = now;
+    lastAckUsecs = now;
+    deliveredUsecs = now;
+    controlTimer->start();
+    emit stateChanged(ConnectedState);
+    emit connected();
+}
+
+QByteArray UdpSocket::newPacket(PacketType type, int bodyBytes) const
+{
+    QByteArray ret(HEADER_BYTES + bodyBytes, Qt::Uninitialized);
+    ret.data()[0] = static_cast<char>(type);
+    Protocol::putUInt32(ret.data() + 1, connectionId);
+    return ret;
+}
+
+void UdpSocket::sendDatagram(const QByteArray &datagram)
+{
+    // A full socket buffer drops the datagram like the network would, and
+    // the loss recovery resends it.
+    udp->writeDatagram(datagram, peerAddress(), peerPort());
+    lastSentUsecs = nowUsecs();
+    ++stats.packetsSent;
+}
+
+void UdpSocket::sendHandshake(PacketType type)
+{
+    QByteArray packet(newPacket(type, 2));
+    packet.data()[HEADER_BYTES] = static_cast<char>(VERSION);
+    packet.data()[HEADER_BYTES + 1] = static_cast<char>(fecGroup);
+    sendDatagram(packet);
+}
+
+void UdpSocket::sendData(quint64 seq, const QByteArray &payload)
+{
+    QByteArray packet(newPacket(DATA, DATA_HEADER_BYTES + payload.size()));
+    Protocol::putUInt64(packet.data() + HEADER_BYTES, seq);
+    memcpy(packet.data() + HEADER_BYTES + DATA_HEADER_BYTES, payload.constData(), static_cast<size_t>(payload.size()));
+    sendDatagram(packet);
+}
+
+void UdpSocket::sendFec()
+{
+    // Groups are aligned to multiples of the group size, so a partial group
+    // flushed while idle is simply covered again once it fills up.
+    QByteArray packet(newPacket(FEC, FEC_HEADER_BYTES + fecParity.size()));
+    char *data = packet.data() + HEADER_BYTES;
+    Protocol::putUInt64(data, (nextSeq - 1) / static_cast<quint64>(fecGroup) * static_cast<quint64>(fecGroup));
+    data[8] = static_cast<char>(fecCount);
+    Protocol::putUInt16(data + 9, fecLengths);
+    memcpy(data + FEC_HEADER_BYTES, fecParity.constData(), static_cast<size_t>(fecParity.size()));
+    sendDatagram(packet);
+    budget -= packet.size();
+    fecSent = fecCount;
+}
+
+void UdpSocket::sendFin()
+{
+    QByteArray packet(newPacket(FIN, 8));
+    Protocol::putUInt64(packet.data() + HEADER_BYTES, nextSeq);
+    sendDatagram(packet);
+}
+
+void UdpSocket::addFec(quint64 seq, const QByteArray &payload)
+{
+    if (fecGroup == 0)
+        return;
+    if (seq % static_cast<quint64>(fecGroup) == 0) {
+        fecParity.clear();
+        fecLengths = 0;
+        fecCount = 0;
+        fecSent = 0;
+    }
+    xorInto(&fecParity, payload);
+    fecLengths ^= static_cast<quint16>(payload.size());
+    if (++fecCount == fecGroup)
+        sendFec();
+}
+
+double UdpSocket::getMaxBw() const
+{
+    double ret = 0;
+    for (int i = 0; i < bwSamples.size(); ++i)
+        ret = qMax(ret, bwSamples[i].second);
+    return ret;
+}
+
+double UdpSocket::getPacingRate() const
+{
+    double bw = getMaxBw();
+    if (bw == 0)
+        bw = static_cast<double>(INITIAL_WINDOW * MAX_PAYLOAD) / qMax(srttUsecs, static_cast<qint64>(1000));
+    return pacingGain * bw;
+}
+
+qint64 UdpSocket::getBdp() const
+{
+    const double bw = getMaxBw();
+    if (bw == 0 || minRttUsecs == 0)
+        return static_cast<qint64>(INITIAL_WINDOW) * MAX_PAYLOAD;
+    return static_cast<qint64>(bw * minRttUsecs);
+}
+
+qint64 UdpSocket::getWindow() const
+{
+    const double gain = mode == STARTUP ? STARTUP_GAIN : CWND_GAIN;
+    const qint64 window = getMaxBw() == 0 ? static_cast<qint64>(INITIAL_WINDOW) * MAX_PAYLOAD : static_cast<qint64>(gain * getBdp());
+    return qMin(qBound(static_cast<qint64>(MIN_WINDOW) * MAX_PAYLOAD, window, static_cast<qint64>(MAX_WINDOW) * MAX_PAYLOAD), peerWindow);
+}
+
+// Packets held above a hole count against the window like unread data.
+qint64 UdpSocket::getRecvWindow() const
+{
+    return qMax(static_cast<qint64>(RECV_BUFFER) - (readBuffer.size() - readOffset) - outOfOrderBytes, static_cast<qint64>(0));
+}
+
+bool UdpSocket::isBeyondRecvBuffer(quint64 seq) const
+{
+    return seq >= recvNext + RECV_BUFFER / MAX_PAYLOAD;
+}
+
+void UdpSocket::updateModel(const RateSample &sample, qint64 now)
+{
+    deliveredUsecs = now;
+    // Resent packets give no RTT sample, their ack is ambiguous.
+    if (!sample.retransmitted) {
+        const qint64 rtt = qMax(now - sample.sentUsecs, static_cast<qint64>(1));
+        srttUsecs = srttUsecs == 0 ? rtt : (7 * srttUsecs + rtt) / 8;
+        if (minRttUsecs == 0 || rtt <= minRttUsecs || now - minRttStamp > static_cast<qint64>(MIN_RTT_WINDOW) * 1000) {
+            minRttUsecs = rtt;
+            minRttStamp = now;
+        }
+    }
+    rtoUsecs = qMax(3 * srttUsecs, static_cast<qint64>(MIN_RTO) * 1000);
+
+    bool roundStart = false;
+    if (sample.delivered >= roundDelivered) {
+        roundDelivered = delivered;
+        ++round;
+        roundStart = true;
+    }
+
+    const qint64 interval = now - sample.deliveredUsecs;
+    if (interval > 0) {
+        const double bw = static_cast<double>(delivered - sample.delivered) / interval;
+        // Samples taken while the writer had nothing queued only show what it
+        // asked for, so they may raise the estimate but never hold it down.
+        if (!sample.appLimited || bw >= getMaxBw()) {
+            if (!bwSamples.isEmpty() && bwSamples.last().first == round)
+                bwSamples.last().second = qMax(bwSamples.last().second, bw);
+            else
+                bwSamples.append(qMakePair(round, bw));
+        }
+        while (!bwSamples.isEmpty() && bwSamples.first().first + BW_WINDOW_ROUNDS < round)
+            bwSamples.removeFirst();
+    }
+
+    const double maxBw = getMaxBw();
+    if (mode == STARTUP && roundStart) {
+        if (maxBw >= fullBw * STARTUP_GROWTH) {
+            fullBw = maxBw;
+            fullBwRounds = 0;
+        } else if (++fullBwRounds >= STARTUP_ROUNDS) {
+            mode = DRAIN;
+            pacingGain = 1 / STARTUP_GAIN;
+        }
+    }
+    if (mode == DRAIN && inflightBytes <= getBdp()) {
+        mode = PROBE_BW;
+        cycleIndex = 0;
+        cycleUsecs = now;
+        pacingGain = PROBE_GAINS[0];
+    }
+    if (mode == PROBE_BW && now - cycleUsecs > minRttUsecs) {
+        cycleIndex = (cycleIndex + 1) % PROBE_CYCLE;
+        cycleUsecs = now;
+        pacingGain = PROBE_GAINS[cycleIndex];
+    }
+}
+
+void UdpSocket::detectLosses(qint64 now)
+{
+    // A packet is lost once three packets sent after it have arrived, or once
+    // it is overdue by a quarter of a round trip. Resent packets only have the
+    // timer, their sequence number is older than everything around them.
+    const qint64 overdue = srttUsecs + srttUsecs / 4;
+    for (QMap<quint64, SentPacket>::iterator it = unacked.begin(); it != unacked.end() && it.key() < ackedEnd; ++it) {
+        SentPacket &packet = it.value();
+        if (packet.lost)
+            continue;
+        const bool late = srttUsecs > 0 && now - packet.sentUsecs > overdue;
+        if (late || (!packet.retransmitted && it.key() + REORDER_THRESHOLD < ackedEnd)) {
+            packet.lost = true;
+            inflightBytes -= packet.payload.size();
+            lossQueue.append(it.key());
+        } else if (!packet.retransmitted) {
+            break;
+        }
+    }
+}
+
+void UdpSocket::pump()
+{
+    const SocketState current = state();
+    if (current != ConnectedState && current != ClosingState) {
+        pacingTimer->stop();
+        return;
+    }
+
+    const qint64 now = nowUsecs();
+    const double rate = getPacingRate();
+    budget = qMin(budget + rate * (now - lastPaceUsecs), qMax(rate * BURST_USECS, 2.0 * MAX_DATAGRAM));
+    lastPaceUsecs = now;
+
+    const qint64 window = getWindow();
+    bool windowLimited = false;
+    while (budget > 0) {
+        if (inflightBytes > 0 && inflightBytes + MAX_PAYLOAD > window) {
+            windowLimited = true;
+            break;
+        }
+        if (unacked.isEmpty())
+            lastAckUsecs = now;
+        if (!lossQueue.isEmpty()) {
+            QMap<quint64, SentPacket>::iterator it = unacked.find(lossQueue.takeFirst());
+            if (it == unacked.end() || !it.value().lost)
+                continue;
+            SentPacket &packet = it.value();
+            packet.sentUsecs = now;
+            packet.delivered = delivered;
+            packet.deliveredUsecs = deliveredUsecs;
+            packet.retransmitted = true;
+            packet.lost = false;
+            inflightBytes += packet.payload.size();
+            sendData(it.key(), packet.payload);
+            ++stats.retransmits;
+            budget -= HEADER_BYTES + DATA_HEADER_BYTES + packet.payload.size();
+            continue;
+        }
+        const int pending = sendBuffer.size() - sendOffset;
+        if (pending == 0)
+            break;
+        const int length = qMin(pending, static_cast<int>(MAX_PAYLOAD));
+        SentPacket packet;
+        packet.payload = sendBuffer.mid(sendOffset, length);
+        packet.sentUsecs = now;
+        packet.delivered = delivered;
+        packet.deliveredUsecs = deliveredUsecs;
+        packet.retransmitted = false;
+        packet.appLimited = length == pending;
+        packet.lost = false;
+        sendOffset += length;
+        const quint64 seq = nextSeq++;
+        unacked.insert(seq, packet);
+        inflightBytes += length;
+        unackedBytes += length;
+        sendData(seq, packet.payload);
+        budget -= HEADER_BYTES + DATA_HEADER_BYTES + length;
+        addFec(seq, packet.payload);
+    }
+
+    if (sendOffset == sendBuffer.size()) {
+        sendBuffer.clear();
+        sendOffset = 0;
+        if (fecCount > fecSent)
+            sendFec();
+    } else if (sendOffset >= COMPACT_BYTES) {
+        sendBuffer.remove(0, sendOffset);
+        sendOffset = 0;
+    }
+
+    if (closing && sendBuffer.isEmpty() && unacked.isEmpty()) {
+        for (int i = 0; i < FIN_COPIES; ++i)
+            sendFin();
+        finish();
+        return;
+    }
+
+    // Acks restart a window-limited sender, the timer only paces.
+    const bool busy = !windowLimited && (!lossQueue.isEmpty() || sendOffset < sendBuffer.size());
+    if (!busy)
+        pacingTimer->stop();
+    else if (!pacingTimer->isActive())
+        pacingTimer->start();
+}
+
+void UdpSocket::sendAck()
+{
+    const SocketState current = state();
+    if (current != ConnectedState && current != ClosingState)
+        return;
+    ackTimer->stop();
+    unackedPackets = 0;
+
+    // The first ranges locate the oldest holes, the last one the newest
+    // arrival that the loss detection counts from.
+    const int count = qMin(sackRanges.size(), static_cast<int>(MAX_SACK_RANGES));
+    QByteArray packet(newPacket(ACK, ACK_HEADER_BYTES + 16 * count));
+    char *data = packet.data() + HEADER_BYTES;
+    advertisedWindow = getRecvWindow();
+    Protocol::putUInt64(data, recvNext);
+    Protocol::putUInt32(data + 8, static_cast<quint32>(advertisedWindow));
+    data[12] = static_cast<char>(count);
+    data += ACK_HEADER_BYTES;
+    QMap<quint64, quint64>::const_iterator it = sackRanges.constBegin();
+    for (int i = 0; i < count; ++i, ++it) {
+        if (i == count - 1)
+            it = sackRanges.constEnd() - 1;
+        Protocol::putUInt64(data, it.key());
+        Protocol::putUInt64(data + 8, it.value());
+        data += 16;
+    }
+    sendDatagram(packet);
+}
+
+void UdpSocket::controlTimeout()
+{
+    const qint64 now = nowUsecs();
+    const SocketState current = state();
+    if (current == ConnectingState) {
+        if (now - lastHeardUsecs > static_cast<qint64>(IDLE_TIMEOUT) * 1000)
+            fail(SocketTimeoutError, "Connection timed out");
+        else if (now - lastSentUsecs >= static_cast<qint64>(HANDSHAKE_INTERVAL) * 1000)
+            sendHandshake(SYN);
+        return;
+    }
+    if (current != ConnectedState && current != ClosingState)
+        return;
+
+    if (now - lastHeardUsecs > static_cast<qint64>(IDLE_TIMEOUT) * 1000) {
+        fail(SocketTimeoutError, "The peer stopped responding");
+        return;
+    }
+    if (!unacked.isEmpty() && now - lastAckUsecs > rtoUsecs) {
+        // Nothing came back for a whole timeout: resend everything in flight
+        // and back off until acks return.
+        for (QMap<quint64, SentPacket>::iterator it = unacked.begin(); it != unacked.end(); ++it) {
+            if (!it.value().lost) {
+                it.value().lost = true;
+                lossQueue.append(it.key());
+            }
+        }
+        inflightBytes = 0;
+        rtoUsecs = qMin(2 * rtoUsecs, static_cast<qint64>(MAX_RTO) * 1000);
+        lastAckUsecs = now;
+        pump();
+    }
+    if (now - lastSentUsecs >= static_cast<qint64>(KEEPALIVE_INTERVAL) * 1000)
+        sendAck();
+}
+
+void UdpSocket::udpReadyRead()
+{
+    char datagram[MAX_DATAGRAM];
+    int received = 0;
+    while (udp->hasPendingDatagrams()) {
+        if (++received > RECV_BATCH) {
+            // Let the pacing and ack timers run between batches.
+            QMetaObject::invokeMethod(this, "udpReadyRead", Qt::QueuedConnection);
+            break;
+        }
+        QHostAddress address;
+        quint16 port;
+        const qint64 length = udp->readDatagram(datagram, sizeof(datagram), &address, &port);
+        if (length < 0)
+            break;
+        processPacket(address, port, datagram, static_cast<int>(length));
+    }
+
+    if (readable) {
+        readable = false;
+        emit readyRead();
+    }
+    const SocketState current = state();
+    if (recvNext >= peerFinSeq && (current == ConnectedState || current == ClosingState))
+        finish();
+}
+
+void UdpSocket::processPacket(const QHostAddress &address, quint16 port, const char *data, int length)
+{
+    if (length < HEADER_BYTES)
+        return;
+    const int type = static_cast<quint8>(data[0]);
+    const quint32 id = Protocol::getUInt32(data + 1);
+    data += HEADER_BYTES;
+    length -= HEADER_BYTES;
+
+    const SocketState current = state();
+    if (current == ListeningState) {
+        if (type == SYN && length >= 2 && static_cast<quint8>(data[0]) == VERSION) {
+            connectionId = id;
+            peerFecGroup = qMin(static_cast<int>(static_cast<quint8>(data[1])), static_cast<int>(MAX_FEC_GROUP));
+            setPeerAddress(address);
+            setPeerPort(port);
+            sendHandshake(SYN_ACK);
+            setConnected(address, port);
+        }
+        return;
+    }
+    if (id != connectionId || (server && (port != peerPort() || !address.isEqual(peerAddress()))))
+        return;
+    lastHeardUsecs = nowUsecs();
+
+    const bool open = current == ConnectedState || current == ClosingState;
+    switch (type) {
+    case SYN:
+        if (server && open)
+            sendHandshake(SYN_ACK);
+        break;
+    case SYN_ACK:
+        if (current == ConnectingState && length >= 2 && static_cast<quint8>(data[0]) == VERSION) {
+            peerFecGroup = qMin(static_cast<int>(static_cast<quint8>(data[1])), static_cast<int>(MAX_FEC_GROUP));
+            setConnected(address, port);
+        }
+        break;
+    case DATA:
+        if (open && length > DATA_HEADER_BYTES && length - DATA_HEADER_BYTES <= MAX_PAYLOAD)
+            processData(Protocol::getUInt64(data), QByteArray(data + DATA_HEADER_BYTES, length - DATA_HEADER_BYTES));
+        break;
+    case ACK:
+        if (open)
+            processAck(data, length);
+        break;
+    case FEC:
+        if (open)
+            processFec(data, length);
+        break;
+    case FIN:
+        if (open && length >= 8)
+            peerFinSeq = Protocol::getUInt64(data);
+        break;
+    }
+}
+
+void UdpSocket::processData(quint64 seq, const QByteArray &payload)
+{
+    if (seq < recvNext || outOfOrder.contains(seq)) {
+        // Our ack went missing, repeat it.
+        sendAck();
+        return;
+    }
+    // Never advertised, the sender resends it once the hole is filled.
+    if (isBeyondRecvBuffer(seq))
+        return;
+    const bool inOrder = seq == recvNext;
+    deliver(seq, payload);
+    trackFec(seq, payload);
+    if (!inOrder || !outOfOrder.isEmpty() || ++unackedPackets >= ACK_EVERY)
+        sendAck();
+    else if (!ackTimer->isActive())
+        ackTimer->start();
+}
+
+void UdpSocket::processAck(const char *data, int length)
+{
+    if (length < ACK_HEADER_BYTES)
+        return;
+    const quint64 cumulative = Protocol::getUInt64(data);
+    const int count = static_cast<quint8>(data[12]);
+    if (cumulative > nextSeq || length < ACK_HEADER_BYTES + 16 * count)
+        return;
+    peerWindow = Protocol::getUInt32(data + 8);
+
+    qint64 ackedBytes = 0;
+    RateSample sample = RateSample();
+    while (!unacked.isEmpty() && unacked.firstKey() < cumulative)
+        acknowledge(unacked.begin(), &ackedBytes, &sample);
+    ackedEnd = qMax(ackedEnd, cumulative);
+    for (int i = 0; i < count; ++i) {
+        const char *range = data + ACK_HEADER_BYTES + 16 * i;
+        const quint64 start = Protocol::getUInt64(range);
+        const quint64 end = Protocol::getUInt64(range + 8);
+        if (start >= end || end > nextSeq)
+            continue;
+        QMap<quint64, SentPacket>::iterator it = unacked.lowerBound(start);
+        while (it != unacked.end() && it.key() < end)
+            it = acknowledge(it, &ackedBytes, &sample);
+        ackedEnd = qMax(ackedEnd, end);
+    }
+
+    const qint64 now = nowUsecs();
+    if (sample.valid) {
+        lastAckUsecs = now;
+        updateModel(sample, now);
+    }
+    detectLosses(now);
+    if (ackedBytes > 0)
+        emit bytesWritten(ackedBytes);
+    pump();
+}
+
+void UdpSocket::processFec(const char *data, int length)
+{
+    if (peerFecGroup == 0 || length <= FEC_HEADER_BYTES || length - FEC_HEADER_BYTES > MAX_PAYLOAD)
+        return;
+    const quint64 first = Protocol::getUInt64(data);
+    const int count = static_cast<quint8>(data[8]);
+    const quint64 group = static_cast<quint64>(peerFecGroup);
+    if (first % group != 0 || count < 1 || count > peerFecGroup || first + static_cast<quint64>(count) <= recvNext
+            || isBeyondRecvBuffer(first))
+        return;
+    const quint64 index = first / group;
+    if (index < fecFloor)
+        return;
+    FecGroup &fec = fecGroups[index];
+    if (count <= fec.parityCount)
+        return;
+    fec.parity = QByteArray(data + FEC_HEADER_BYTES, length - FEC_HEADER_BYTES);
+    fec.parityLengths = Protocol::getUInt16(data + 9);
+    fec.parityCount = count;
+    if (recoverFec(index))
+        sendAck();
+}
+
+QMap<quint64, UdpSocket::SentPacket>::iterator UdpSocket::acknowledge(QMap<quint64, SentPacket>::iterator it, qint64 *ackedBytes, RateSample *sample)
+{
+    const SentPacket &packet = it.value();
+    const qint64 length = packet.payload.size();
+    if (!packet.lost)
+        inflightBytes -= length;
+    unackedBytes -= length;
+    delivered += length;
+    *ackedBytes += length;
+    if (!sample->valid || packet.delivered > sample->delivered) {
+        sample->valid = true;
+        sample->delivered = packet.delivered;
+        sample->deliveredUsecs = packet.deliveredUsecs;
+        sample->sentUsecs = packet.sentUsecs;
+        sample->retransmitted = packet.retransmitted;
+        sample->appLimited = packet.appLimited;
+    }
+    return unacked.erase(it);
+}
+
+void UdpSocket::deliver(quint64 seq, const QByteArray &payload)
+{
+    if (seq != recvNext) {
+        outOfOrder.insert(seq, payload);
+        outOfOrderBytes += payload.size();
+        // Keep the received ranges above the hole merged for the acks.
+        QMap<quint64, quint64>::iterator next = sackRanges.lowerBound(seq + 1);
+        QMap<quint64, quint64>::iterator prev = next == sackRanges.begin() ? sackRanges.end() : next - 1;
+        const bool joinsNext = next != sackRanges.end() && next.key() == seq + 1;
+        if (prev != sackRanges.end() && prev.value() == seq) {
+            prev.value() = joinsNext ? next.value() : seq + 1;
+            if (joinsNext)
+                sackRanges.erase(next);
+        } else if (joinsNext) {
+            const quint64 end = next.value();
+            sackRanges.erase(next);
+            sackRanges.insert(seq, end);
+        } else {
+            sackRanges.insert(seq, seq + 1);
+        }
+        return;
+    }
+
+    readBuffer.append(payload);
+    ++recvNext;
+    if (!sackRanges.isEmpty() && sackRanges.firstKey() == recvNext) {
+        const quint64 end = sackRanges.first();
+        sackRanges.erase(sackRanges.begin());
+        while (recvNext < end) {
+            const QByteArray packet = outOfOrder.take(recvNext++);
+            outOfOrderBytes -= packet.size();
+            readBuffer.append(packet);
+        }
+    }
+    readable = true;
+    if (peerFecGroup > 0) {
+        while (fecFloor < recvNext / static_cast<quint64>(peerFecGroup))
+            fecGroups.remove(fecFloor++);
+    }
+}
+
+void UdpSocket::trackFec(quint64 seq, const QByteArray &payload)
+{
+    if (peerFecGroup == 0)
+        return;
+    const quint64 index = seq / static_cast<quint64>(peerFecGroup);
+    if (index < fecFloor)
+        return;
+    FecGroup &fec = fecGroups[index];
+    xorInto(&fec.data, payload);
+    fec.lengths ^= static_cast<quint16>(payload.size());
+    fec.received |= static_cast<quint32>(1) << (seq % static_cast<quint64>(peerFecGroup));
+    recoverFec(index);
+}
+
+bool UdpSocket::recoverFec(quint64 index)
+{
+    QHash<quint64, FecGroup>::iterator it = fecGroups.find(index);
+    if (it == fecGroups.end() || it.value().parityCount == 0)
+        return false;
+    FecGroup &fec = it.value();
+    const quint32 members = fec.parityCount == 32 ? ~static_cast<quint32>(0) : (static_cast<quint32>(1) << fec.parityCount) - 1;
+    const quint32 missing = members & ~fec.received;
+    // The parity repairs exactly one hole, and only over the packets it was
+    // computed from.
+    if ((fec.received & ~members) != 0 || missing == 0 || (missing & (missing - 1)) != 0)
+        return false;
+    int bit = 0;
+    while ((missing & (static_cast<quint32>(1) << bit)) == 0)
+        ++bit;
+    const int length = fec.parityLengths ^ fec.lengths;
+    if (length == 0 || length > fec.parity.size())
+        return false;
+
+    QByteArray payload(fec.parity.left(length));
+    char *data = payload.data();
+    const char *known = fec.data.constData();
+    for (int i = 0; i < qMin(length, fec.data.size()); ++i)
+        data[i] ^= known[i];
+    xorInto(&fec.data, payload);
+    fec.lengths ^= static_cast<quint16>(length);
+    fec.received |= missing;
+    ++stats.fecRecovered;
+    const quint64 seq = index * static_cast<quint64>(peerFecGroup) + static_cast<quint64>(bit);
+    if (seq >= recvNext && !outOfOrder.contains(seq) && !isBeyondRecvBuffer(seq))
+        deliver(seq, payload);
+    return true;
+}
+
+void UdpSocket::fail(SocketError socketError, const QString &message)
+{
+    setSocketError(socketError);
+    setErrorString(message);
+    emit error(socketError);
+    if (state() != UnconnectedState)
+        finish();
+}
+
+void UdpSocket::finish()
+{
+    const SocketState current = state();
+    pacingTimer->stop();
+    ackTimer->stop();
+    controlTimer->stop();
+    udp->close();
+    closing = false;
+    sendBuffer.clear();
+    sendOffset = 0;
+    unacked.clear();
+    lossQueue.clear();
+    inflightBytes = 0;
+    unackedBytes = 0;
+    setSocketState(UnconnectedState);
+    emit stateChanged(UnconnectedState);
+    if (current == ConnectedState || current == ClosingState)
+        emit disconnected();
+}
+
+void UdpSocket::hostLookedUp(const QHostInfo &info)
+{
+    if (state() != HostLookupState)
+        return;
+    if (info.error() != QHostInfo::NoError || info.addresses().isEmpty()) {
+        fail(HostNotFoundError, info.errorString());
+        return;
+    }
+    startConnect(info.addresses().first());
+}
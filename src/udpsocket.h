@@ -0,0 +1,219 @@
+#ifndef UDPSOCKET_H
+#define UDPSOCKET_H
+
+#include <QByteArray>
+#include <QElapsedTimer>
+#include <QHash>
+#include <QHostAddress>
+#include <QHostInfo>
+#include <QList>
+#include <QMap>
+#include <QPair>
+#include <QTcpSocket>
+#include <QTimer>
+#include <QUdpSocket>
+#include <QVector>
+
+struct UdpStats {
+    quint64 packetsSent;
+    quint64 retransmits;
+    quint64 fecRecovered;
+    double pacingRate;
+    double srttMsecs;
+};
+
+// A reliable byte stream over UDP for lossy links with a long round trip. It
+// stands in for a QTcpSocket, so connections carry the same frames over it
+// unchanged. Sending is paced at a rate estimated from delivery samples,
+// losses are found from selective acknowledgements, and each group of
+// packets can carry an XOR parity packet that repairs one loss without a
+// round trip.
+class UdpSocket : public QTcpSocket {
+    Q_OBJECT
+public:
+    enum {
+        MAX_FEC_GROUP = 32
+    };
+    explicit UdpSocket(QObject *parent = nullptr);
+    ~UdpSocket();
+    bool listen(const QHostAddress &address, quint16 port);
+    void setFecGroup(int packets);
+    UdpStats getStats() const;
+    void connectToHost(const QString &hostName, quint16 port, OpenMode openMode = ReadWrite, NetworkLayerProtocol protocol = AnyIPProtocol);
+    void disconnectFromHost();
+    qint64 bytesAvailable() const;
+    qint64 bytesToWrite() const;
+    void close();
+protected:
+    qint64 readData(char *data, qint64 maxSize);
+    qint64 writeData(const char *data, qint64 maxSize);
+private:
+    enum PacketType {
+        SYN = 1,
+        SYN_ACK = 2,
+        DATA = 3,
+        ACK = 4,
+        FEC = 5,
+        FIN = 6
+    };
+    enum Mode {
+        STARTUP,
+        DRAIN,
+        PROBE_BW
+    };
+    enum {
+        VERSION = 1,
+        HEADER_BYTES = 5,
+        DATA_HEADER_BYTES = 8,
+        ACK_HEADER_BYTES = 13,
+        FEC_HEADER_BYTES = 11,
+        MAX_PAYLOAD = 1200,
+        MAX_DATAGRAM = HEADER_BYTES + FEC_HEADER_BYTES + MAX_PAYLOAD,
+        MAX_SACK_RANGES = 32,
+        INITIAL_WINDOW = 32,
+        MIN_WINDOW = 4,
+        MAX_WINDOW = 65536,
+        REORDER_THRESHOLD = 3,
+        ACK_EVERY = 2,
+        ACK_DELAY = 5,
+        PACING_INTERVAL = 1,
+        BURST_USECS = 2000,
+        CONTROL_INTERVAL = 10,
+        HANDSHAKE_INTERVAL = 250,
+        KEEPALIVE_INTERVAL = 1000,
+        IDLE_TIMEOUT = 15000,
+        MIN_RTO = 200,
+        MAX_RTO = 10000,
+        FIN_COPIES = 3,
+        BW_WINDOW_ROUNDS = 10,
+        STARTUP_ROUNDS = 3,
+        MIN_RTT_WINDOW = 10000,
+        RECV_BATCH = 256,
+        RECV_BUFFER = 64 * 1024 * 1024,
+        SOCKET_BUFFER = 8 * 1024 * 1024,
+        COMPACT_BYTES = 1024 * 1024
+    };
+    struct SentPacket {
+        QByteArray payload;
+        qint64 sentUsecs;
+        qint64 delivered;
+        qint64 deliveredUsecs;
+        bool retransmitted;
+        bool appLimited;
+        bool lost;
+    };
+    struct RateSample {
+        bool valid;
+        qint64 delivered;
+        qint64 deliveredUsecs;
+        qint64 sentUsecs;
+        bool retransmitted;
+        bool appLimited;
+    };
+    struct FecGroup {
+        QByteArray data;
+        quint16 lengths;
+        quint32 received;
+        QByteArray parity;
+        quint16 parityLengths;
+        int parityCount;
+    };
+    QUdpSocket *udp;
+    QTimer *pacingTimer;
+    QTimer *ackTimer;
+    QTimer *controlTimer;
+    QElapsedTimer clock;
+    int fecGroup;
+    quint32 connectionId;
+    bool server;
+    bool closing;
+    bool readable;
+    int peerFecGroup;
+    qint64 lastHeardUsecs;
+    qint64 lastSentUsecs;
+    UdpStats stats;
+
+    QByteArray sendBuffer;
+    int sendOffset;
+    quint64 nextSeq;
+    QMap<quint64, SentPacket> unacked;
+    QList<quint64> lossQueue;
+    qint64 inflightBytes;
+    qint64 unackedBytes;
+    qint64 peerWindow;
+    quint64 ackedEnd;
+    qint64 delivered;
+    qint64 deliveredUsecs;
+    qint64 rtoUsecs;
+    qint64 lastAckUsecs;
+    QByteArray fecParity;
+    quint16 fecLengths;
+    int fecCount;
+    int fecSent;
+
+    Mode mode;
+    double pacingGain;
+    int cycleIndex;
+    qint64 cycleUsecs;
+    double budget;
+    qint64 lastPaceUsecs;
+    qint64 round;
+    qint64 roundDelivered;
+    QVector<QPair<qint64, double> > bwSamples;
+    double fullBw;
+    int fullBwRounds;
+    qint64 minRttUsecs;
+    qint64 minRttStamp;
+    qint64 srttUsecs;
+
+    QByteArray readBuffer;
+    int readOffset;
+    quint64 recvNext;
+    quint64 peerFinSeq;
+    QMap<quint64, QByteArray> outOfOrder;
+    qint64 outOfOrderBytes;
+    QMap<quint64, quint64> sackRanges;
+    QHash<quint64, FecGroup> fecGroups;
+    quint64 fecFloor;
+    int unackedPackets;
+    qint64 advertisedWindow;
+
+    qint64 nowUsecs() const;
+    void resetState();
+    bool bindUdp(const QHostAddress &address, quint16 port);
+    void startConnect(const QHostAddress &address);
+    void setConnected(const QHostAddress &address, quint16 port);
+    QByteArray newPacket(PacketType type, int bodyBytes) const;
+    void sendDatagram(const QByteArray &datagram);
+    void sendHandshake(PacketType type);
+    void sendData(quint64 seq, const QByteArray &payload);
+    void sendFec();
+    void sendFin();
+    void addFec(quint64 seq, const QByteArray &payload);
+    double getMaxBw() const;
+    double getPacingRate() const;
+    qint64 getBdp() const;
+    qint64 getWindow() const;
+    qint64 getRecvWindow() const;
+    bool isBeyondRecvBuffer(quint64 seq) const;
+    void updateModel(const RateSample &sample, qint64 now);
+    void detectLosses(qint64 now);
+    void processPacket(const QHostAddress &address, quint16 port, const char *data, int length);
+    void processData(quint64 seq, const QByteArray &payload);
+    void processAck(const char *data, int length);
+    void processFec(const char *data, int length);
+    QMap<quint64, SentPacket>::iterator acknowledge(QMap<quint64, SentPacket>::iterator it, qint64 *ackedBytes, RateSample *sample);
+    void deliver(quint64 seq, const QByteArray &payload);
+    void trackFec(quint64 seq, const QByteArray &payload);
+    bool recoverFec(quint64 index);
+    void fail(SocketError socketError, const QString &message);
+    void finish();
+private slots:
+    void udpReadyRead();
+    void pump();
+    void sendAck();
+    void controlTimeout();
+    void hostLookedUp(const QHostInfo &info);
+};
+
+#endif // UDPSOCKET_H